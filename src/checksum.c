@@ -0,0 +1,286 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/**
+ * @file checksum.c
+ * @brief integrity check of the messages, the implementation is chosen from the CPU features at runtime
+ * @author Li Jiliang<tjulijiliang@gmail.com
+ * @version 1.0
+ * @date 2011-11-09
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_DISPATCH
+#endif
+
+#include "checksum.h"
+#include "protocol.h"
+
+/* the Castagnoli polynomial, bit reflected */
+#define CRC32C_POLY	0x82F63B78
+
+typedef uint64_t (*Sum_func)(const unsigned char *p, size_t len);
+typedef uint32_t (*Crc_func)(uint32_t crc, const unsigned char *p, size_t len);
+
+static Sum_func sum_impl = NULL;
+static Crc_func crc_impl = NULL;
+static const char *impl_name = NULL;
+static uint32_t crc_table[256];
+
+static void select_impl();
+static uint64_t sum_scalar(const unsigned char *p, size_t len);
+static uint32_t crc32c_soft(uint32_t crc, const unsigned char *p, size_t len);
+#ifdef HAVE_X86_DISPATCH
+static uint64_t sum_avx2(const unsigned char *p, size_t len);
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len);
+#endif
+
+/**
+ * @brief compute the 16 bits ones' complement checksum
+ *
+ * @param addr message address
+ * @param len message length
+ *
+ * @return checksum
+ */
+u_short checksum(const void *addr, int len){
+	uint64_t sum;
+
+	if(sum_impl == NULL)
+		select_impl();
+	sum = sum_impl((const unsigned char *)addr, (size_t)len);
+
+	/* add carries from the top bits to the low 16 bits till none is left */
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return (u_short)~sum;
+}
+
+/**
+ * @brief compute the CRC32C of the buffer
+ *
+ * @param crc CRC32C of the preceding data, 0 for the first block
+ * @param buf address of the data
+ * @param len length of the data
+ *
+ * @return CRC32C
+ */
+unsigned crc32c(unsigned crc, const void *buf, size_t len){
+	if(crc_impl == NULL)
+		select_impl();
+	return ~crc_impl(~(uint32_t)crc, (const unsigned char *)buf, len);
+}
+
+/**
+ * @brief compute the CRC32C of a v2 message, which covers all but the check field
+ *
+ * @param buf the message
+ * @param len length of the message
+ *
+ * @return CRC32C
+ */
+unsigned message_crc32c(const void *buf, size_t len){
+	const unsigned char *p = (const unsigned char *)buf;
+	unsigned crc;
+
+	crc = crc32c(0, p, HAST3_V2_CHECK_OFFSET);
+	return crc32c(crc, p + HAST3_V2_HEADER_LEN, len - HAST3_V2_HEADER_LEN);
+}
+
+/**
+ * @brief verify the integrity of a received message of either format
+ *
+ * @param buf the message
+ * @param len length of the message
+ *
+ * @return 0 if the message is intact and -1 if not
+ */
+int verify_message(const void *buf, int len){
+	const unsigned char *p = (const unsigned char *)buf;
+	uint32_t stored;
+
+	if(len >= HAST3_V2_HEADER_LEN && p[0] == HAST3_V2_MAGIC0 &&
+			p[1] == HAST3_V2_MAGIC1 && (p[4] & HAST3_V2_FLAG_CRC32C)){
+		stored = (uint32_t)p[10] << 24 | (uint32_t)p[11] << 16 |
+			(uint32_t)p[12] << 8 | p[13];
+		return message_crc32c(p, (size_t)len) == stored ? 0 : -1;
+	}
+
+	return checksum(p, len) == 0 ? 0 : -1;
+}
+
+/**
+ * @brief name the implementations in use
+ *
+ * @return a static string
+ */
+const char * checksum_impl(){
+	if(impl_name == NULL)
+		select_impl();
+	return impl_name;
+}
+
+/**
+ * @brief pick the fastest implementations the CPU supports
+ */
+static void select_impl(){
+	int i, j;
+	uint32_t crc;
+	Sum_func sum = sum_scalar;
+	Crc_func crc_func = crc32c_soft;
+
+#ifdef HAVE_X86_DISPATCH
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		sum = sum_avx2;
+	if(__builtin_cpu_supports("sse4.2"))
+		crc_func = crc32c_sse42;
+#endif
+
+	if(crc_func == crc32c_soft)
+		for(i = 0; i < 256; i++){
+			crc = (uint32_t)i;
+			for(j = 0; j < 8; j++)
+				crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+			crc_table[i] = crc;
+		}
+
+	if(sum == sum_scalar)
+		impl_name = crc_func == crc32c_soft ? "sum-scalar crc32c-table" :
+			"sum-scalar crc32c-sse4.2";
+	else
+		impl_name = crc_func == crc32c_soft ? "sum-avx2 crc32c-table" :
+			"sum-avx2 crc32c-sse4.2";
+	crc_impl = crc_func;
+	sum_impl = sum;
+}
+
+/**
+ * @brief add up the 16 bits words in host byte order, a left-over byte is added as it is
+ *
+ * @param p address of the data
+ * @param len length of the data
+ *
+ * @return the sum, carries not folded yet
+ */
+static uint64_t sum_scalar(const unsigned char *p, size_t len){
+	uint64_t sum = 0;
+	uint32_t word;
+	uint16_t half;
+
+	/* a 32 bits word adds up to the same as its two halves modulo 0xffff */
+	while(len >= 4){
+		memcpy(&word, p, 4);
+		sum += word;
+		p += 4;
+		len -= 4;
+	}
+	if(len >= 2){
+		memcpy(&half, p, 2);
+		sum += half;
+		p += 2;
+		len -= 2;
+	}
+	if(len == 1)
+		sum += *p;
+	return sum;
+}
+
+/**
+ * @brief CRC32C a byte at a time with a table
+ *
+ * @param crc CRC so far, not inverted
+ * @param p address of the data
+ * @param len length of the data
+ *
+ * @return CRC, not inverted
+ */
+static uint32_t crc32c_soft(uint32_t crc, const unsigned char *p, size_t len){
+	while(len-- > 0)
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef HAVE_X86_DISPATCH
+/**
+ * @brief sum_scalar() with the 16 bits words widened and added 16 at a time
+ *
+ * @param p address of the data
+ * @param len length of the data
+ *
+ * @return the sum, carries not folded yet
+ */
+__attribute__((target("avx2")))
+static uint64_t sum_avx2(const unsigned char *p, size_t len){
+	__m256i acc, data, zero = _mm256_setzero_si256();
+	uint32_t lanes[8];
+	uint64_t sum = 0;
+	size_t rounds;
+	int i;
+
+	while(len >= 32){
+		/* a 32 bits lane takes 2 words per round, so it never overflows */
+		acc = _mm256_setzero_si256();
+		for(rounds = 0; len >= 32 && rounds < 32768; rounds++){
+			data = _mm256_loadu_si256((const __m256i *)p);
+			acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(data, zero));
+			acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(data, zero));
+			p += 32;
+			len -= 32;
+		}
+		_mm256_storeu_si256((__m256i *)lanes, acc);
+		for(i = 0; i < 8; i++)
+			sum += lanes[i];
+	}
+
+	return sum + sum_scalar(p, len);
+}
+
+/**
+ * @brief CRC32C with the crc32 instruction of SSE4.2
+ *
+ * @param crc CRC so far, not inverted
+ * @param p address of the data
+ * @param len length of the data
+ *
+ * @return CRC, not inverted
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len){
+#ifdef __x86_64__
+	uint64_t crc64 = crc, word;
+
+	while(len >= 8){
+		memcpy(&word, p, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+		p += 8;
+		len -= 8;
+	}
+	crc = (uint32_t)crc64;
+#endif
+	while(len-- > 0)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+#ifndef _CHECKSUM_H_
+#define _CHECKSUM_H_
+
+#include <sys/types.h>
+#include <stddef.h>
+
+/* integrity check of the v2 messages, the v1 ones always use the sum */
+#define HAST3_CHECK_SUM		0
+#define HAST3_CHECK_CRC32C	1
+
+u_short checksum(const void *addr, int len);
+unsigned crc32c(unsigned crc, const void *buf, size_t len);
+unsigned message_crc32c(const void *buf, size_t len);
+int verify_message(const void *buf, int len);
+const char * checksum_impl();
+
+#endif
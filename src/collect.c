@@ -29,11 +29,14 @@
 #include <sys/socket.h>
 #include <sys/param.h>
 #include <sys/wait.h>
+#include <sys/timerfd.h>
 
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 
 #include <time.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -46,14 +49,33 @@
 #include "hast3.h"
 #include "communicate.h"
 #include "collect.h"
+#include "probe.h"
+#include "util.h"
+#include "watch.h"
+#include "protocol.h"
+#include "gossip.h"
 
-static int get_service_status(Env *env,int service_index);
-static int collect_system(const char* cmd);
+static int send_heartbeat(Env *env, int fd, Hast3_packet *pkt,
+		char *message, size_t message_len, const int results[]);
+static int send_parts(Env *env, int fd, const char *message, int len);
+static int start_ticker(Env *env);
+static void check_udp_gso(Env *env);
 
 extern sem_t mutex;
 
 pid_t collect_pid = 0;
 
+/* the statuses in the last full snapshot and its generation */
+static short *snapshot = NULL;
+static unsigned short generation = 0;
+static int since_snapshot = 0;
+/* the status of each service in this heartbeat */
+static short *statuses = NULL;
+/* the socket segments the parts of a snapshot by UDP_SEGMENT */
+static int gso = 0;
+/* when each result was probed */
+static double *probed_at = NULL;
+
 /**
  * @brief The main loop of the collect process, which basically collects the status information of all the services and multicasts it to the other nodes
  *
@@ -62,17 +84,32 @@ pid_t collect_pid = 0;
  * @return The function should loop forever and return denotes an error.
  */
 static int collect_main_loop(Env *env){
-	int fd, i, sndcnt = 0, retry = 0, s;
-	int message_len;
-	short status;
+	int fd, tick_fd, i;
+	int *results, *due;
+	size_t message_len;
+	uint64_t ticks;
+	double now;
 	struct sockaddr_in addr;
-	struct timespec timeout;
-	Hast3_message * message;
+	char *message;
+	Hast3_packet *pkt;
+
+	message_len = max_message_len(env);
+	message = (char *)malloc(message_len);
+	pkt = alloc_packet(env);
+	if(message == NULL || pkt == NULL){
+		fprintf(stderr, "Malloc error\n");
+		exit(EXIT_FAILURE);
+	}
 
-	message_len = sizeof(Hast3_message) + (unsigned int)env->service_num * 
-		sizeof(Hast3_message_entry);
-	message = (Hast3_message *)malloc(message_len);
-	if(message == NULL){
+	results = (int *)calloc(env->service_num, sizeof(int));
+	due = (int *)calloc(env->service_num, sizeof(int));
+	snapshot = (short *)calloc(env->service_num, sizeof(short));
+	statuses = (short *)calloc(env->service_num, sizeof(short));
+	probed_at = (double *)calloc(env->service_num, sizeof(double));
+	if(results == NULL || due == NULL || snapshot == NULL ||
+			statuses == NULL || probed_at == NULL ||
+			init_probes(env) != STATUS_OK ||
+			init_watches(env) != STATUS_OK){
 		fprintf(stderr, "Malloc error\n");
 		exit(EXIT_FAILURE);
 	}
@@ -95,54 +132,257 @@ static int collect_main_loop(Env *env){
 		exit(EXIT_FAILURE);
 	}
 
+	/* 
+	 * the kernel splits a snapshot into the parts, if it can, udp_gso is
+	 * cleared by check_udp_gso() where it cannot
+	 */
+#ifdef UDP_SEGMENT
+	if(env->udp_gso)
+		gso = setsockopt(fd, SOL_UDP, UDP_SEGMENT, &env->max_datagram,
+				sizeof(env->max_datagram)) == 0;
+#endif
+
 	/* fill the header part of message */
-	strcpy(message->nodename, env->nodename);
-	message->type = HAST3_MSG_BCAST;
-	message->field_num = (short)env->service_num;
+	strcpy(pkt->nodename, env->nodename);
+
+	/* the first heartbeat is always a full snapshot */
+	since_snapshot = env->snapshot_interval;
 
-	/* set the timeout struct */
-	timeout.tv_sec = (int)env->ha_interval;
-	timeout.tv_nsec = (env->ha_interval-(int)env->ha_interval)*1000000000;
+	tick_fd = start_ticker(env);
+	if(tick_fd < 0){
+		fprintf(stderr, "timerfd error\n");
+		exit(EXIT_FAILURE);
+	}
 
 	/* loop forever */
 	for(;;){
 
-		/* get the status of each service */
-		for(i = 0; i < env->service_num; i++){
-			strcpy(message->data[i].service_name, env->services[i].name);
-			if(get_service_status(env, i) == 0)
-				status = Service_Running;
-			else{
-				sem_wait(&mutex);
-				if(env->services[i].tried_cnt > env->max_try_no)
-					status = Service_Failed;
-				else
-					status = Service_Nonrunning;
-				sem_post(&mutex);
-			}
-			message->data[i].cmd_or_status = status;
+		/* 
+		 * probe the due services concurrently, the others keep their last
+		 * known results
+		 */
+		now = monotonic_time();
+		schedule_probes(env, now, due);
+		run_probes(env, due, results);
+		reschedule_probes(env, now, due, results);
+		for(i = 0; i < env->service_num; i++)
+			if(due[i])
+				probed_at[i] = now;
+		update_watches(env, due, results);
+
+		send_heartbeat(env, fd, pkt, message, message_len, results);
+
+		/* 
+		 * the ticks expired while the cycle was running are overruns,
+		 * they are either merged into one cycle run at once or skipped
+		 * to keep the heartbeats on the tick grid
+		 */
+		if(read(tick_fd, &ticks, sizeof(ticks)) == sizeof(ticks)){
+			env->heartbeat_overruns += ticks;
+			if(!env->skip_missed_ticks)
+				continue;
 		}
 
-		/* fill the check sum part */
-		message->checksum = 0;
-		message->checksum = checksum((u_short *)message, message_len);
+		/* 
+		 * sleep till the next tick, but tell the others at once if a
+		 * watched service exits in between
+		 */
+		for(;;){
+			if(wait_for_exits(env, tick_fd, results) > 0)
+				send_heartbeat(env, fd, pkt, message, message_len, results);
+			if(read(tick_fd, &ticks, sizeof(ticks)) == sizeof(ticks))
+				break;
+		}
+	}
 
+	/* should never go here */
+	close(fd);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief fill the status of each service into the heartbeat and multicast it unless the gossip transport is used, in delta mode only the services changed since the last full snapshot are sent. The statuses are also published to the main process.
+ *
+ * @param env Env struct
+ * @param fd udp socket connected to the multicast group
+ * @param pkt heartbeat packet whose nodename is filled
+ * @param message where the heartbeat is encoded
+ * @param message_len capacity of the message
+ * @param results[] exit code of the state commands
+ *
+ * @return 0 on success and -1 on failure
+ */
+static int send_heartbeat(Env *env, int fd, Hast3_packet *pkt,
+		char *message, size_t message_len, const int results[]){
+	int i, sndcnt = 0, retry = 0, s, full, num, len;
+	short status;
+	Service *service;
+
+	/* get the status of each service */
+	for(i = 0; i < env->service_num; i++){
+		if(results[i] == 0)
+			status = Service_Running;
+		else{
+			sem_wait(&mutex);
+			if(env->services[i].tried_cnt > env->max_try_no)
+				status = Service_Failed;
+			else
+				status = Service_Nonrunning;
+			sem_post(&mutex);
+		}
+		statuses[i] = status;
+
+		/* publish what's new to the main process */
+		service = &env->services[i];
+		if(results[i] != service->local_result ||
+				status != service->local_status ||
+				probed_at[i] != service->probed_at){
+			/* a watched process has exited since the last probe */
+			if(probed_at[i] == service->probed_at)
+				probed_at[i] = monotonic_time();
+			publish_local_status(service, results[i], status, probed_at[i]);
+		}
+	}
+
+	/* the main process gossips the statuses instead */
+	if(env->transport == HAST3_TRANSPORT_GOSSIP){
+		env->local_heartbeat_at = monotonic_time();
+		return 0;
+	}
+
+	full = !env->delta_heartbeat || env->snapshot_requested ||
+		++since_snapshot >= env->snapshot_interval;
+	for(;;){
+		if(full){
+			env->snapshot_requested = 0;
+			since_snapshot = 0;
+			generation++;
+			memcpy(snapshot, statuses, env->service_num * sizeof(short));
+		}
+
+		for(i = 0, num = 0; i < env->service_num; i++){
+			if(!full && statuses[i] == snapshot[i])
+				continue;
+			pkt->data[num].service = i;
+			pkt->data[num].cmd_or_status = statuses[i];
+			num++;
+		}
+
+		pkt->type = full ? HAST3_MSG_BCAST : HAST3_MSG_DELTA;
+		pkt->field_num = num;
+		pkt->serial = generation;
+
+		/* encode in the configured format with the check sum filled */
+		len = encode_message(env, pkt, message, message_len);
+		if(len < 0)
+			return -1;
+		/* a delta never comes in parts, a new snapshot does better */
+		if(full || env->protocol != HAST3_PROTO_V2 || len <= env->max_datagram)
+			break;
+		full = 1;
+	}
+
+	if(len > env->max_datagram && env->protocol == HAST3_PROTO_V2 &&
+			!(gso && send(fd, message, len, 0) == len))
+		retry = send_parts(env, fd, message, len);
+	else{
 		/* check the return value of send */
-		sndcnt = 0;
-		retry = 0;
-		while(retry < RETRYCNT && sndcnt < message_len){
-			s = send(fd,message,message_len ,0);
+		while(retry < RETRYCNT && sndcnt < len){
+			s = send(fd, message, len, 0);
 			if(s < 0)
 				retry++;
 			else
 				sndcnt += s;
 		}
-		nanosleep(&timeout, NULL);
 	}
 
-	/* should never go here */
-	close(fd);
-	exit(EXIT_FAILURE);
+	env->local_heartbeat_at = monotonic_time();
+	return retry < RETRYCNT ? 0 : -1;
+}
+
+/**
+ * @brief send the parts of a snapshot one by one, all but the last one are max_datagram bytes
+ *
+ * @param env Env struct
+ * @param fd udp socket connected to the multicast group
+ * @param message the parts of the snapshot
+ * @param len total length of the parts
+ *
+ * @return number of retries, RETRYCNT if a part cannot be sent
+ */
+static int send_parts(Env *env, int fd, const char *message, int len){
+	int off, part_len, retry = 0;
+
+	for(off = 0; off < len && retry < RETRYCNT; ){
+		part_len = len - off < env->max_datagram ? len - off : env->max_datagram;
+		if(send(fd, message + off, part_len, 0) == part_len)
+			off += part_len;
+		else
+			retry++;
+	}
+	return retry;
+}
+
+/**
+ * @brief create a timerfd which expires every ha_interval on absolute deadlines of CLOCK_MONOTONIC, so the heartbeats don't drift with the time spent in probing
+ *
+ * @param env Env struct
+ *
+ * @return the timerfd on success and -1 on failure
+ */
+static int start_ticker(Env *env){
+	int fd;
+	struct itimerspec its;
+	struct timespec now;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(fd < 0)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	its.it_interval.tv_sec = (time_t)env->ha_interval;
+	its.it_interval.tv_nsec = (long)((env->ha_interval -
+				(time_t)env->ha_interval) * 1000000000);
+	its.it_value.tv_sec = now.tv_sec + its.it_interval.tv_sec;
+	its.it_value.tv_nsec = now.tv_nsec + its.it_interval.tv_nsec;
+	if(its.it_value.tv_nsec >= 1000000000){
+		its.it_value.tv_sec++;
+		its.it_value.tv_nsec -= 1000000000;
+	}
+
+	if(timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) < 0){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * @brief check whether the snapshots can be sent with UDP_SEGMENT, in the main process since the collect process has no log, and clear udp_gso if not
+ *
+ * @param env Env struct
+ */
+static void check_udp_gso(Env *env){
+	int ok = 0;
+#ifdef UDP_SEGMENT
+	int fd;
+#endif
+
+	if(!env->udp_gso)
+		return;
+
+#ifdef UDP_SEGMENT
+	if(env->protocol == HAST3_PROTO_V2 &&
+			(fd = socket(AF_INET, SOCK_DGRAM, 0)) >= 0){
+		ok = setsockopt(fd, SOL_UDP, UDP_SEGMENT, &env->max_datagram,
+				sizeof(env->max_datagram)) == 0;
+		close(fd);
+	}
+#endif
+	if(!ok){
+		write_log(WARN, "UDP segmentation offload is unavailable");
+		env->udp_gso = 0;
+	}
 }
 
 /**
@@ -154,16 +394,23 @@ static int collect_main_loop(Env *env){
  */
 int start_collect(Env *env){
 	int in, out, i;
+	sigset_t mask;
 
 	if(collect_pid != 0 && kill(collect_pid, 0) != -1)
 		kill(collect_pid, SIGKILL);
 
+	check_udp_gso(env);
+
 	collect_pid = fork();
 	if(collect_pid == -1){
 		fprintf(stderr, "fork error");
 		exit(EXIT_FAILURE);
 	}
 	else if(collect_pid == 0){
+		/* the main process may have blocked the signals it reads by fd */
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+
 		in = open("/dev/null", O_RDONLY);
 		out = open("/dev/null", O_WRONLY);
 
@@ -189,42 +436,22 @@ int start_collect(Env *env){
  * @return 0 for sucess and other for failure
  */
 int stop_collect(){
-	kill(collect_pid, SIGKILL);
+	/* 0 once it's reaped, which would signal the whole process group */
+	if(collect_pid > 0)
+		kill(collect_pid, SIGKILL);
 	return STATUS_OK;
 }
 
 /**
- * @brief wrap function for system(3)
+ * @brief reap the collect process if it has exited, the other children are left to their waiters
  *
- * @param cmd
- *
- * @return -1 on failure, and real exit code on success
- */
-static int collect_system(const char* cmd){
-	int status;
-	errno = 0;
-	status = system(cmd);
-	if(status == -1)
-		return -1;
-	else
-		return WEXITSTATUS(status);
-}
-
-/**
- * @brief get the status of specified service
- *
- * @param env Env struct
- * @param service_index the index of service
+ * @param status the wait status is returned here
  *
- * @return status
+ * @return 1 if it has exited and 0 otherwise
  */
-static int get_service_status(Env *env,int service_index){
-	int i, status;
-	for(i = 0; i < MAX_TRY_NUM; i++){
-		status = collect_system(env->services[service_index].statecmd);
-		if(status != -1)
-			return status;
-		usleep(10);
-	}
-	return -1;
+int collect_exited(int *status){
+	if(collect_pid <= 0 || waitpid(collect_pid, status, WNOHANG) != collect_pid)
+		return 0;
+	collect_pid = 0;
+	return 1;
 }
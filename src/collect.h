@@ -21,5 +21,6 @@
 
 int start_collect(Env *env);
 int stop_collect();
+int collect_exited(int *status);
 
 #endif
@@ -25,9 +25,10 @@
  * @date 2011-11-09
  */
 
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <time.h>
@@ -36,12 +37,44 @@
 #include <stdlib.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
 
 #include "hast3.h"
 #include "communicate.h"
+#include "checksum.h"
+#include "protocol.h"
+#include "peer.h"
+#include "reliable.h"
+#include "gossip.h"
+
+/* the headers of recvmmsg(), one for each message of a batch */
+static struct mmsghdr recv_msgs[RECV_BATCH];
+static struct iovec recv_iovs[RECV_BATCH];
+static char recv_ctrls[RECV_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+
+/* the commands queued for each node */
+typedef struct{
+	char node[NAMELEN];
+	Hast3_packet *pkt;
+	char *buf;
+	size_t size;
+	struct sockaddr_in addr;
+	struct iovec iov;
+} Cmd_batch;
+
+#define CMD_BATCH_RESIZE	8
+
+static Cmd_batch *cmd_batches = NULL;
+static int cmd_batch_num = 0;
+static int cmd_batch_cap = 0;
+static struct mmsghdr *send_msgs = NULL;
+static int send_msgs_cap = 0;
+
+static int set_recv_buffer(int fd, int size);
 
 /**
- * @brief creates the udp socket to receive multicast information
+ * @brief creates the udp socket to receive multicast information, or the gossip of the other nodes
  *
  * @param env Env struct
  *
@@ -79,18 +112,59 @@ int build_server(Env *env){
 		return STATUS_SOCKET_ERR;
 	}
 
+	/* a bigger buffer rides out the bursts of heartbeats from many nodes */
+	if(env->recv_buffer > 0 &&
+			set_recv_buffer(env->server_fd, env->recv_buffer) != 0)
+		fprintf(stderr, "[WARNING]\tCannot set the receive buffer to %d "
+				"bytes, raise net.core.rmem_max\n", env->recv_buffer);
+
+	/* have the kernel tell how many datagrams it has dropped */
+	if(setsockopt(env->server_fd, SOL_SOCKET, SO_RXQ_OVFL, &yes,
+				sizeof(yes)) < 0)
+		fprintf(stderr, "[WARNING]\tCannot track the dropped messages\n");
+
 	/* use setsockopt() to request that the kernel join a multicast group */
 	mreq.imr_multiaddr.s_addr=inet_addr(HEARTBEAT_GROUP);
 	mreq.imr_interface.s_addr=htonl(INADDR_ANY);
-	if (setsockopt(env->server_fd,IPPROTO_IP,IP_ADD_MEMBERSHIP,&mreq,
+	if (env->transport == HAST3_TRANSPORT_MULTICAST &&
+			setsockopt(env->server_fd,IPPROTO_IP,IP_ADD_MEMBERSHIP,&mreq,
 				sizeof(mreq)) < 0) {
 		fprintf(stderr, "Failed to enter multicast group");
 		return STATUS_SOCKET_ERR;
 	}
 
+	/* the commands to the other nodes are all sent through this socket */
+	if((env->cmd_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0){
+		fprintf(stderr, "socket error");
+		return STATUS_SOCKET_ERR;
+	}
+
 	return STATUS_OK;
 }
 
+/**
+ * @brief set the size of the receive buffer, beyond net.core.rmem_max if hast3 is privileged
+ *
+ * @param fd udp socket
+ * @param size size in bytes
+ *
+ * @return 0 on success and -1 if the buffer is smaller than size
+ */
+static int set_recv_buffer(int fd, int size){
+	int actual = 0;
+	socklen_t len = sizeof(actual);
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	/* the kernel reports the doubled size including its overhead */
+	if(getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &actual, &len) == 0 &&
+			actual >= size)
+		return 0;
+
+	if(setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) == 0)
+		return 0;
+	return -1;
+}
+
 /**
  * @brief stop the udp server
  *
@@ -99,126 +173,271 @@ int build_server(Env *env){
  * @return 0 on success, other on failure
  */
 int stop_server(Env *env){
+	close(env->cmd_fd);
 	return close(env->server_fd);
 }
 
 /**
- * @brief compute the CRC checksum
+ * @brief drain up to RECV_BATCH messages from the socket with a single system call and check their validity
  *
- * @param addr message address
- * @param len message length
+ * @param env Env struct
+ * @param batch where the messages are stored, the length of a corrupt one is set to -1
  *
- * @return checksum
+ * @return number of messages received, 0 if there is none
  */
-u_short checksum(u_short* addr, int len){
-	register int left = len;
-	register int sum = 0;
-	u_short answer = 0;
-
-	while(left > 1){
-		sum += *addr++;
-		left -= 2;
+int get_and_check_messages(Env *env, Recv_batch *batch){
+	int i, n;
+	uint32_t dropped;
+	struct msghdr *hdr;
+	struct cmsghdr *cmsg;
+
+	for(i = 0; i < RECV_BATCH; i++){
+		recv_iovs[i].iov_base = batch->buf[i];
+		recv_iovs[i].iov_len = MAXBUFSIZE;
+		hdr = &recv_msgs[i].msg_hdr;
+		memset(hdr, 0, sizeof(struct msghdr));
+		hdr->msg_name = &batch->from[i];
+		hdr->msg_namelen = sizeof(batch->from[i]);
+		hdr->msg_iov = &recv_iovs[i];
+		hdr->msg_iovlen = 1;
+		hdr->msg_control = recv_ctrls[i];
+		hdr->msg_controllen = sizeof(recv_ctrls[i]);
+	}
+
+	batch->num = 0;
+	do{
+		n = recvmmsg(env->server_fd, recv_msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+	} while(n < 0 && errno == EINTR);
+	if(n <= 0)
+		return 0;
+
+	for(i = 0; i < n; i++){
+		hdr = &recv_msgs[i].msg_hdr;
+		/* the number of datagrams the socket has dropped so far */
+		for(cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL;
+				cmsg = CMSG_NXTHDR(hdr, cmsg))
+			if(cmsg->cmsg_level == SOL_SOCKET &&
+					cmsg->cmsg_type == SO_RXQ_OVFL){
+				memcpy(&dropped, CMSG_DATA(cmsg), sizeof(dropped));
+				__atomic_store_n(&env->recv_dropped, dropped,
+						__ATOMIC_RELAXED);
+			}
+
+		/* check the integrity, the layout is checked by decode_message() */
+		batch->len[i] = (int)recv_msgs[i].msg_len;
+		if((hdr->msg_flags & MSG_TRUNC) ||
+				verify_message(batch->buf[i], batch->len[i]) != 0)
+			batch->len[i] = -1;
 	}
 
-	/* add left-over byte if necessary */
-	if(left == 1)
-		sum += *(unsigned char *)addr;
-	
-	/* add carries from top 16 bits to low 16 bits */
-	sum = (sum >> 16) + (sum &0xffff);
-	/* add possible carry */
-	sum += (sum >> 16);
-
-	answer = ~sum;
-	return answer;
+	batch->num = n;
+	return n;
 }
 
 /**
- * @brief when the socket is readble, read the socket and checks its validity
+ * @brief queue a command to the specified node, i.e., ask it to start or stop the service, the commands to the same node are sent in one message by flush_cmds()
  *
- * @param fd udp socket
- * @param buf[] where the data should be stored
+ * @param env Env struct
+ * @param node name of the receiving node
+ * @param service the index of the service
+ * @param cmd command
  *
- * @return STATUS_OK on success and STATUS_MSG_CORRUPT on failure
+ * @return STATUS_OK on success and STATUS_SOCKET_ERR on failure
  */
-int get_and_check_message(int fd, char buf[]){
-	struct sockaddr_in addr;
-	int len = 0, addrlen = sizeof(addr), header_len, entry_len;
+int queue_cmd_to_node(Env *env, const char*node, int service, int cmd){
+	int i;
+	Cmd_batch *batch, *tmp;
+	Hast3_entry *entry;
+
+	/* a full batch is sent as it is, the rest go to another message */
+	for(i = 0; i < cmd_batch_num; i++)
+		if(strcmp(cmd_batches[i].node, node) == 0 &&
+				cmd_batches[i].pkt->field_num < max_cmd_entries(env))
+			break;
+
+	if(i >= cmd_batch_num){
+		/* the batches are kept for reuse after being flushed */
+		if(cmd_batch_num >= cmd_batch_cap){
+			tmp = realloc(cmd_batches,
+					(cmd_batch_cap + CMD_BATCH_RESIZE) * sizeof(Cmd_batch));
+			if(tmp == NULL)
+				return STATUS_SOCKET_ERR;
+			memset(tmp + cmd_batch_cap, 0, CMD_BATCH_RESIZE * sizeof(Cmd_batch));
+			cmd_batches = tmp;
+			cmd_batch_cap += CMD_BATCH_RESIZE;
+		}
+
+		batch = &cmd_batches[cmd_batch_num];
+		if(batch->pkt == NULL){
+			batch->size = max_message_len(env);
+			batch->pkt = alloc_packet(env);
+			batch->buf = (char *)malloc(batch->size);
+			if(batch->pkt == NULL || batch->buf == NULL){
+				free_packet(batch->pkt);
+				free(batch->buf);
+				batch->pkt = NULL;
+				batch->buf = NULL;
+				return STATUS_SOCKET_ERR;
+			}
+		}
+		strcpy(batch->node, node);
+		strcpy(batch->pkt->nodename, env->nodename);
+		batch->pkt->type = HAST3_MSG_CMD;
+		batch->pkt->field_num = 0;
+		cmd_batch_num++;
+	}
+	else
+		batch = &cmd_batches[i];
+
+	if(batch->pkt->field_num >= batch->pkt->capacity)
+		return STATUS_SOCKET_ERR;
+	entry = &batch->pkt->data[batch->pkt->field_num++];
+	entry->service = service;
+	entry->cmd_or_status = (short)cmd;
+	return STATUS_OK;
+}
+
+/**
+ * @brief send the queued commands, one message for each node unless they don't fit in a datagram, all in a single sendmmsg() call
+ *
+ * @param env Env struct
+ *
+ * @return STATUS_OK on success and STATUS_SOCKET_ERR if some message cannot be sent
+ */
+int flush_cmds(Env *env){
+	int i, n = 0, len, sent, status = STATUS_OK;
+	struct mmsghdr *tmp;
+	Cmd_batch *batch;
+
+	if(cmd_batch_num == 0)
+		return STATUS_OK;
+
+	if(send_msgs_cap < cmd_batch_num){
+		tmp = realloc(send_msgs, cmd_batch_cap * sizeof(struct mmsghdr));
+		if(tmp == NULL)
+			return STATUS_SOCKET_ERR;
+		send_msgs = tmp;
+		send_msgs_cap = cmd_batch_cap;
+	}
+
+	for(i = 0; i < cmd_batch_num; i++){
+		batch = &cmd_batches[i];
+		/* 
+		 * the v1 CMD keeps the legacy header without serial, it's sent
+		 * once as before and routine_check() sends it again if needed
+		 */
+		if(env->protocol == HAST3_PROTO_V2)
+			batch->pkt->serial = next_cmd_seq();
+		else
+			batch->pkt->serial = 0;
+		len = encode_message(env, batch->pkt, batch->buf, batch->size);
+		if(len < 0 || lookup_peer(env, batch->node, &batch->addr) != 0){
+			write_log(ERROR, "Cannot send CMD to node [%s]", batch->node);
+			status = STATUS_SOCKET_ERR;
+			continue;
+		}
+		/* retransmitted by retransmit_cmds() till it's acknowledged */
+		if(batch->pkt->serial != 0)
+			track_cmd(env, batch->node, batch->pkt->serial, batch->buf,
+					(size_t)len, &batch->addr);
+
+		batch->iov.iov_base = batch->buf;
+		batch->iov.iov_len = (size_t)len;
+		memset(&send_msgs[n], 0, sizeof(struct mmsghdr));
+		send_msgs[n].msg_hdr.msg_name = &batch->addr;
+		send_msgs[n].msg_hdr.msg_namelen = sizeof(batch->addr);
+		send_msgs[n].msg_hdr.msg_iov = &batch->iov;
+		send_msgs[n].msg_hdr.msg_iovlen = 1;
+		n++;
+	}
+	cmd_batch_num = 0;
+
+	/* sendmmsg() fails only when the first message cannot be sent */
+	for(i = 0; i < n; ){
+		sent = sendmmsg(env->cmd_fd, send_msgs + i, (unsigned)(n - i), 0);
+		if(sent > 0)
+			i += sent;
+		else{
+			status = STATUS_SOCKET_ERR;
+			i++;
+		}
+	}
+
+	return status;
+}
+
+/**
+ * @brief ask the specified node to multicast a full snapshot of its services
+ *
+ * @param env Env struct
+ * @param node name of the node
+ *
+ * @return STATUS_OK on success and STATUS_SOCKET_ERR on failure
+ */
+int request_snapshot(Env *env, const char *node){
+	char buf[MAXBUFSIZE];
+	int len;
+	Hast3_packet pkt;
 
-	if(ioctl(fd, FIONREAD, &len) != -1 && len <= 0)
-		return STATUS_MSG_CORRPUT;
+	memset(&pkt, 0, sizeof(pkt));
+	strcpy(pkt.nodename, env->nodename);
+	pkt.type = HAST3_MSG_SNAPREQ;
 
-	len = recvfrom(fd, buf, MAXBUFSIZE, 0, 
-			(struct sockaddr *)&addr, &addrlen);
+	len = encode_message(env, &pkt, buf, sizeof(buf));
 	if(len < 0)
-		return STATUS_MSG_CORRPUT;
+		return STATUS_SOCKET_ERR;
+	return send_msg_to_node(env, node, buf, (size_t)len);
+}
 
-	/* check the checksum */
-	if(checksum((u_short *)buf, len) != 0)
-		return STATUS_MSG_CORRPUT;
+/**
+ * @brief acknowledge a command received from the specified node
+ *
+ * @param env Env struct
+ * @param node name of the node
+ * @param seq sequence number of the command
+ *
+ * @return STATUS_OK on success and STATUS_SOCKET_ERR on failure
+ */
+int send_ack(Env *env, const char *node, unsigned short seq){
+	char buf[MAXBUFSIZE];
+	int len;
+	Hast3_packet pkt;
 
-	header_len = sizeof(Hast3_message);
-	entry_len = sizeof(Hast3_message_entry);
-	if((len - header_len) % entry_len != 0)
-		return STATUS_MSG_CORRPUT;
+	memset(&pkt, 0, sizeof(pkt));
+	strcpy(pkt.nodename, env->nodename);
+	pkt.type = HAST3_MSG_ACK;
+	pkt.serial = seq;
 
-	return STATUS_OK;
+	len = encode_message(env, &pkt, buf, sizeof(buf));
+	if(len < 0)
+		return STATUS_SOCKET_ERR;
+	return send_msg_to_node(env, node, buf, (size_t)len);
 }
 
 /**
- * @brief send a command to the specified node, i.e., ask it to start or stop the service
+ * @brief send a message to the hast3 of the specified node
  *
  * @param env Env struct
  * @param node name of the receiving node
- * @param service name of the service
- * @param cmd command
+ * @param msg encoded message
+ * @param msglen length of the message
  *
  * @return STATUS_OK on success and STATUS_SOCKET_ERR on failure
  */
-int send_cmd_to_node(Env *env, const char*node, const char *service, int cmd){
-	int fd, retry, sent;
+int send_msg_to_node(Env *env, const char *node, const char *msg,
+		size_t msglen){
+	int retry, sent;
 	unsigned sndcnt;
 	struct sockaddr_in address;
-	struct hostent *hostinfo;
-	size_t addrlen = sizeof(address), msglen;
-	Hast3_message *msg;
-	Hast3_message_entry *entry;
-
-	msglen = sizeof(Hast3_message) + sizeof(Hast3_message_entry);
-	msg = (Hast3_message *)malloc(msglen);
-	if(msg == NULL)
-		return STATUS_SOCKET_ERR;
-	strcpy(msg->nodename, env->nodename);
-	msg->type = HAST3_MSG_CMD;
-	msg->field_num = 1;
-	entry = (Hast3_message_entry*)((char *)msg + sizeof(Hast3_message));
-	strcpy(entry->service_name, service);
-	entry->cmd_or_status = (short)cmd;
-	msg->checksum = 0;
-	msg->checksum = checksum((u_short *)msg, msglen);
+	size_t addrlen = sizeof(address);
 
-	fd = socket(AF_INET, SOCK_DGRAM, 0);
-	if(fd < 0){
-		free(msg);
+	if(lookup_peer(env, node, &address) != 0)
 		return STATUS_SOCKET_ERR;
-	}
-
-	hostinfo = gethostbyname(node);
-	if(hostinfo == NULL){
-		close(fd);
-		free(msg);
-		return STATUS_SOCKET_ERR;
-	}
-
-	memset(&address, 0, addrlen);
-	address.sin_family = AF_INET;
-	address.sin_port = htons(env->port);
-	address.sin_addr = *(struct in_addr *)*hostinfo->h_addr_list;
 
 	sndcnt = 0;
 	retry = 0;
 	while(retry < RETRYCNT && sndcnt < msglen){
-		sent = sendto(fd, msg, msglen, 0, 
+		sent = sendto(env->cmd_fd, msg, msglen, 0, 
 				(struct sockaddr *)&address, addrlen);
 		if(sent < 0)
 			retry++;
@@ -226,9 +445,6 @@ int send_cmd_to_node(Env *env, const char*node, const char *service, int cmd){
 			sndcnt += sent;
 	}
 
-	free(msg);
-	close(fd);
-
 	if(retry < RETRYCNT)
 		return STATUS_OK;
 	else
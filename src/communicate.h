@@ -20,6 +20,7 @@
 #define _COMMUNICATE_H_
 
 #include <sys/types.h>
+#include <netinet/in.h>
 
 #include "hast3.h"
 
@@ -27,12 +28,25 @@
 
 #define HEARTBEAT_GROUP "225.0.0.37"
 
-u_short checksum(u_short* addr, int len);
-
-int send_cmd_to_node(Env *env, const char*node, const char *service, int cmd);
+/* at most so many messages are received by a system call */
+#define RECV_BATCH	32
+
+typedef struct{
+	int num;
+	int len[RECV_BATCH];
+	struct sockaddr_in from[RECV_BATCH];
+	char buf[RECV_BATCH][MAXBUFSIZE];
+} Recv_batch;
+
+int queue_cmd_to_node(Env *env, const char*node, int service, int cmd);
+int flush_cmds(Env *env);
+int request_snapshot(Env *env, const char *node);
+int send_ack(Env *env, const char *node, unsigned short seq);
+int send_msg_to_node(Env *env, const char *node, const char *msg,
+		size_t msglen);
 int build_server(Env *env);
 int stop_server(Env *env);
-int get_and_check_message(int fd, char buf[]);
+int get_and_check_messages(Env *env, Recv_batch *batch);
 
 
 #endif
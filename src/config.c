@@ -29,9 +29,23 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include "hast3.h"
 #include "keyfile.h"
+#include "probe.h"
+#include "util.h"
+#include "protocol.h"
+#include "checksum.h"
+#include "peer.h"
+#include "reliable.h"
+#include "gossip.h"
+#include "detector.h"
+#include "executor.h"
+
+static int parse_node_list(Env *env, char *list);
+static int parse_peer_list(char *list);
+static int parse_seed_list(Env *env, char *list);
 
 /**
  * @brief read the configuration
@@ -44,7 +58,7 @@
 int init_config(Env *env, const char *config){
 	Keyfile *keyfile;
 	int		integer, i;
-	char	servicex[] = "ServiceX";
+	char	servicex[2 * NAMELEN];
 	char	str[MAXSTRLEN];
 	double	value;
 
@@ -73,6 +87,38 @@ int init_config(Env *env, const char *config){
 		return STATUS_CNF_ERR;
 	}
 
+	/* 
+	 * the node ids used by protocol v2 are the positions in the node list,
+	 * which must be the same on every node
+	 */
+	if(getStrValue(keyfile, "General", "Nodes", str) == 0 &&
+			parse_node_list(env, str) != 0)
+		return STATUS_CNF_ERR;
+
+	if(getIntValue(keyfile, "General", "Protocol", &integer) == 0 &&
+			integer == HAST3_PROTO_V2){
+		if(env->node_id > 0)
+			env->protocol = HAST3_PROTO_V2;
+		else{
+			fprintf(stderr, "[WARNING]\tNode %s is not in Nodes, "
+					"fall back to protocol 1\n", env->nodename);
+			env->protocol = HAST3_PROTO_V1;
+		}
+	}
+	else
+		env->protocol = HAST3_PROTO_V1;
+
+	/* the v1 messages always carry the 16 bits checksum */
+	env->checksum_mode = HAST3_CHECK_CRC32C;
+	if(getStrValue(keyfile, "General", "Checksum", str) == 0){
+		if(strcmp(str, "sum") == 0)
+			env->checksum_mode = HAST3_CHECK_SUM;
+		else if(strcmp(str, "crc32c") != 0){
+			fprintf(stderr, "Checksum should be crc32c or sum\n");
+			return STATUS_CNF_ERR;
+		}
+	}
+
 	/* The port number should be none well know, i.e. greater than 1024 */
 	getIntValue(keyfile, "General", "Port", &integer);
 	if (integer > 1024 && integer < 65536)
@@ -80,6 +126,47 @@ int init_config(Env *env, const char *config){
 	else
 		env->port = 10010; /* default to 10086 */
 
+	if(getIntValue(keyfile, "General", "RecvBuffer", &integer) == 0 &&
+			integer > 0)
+		env->recv_buffer = integer;
+	else
+		env->recv_buffer = 0;
+
+	/* an even length keeps the 16 bits checksum of each part aligned */
+	if(getIntValue(keyfile, "General", "MaxDatagram", &integer) == 0 &&
+			integer >= HAST3_MIN_DATAGRAM && integer <= MAXBUFSIZE)
+		env->max_datagram = integer & ~1;
+	else
+		env->max_datagram = DEFAULT_MAX_DATAGRAM;
+
+	if(getIntValue(keyfile, "General", "UdpGso", &integer) == 0 &&
+			integer > 0)
+		env->udp_gso = 1;
+	else
+		env->udp_gso = 0;
+
+	/* the addresses of the nodes which are not to be resolved */
+	if(getStrValue(keyfile, "General", "Peers", str) == 0 &&
+			parse_peer_list(str) != 0)
+		return STATUS_CNF_ERR;
+
+	/* 
+	 * the nodes gossip by unicast instead of the multicast heartbeats,
+	 * starting from the seeds
+	 */
+	env->transport = HAST3_TRANSPORT_MULTICAST;
+	if(getStrValue(keyfile, "General", "Transport", str) == 0){
+		if(strcmp(str, "gossip") == 0)
+			env->transport = HAST3_TRANSPORT_GOSSIP;
+		else if(strcmp(str, "multicast") != 0){
+			fprintf(stderr, "Transport should be multicast or gossip\n");
+			return STATUS_CNF_ERR;
+		}
+	}
+	if(getStrValue(keyfile, "General", "Seeds", str) == 0 &&
+			parse_seed_list(env, str) != 0)
+		return STATUS_CNF_ERR;
+
 	/* the runtime part */
 	getFloatValue(keyfile, "Runtime", "HAInterval", &value);
 	if(value > 0.0)
@@ -89,14 +176,64 @@ int init_config(Env *env, const char *config){
 		return STATUS_CNF_ERR;
 	}
 
-	getIntValue(keyfile, "Runtime", "DeadTime", &integer);
-	if(integer > env->ha_interval)
-		env->dead_time = integer;
+	/* fractional, a sub-second DeadTime goes with a short HAInterval */
+	getFloatValue(keyfile, "Runtime", "DeadTime", &value);
+	if(value > env->ha_interval)
+		env->dead_time = value;
 	else{
 		fprintf(stderr, "DeadTime should be greater than HAInterval\n");
 		return STATUS_CNF_ERR;
 	}
 
+	/* 
+	 * the nodes are judged by the phi-accrual detector, DeadTime is only
+	 * the upper bound, 0 to use DeadTime alone
+	 */
+	if(getFloatValue(keyfile, "Runtime", "PhiThreshold", &value) == 0 &&
+			value >= 0.0)
+		env->phi_threshold = value;
+	else
+		env->phi_threshold = DEFAULT_PHI_THRESHOLD;
+
+	if(getFloatValue(keyfile, "Runtime", "CmdTimeout", &value) == 0 &&
+			value > 0.0)
+		env->cmd_timeout = value;
+	else
+		env->cmd_timeout = DEFAULT_CMD_TIMEOUT;
+
+	/* the timeout is doubled on each retransmit */
+	if(getIntValue(keyfile, "Runtime", "CmdRetries", &integer) == 0 &&
+			integer >= 0 && integer <= 16)
+		env->cmd_retries = integer;
+	else
+		env->cmd_retries = DEFAULT_CMD_RETRIES;
+
+	/* the START/STOP commands run by the executor thread */
+	if(getIntValue(keyfile, "Runtime", "ActionConcurrency", &integer) == 0 &&
+			integer > 0)
+		env->action_concurrency = integer;
+	else
+		env->action_concurrency = DEFAULT_ACTION_CONCURRENCY;
+
+	if(getFloatValue(keyfile, "Runtime", "ActionTimeout", &value) == 0 &&
+			value > 0.0)
+		env->action_timeout = value;
+	else
+		env->action_timeout = DEFAULT_ACTION_TIMEOUT;
+
+	if(getFloatValue(keyfile, "Runtime", "ActionBackoff", &value) == 0 &&
+			value >= 0.0)
+		env->action_backoff = value;
+	else
+		env->action_backoff = DEFAULT_ACTION_BACKOFF;
+
+	/* a node unheard of for DeadTime is gone, so is its address */
+	if(getFloatValue(keyfile, "Runtime", "PeerTTL", &value) == 0 &&
+			value > 0.0)
+		env->peer_ttl = value;
+	else
+		env->peer_ttl = env->dead_time;
+
 	getIntValue(keyfile, "Runtime", "ServiceNumber", &integer);
 	if(integer > 0)
 		env->service_num = integer;
@@ -113,10 +250,66 @@ int init_config(Env *env, const char *config){
 		return STATUS_CNF_ERR;
 	}
 
-	/* Initialize the services */
-	env->services = calloc(env->service_num, sizeof(Service));
+	/* how many state commands the collect process may run at the same time */
+	if(getIntValue(keyfile, "Runtime", "ProbeConcurrency", &integer) == 0 &&
+			integer > 0)
+		env->probe_concurrency = integer;
+	else
+		env->probe_concurrency = DEFAULT_PROBE_CONCURRENCY;
+
+	/* 
+	 * stable services are probed less and less often, but at least every
+	 * ProbeMaxInterval seconds
+	 */
+	if(getIntValue(keyfile, "Runtime", "AdaptiveProbe", &integer) == 0)
+		env->adaptive_probe = integer;
+	if(getFloatValue(keyfile, "Runtime", "ProbeMaxInterval", &value) == 0 &&
+			value >= env->ha_interval)
+		env->probe_max_interval = value;
+	else
+		env->probe_max_interval = DEFAULT_PROBE_BACKOFF * env->ha_interval;
+
+	/* 
+	 * when a collect cycle overruns, skip the missed heartbeats instead of
+	 * sending one at once
+	 */
+	if(getIntValue(keyfile, "Runtime", "SkipMissedTicks", &integer) == 0)
+		env->skip_missed_ticks = integer;
+
+	/* 
+	 * send only the changed services between the full snapshots, which
+	 * are sent every SnapshotInterval heartbeats
+	 */
+	if(getIntValue(keyfile, "Runtime", "DeltaHeartbeat", &integer) == 0)
+		env->delta_heartbeat = integer;
+	if(getIntValue(keyfile, "Runtime", "SnapshotInterval", &integer) == 0 &&
+			integer > 0)
+		env->snapshot_interval = integer;
+	else
+		env->snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
+
+	/* START/STOP reuse the probe of the collect process if it's so fresh */
+	if(getFloatValue(keyfile, "Runtime", "StatusMaxAge", &value) == 0 &&
+			value >= 0.0)
+		env->status_max_age = value;
+	else
+		env->status_max_age = env->ha_interval;
+
+	/* watch the processes found by the builtin probes for their exit */
+	if(getIntValue(keyfile, "Runtime", "WatchPid", &integer) == 0)
+		env->watch_pid = integer;
+
+	/* Initialize the services, they are shared with the collect process */
+	env->services = mmap(NULL, env->service_num * sizeof(Service),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(env->services == MAP_FAILED){
+		fprintf(stderr, "cannot get the shared memroy for services\n");
+		return STATUS_CNF_ERR;
+	}
+	memset(env->services, 0, env->service_num * sizeof(Service));
 	for(i = 0; i < env->service_num; i++){
-		servicex[7] = '0' + i;
+		/* Service0, Service1, ..., Service10, ... */
+		snprintf(servicex, sizeof(servicex), "Service%d", i);
 		getStrValue(keyfile, servicex, "ServiceName", str);
 		strcpy(env->services[i].name, str);
 		if(strlen(env->services[i].name) >= NAMELEN){
@@ -127,7 +320,12 @@ int init_config(Env *env, const char *config){
 		}
 
 		getStrValue(keyfile, servicex, "StartCMD", str);
-		strcpy(env->services[i].startcmd, str);
+		if(parse_command(&env->services[i].startcmd, str) < 0 ||
+				env->services[i].startcmd.builtin != Builtin_None){
+			fprintf(stderr, "Builtin probe %s is only allowed in StateCMD\n",
+					str);
+			return STATUS_CNF_ERR;
+		}
 //		if(access(str, R_OK | X_OK) == 0)
 //			strcpy(env->services[i].startcmd, str);
 //		else{
@@ -136,7 +334,12 @@ int init_config(Env *env, const char *config){
 //		}
 
 		getStrValue(keyfile, servicex, "StopCMD", str);
-		strcpy(env->services[i].stopcmd, str);
+		if(parse_command(&env->services[i].stopcmd, str) < 0 ||
+				env->services[i].stopcmd.builtin != Builtin_None){
+			fprintf(stderr, "Builtin probe %s is only allowed in StateCMD\n",
+					str);
+			return STATUS_CNF_ERR;
+		}
 //		if(access(str, R_OK | X_OK) == 0)
 //			strcpy(env->services[i].stopcmd, str);
 //		else{
@@ -145,7 +348,10 @@ int init_config(Env *env, const char *config){
 //		}
 
 		getStrValue(keyfile, servicex, "StateCMD", str);
-		strcpy(env->services[i].statecmd, str);
+		if(parse_command(&env->services[i].statecmd, str) < 0){
+			fprintf(stderr, "Unknown builtin probe %s\n", str);
+			return STATUS_CNF_ERR;
+		}
 //		if(access(str, R_OK | X_OK) == 0)
 //			strcpy(env->services[i].statecmd, str);
 //		else{
@@ -153,9 +359,105 @@ int init_config(Env *env, const char *config){
 //			return STATUS_CNF_ERR;
 //		}
 
+		/* defaults to probe on every heartbeat */
+		if(getFloatValue(keyfile, servicex, "ProbeInterval", &value) == 0 &&
+				value >= env->ha_interval)
+			env->services[i].probe_interval = value;
+		else
+			env->services[i].probe_interval = env->ha_interval;
+		if(env->services[i].probe_interval > env->probe_max_interval)
+			env->services[i].probe_interval = env->probe_max_interval;
+
 		env->services[i].tried_cnt = 0;
+		env->services[i].probe_now = 0;
 	}
 
 	destroyKeyfile(keyfile);
+	/* the commands and the v1 heartbeats name the services */
+	return build_service_index(env);
+}
+
+/**
+ * @brief parse the ';' separated list of the cluster nodes
+ *
+ * @param env Env struct
+ * @param list node list, modified in place
+ *
+ * @return STATUS_OK on success and STATUS_CNF_ERR on failure
+ */
+static int parse_node_list(Env *env, char *list){
+	int cap = 0;
+	char *name, *saveptr;
+
+	env->cluster_size = 0;
+	for(name = strtok_r(list, "; \t", &saveptr); name != NULL;
+			name = strtok_r(NULL, "; \t", &saveptr)){
+		if(strlen(name) >= NAMELEN){
+			fprintf(stderr, "Node name %s in Nodes is too long\n", name);
+			return STATUS_CNF_ERR;
+		}
+		if(env->cluster_size >= HAST3_MAX_NODE_ID){
+			fprintf(stderr, "At most %d nodes are allowed in Nodes\n",
+					HAST3_MAX_NODE_ID);
+			return STATUS_CNF_ERR;
+		}
+		if(env->cluster_size >= cap){
+			cap = cap * 2 + 8;
+			env->cluster_nodes = realloc(env->cluster_nodes,
+					cap * sizeof(*env->cluster_nodes));
+			if(env->cluster_nodes == NULL)
+				return STATUS_CNF_ERR;
+		}
+		strcpy(env->cluster_nodes[env->cluster_size++], name);
+		if(strcmp(name, env->nodename) == 0)
+			env->node_id = env->cluster_size;
+	}
+
+	return STATUS_OK;
+}
+
+/**
+ * @brief parse the ';' separated list of node:address pairs
+ *
+ * @param list peer list, modified in place
+ *
+ * @return STATUS_OK on success and STATUS_CNF_ERR on failure
+ */
+static int parse_peer_list(char *list){
+	char *peer, *addr, *saveptr;
+
+	for(peer = strtok_r(list, "; \t", &saveptr); peer != NULL;
+			peer = strtok_r(NULL, "; \t", &saveptr)){
+		addr = strchr(peer, ':');
+		if(addr != NULL)
+			*addr++ = '\0';
+		if(addr == NULL || add_static_peer(peer, addr) != 0){
+			fprintf(stderr, "Peers should be like node1:10.0.0.1;"
+					"node2:10.0.0.2\n");
+			return STATUS_CNF_ERR;
+		}
+	}
+
+	return STATUS_OK;
+}
+
+/**
+ * @brief parse the ';' separated list of the gossip seeds
+ *
+ * @param env Env struct
+ * @param list seed list, modified in place
+ *
+ * @return STATUS_OK on success and STATUS_CNF_ERR on failure
+ */
+static int parse_seed_list(Env *env, char *list){
+	char *seed, *saveptr;
+
+	for(seed = strtok_r(list, "; \t", &saveptr); seed != NULL;
+			seed = strtok_r(NULL, "; \t", &saveptr))
+		if(add_gossip_seed(env, seed) != 0){
+			fprintf(stderr, "Cannot resolve the seed %s\n", seed);
+			return STATUS_CNF_ERR;
+		}
+
 	return STATUS_OK;
 }
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/**
+ * @file detector.c
+ * @brief phi-accrual failure detector, the suspicion of a node grows with the time since its last heartbeat, measured against the distribution of its past inter-arrival times
+ * @author Li Jiliang<tjulijiliang@gmail.com
+ * @version 1.0
+ * @date 2011-11-09
+ */
+
+#include <math.h>
+
+#include "hast3.h"
+#include "detector.h"
+
+static void arrival_stats(const Arrival_window *window, double min_stddev,
+		double *mean, double *stddev);
+
+/**
+ * @brief record the arrival of a heartbeat
+ *
+ * @param window the arrival window of the node
+ * @param now monotonic time of the arrival
+ */
+void record_arrival(Arrival_window *window, double now){
+	double interval, old;
+
+	if(window->last_arrival > 0.0){
+		interval = now - window->last_arrival;
+		/* the oldest interval leaves a full window */
+		if(window->num == PHI_WINDOW){
+			old = window->intervals[window->next];
+			window->sum -= old;
+			window->sum_sq -= old * old;
+		}
+		else
+			window->num++;
+		window->intervals[window->next] = interval;
+		window->next = (window->next + 1) % PHI_WINDOW;
+		window->sum += interval;
+		window->sum_sq += interval * interval;
+	}
+	window->last_arrival = now;
+}
+
+/**
+ * @brief the suspicion level of the node, -log10 of the probability that a heartbeat still comes this late, with the inter-arrival times taken as normally distributed
+ *
+ * @param window the arrival window of the node
+ * @param now current monotonic time
+ * @param min_stddev lower bound of the standard deviation, so that a very regular node isn't condemned by a little jitter
+ * @param pause the pause allowed on top of the mean, e.g. for a lost heartbeat
+ *
+ * @return phi, -1 if there are too few samples to tell
+ */
+double phi(const Arrival_window *window, double now, double min_stddev,
+		double pause){
+	double mean, stddev, y, e;
+
+	if(window->num < PHI_MIN_SAMPLES)
+		return -1.0;
+
+	arrival_stats(window, min_stddev, &mean, &stddev);
+	/* the logistic approximation of the normal CDF */
+	y = (now - window->last_arrival - mean - pause) / stddev;
+	e = exp(-y * (1.5976 + 0.070566 * y * y));
+	if(y > 0)
+		return -log10(e / (1.0 + e));
+	return -log10(1.0 - 1.0 / (1.0 + e));
+}
+
+/**
+ * @brief the time phi reaches the threshold if no heartbeat comes, which is fixed till the next arrival
+ *
+ * @param window the arrival window of the node
+ * @param threshold phi the node is judged dead at
+ * @param min_stddev lower bound of the standard deviation as in phi()
+ * @param pause the pause allowed on top of the mean as in phi()
+ *
+ * @return monotonic time, -1 if there are too few samples to tell
+ */
+double phi_deadline(const Arrival_window *window, double threshold,
+		double min_stddev, double pause){
+	static double cached_threshold = -1.0, cached_y;
+	double mean, stddev, k, low, high, y;
+	int i;
+
+	if(window->num < PHI_MIN_SAMPLES)
+		return -1.0;
+
+	/* 
+	 * phi = threshold where y * (1.5976 + 0.070566 * y^2) = k, the left
+	 * side grows with y so it's solved by bisection, once per threshold
+	 */
+	if(threshold != cached_threshold){
+		k = log(pow(10.0, threshold) - 1.0);
+		low = -fabs(k) / 1.5976;
+		high = fabs(k) / 1.5976;
+		for(i = 0; i < 64; i++){
+			y = (low + high) / 2;
+			if(y * (1.5976 + 0.070566 * y * y) < k)
+				low = y;
+			else
+				high = y;
+		}
+		cached_threshold = threshold;
+		cached_y = high;
+	}
+
+	arrival_stats(window, min_stddev, &mean, &stddev);
+	return window->last_arrival + mean + pause + cached_y * stddev;
+}
+
+/**
+ * @brief mean and standard deviation of the inter-arrival times
+ *
+ * @param window the arrival window of the node, with some samples
+ * @param min_stddev lower bound of the standard deviation
+ * @param mean the mean is returned here
+ * @param stddev the standard deviation is returned here
+ */
+static void arrival_stats(const Arrival_window *window, double min_stddev,
+		double *mean, double *stddev){
+	double variance;
+
+	*mean = window->sum / window->num;
+	variance = window->sum_sq / window->num - *mean * *mean;
+	*stddev = variance > 0.0 ? sqrt(variance) : 0.0;
+	if(*stddev < min_stddev)
+		*stddev = min_stddev;
+}
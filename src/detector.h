@@ -0,0 +1,34 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+#ifndef _DETECTOR_H_
+#define _DETECTOR_H_
+
+#include "hast3.h"
+
+/* a node is judged by DeadTime till so many intervals are known */
+#define PHI_MIN_SAMPLES	3
+#define DEFAULT_PHI_THRESHOLD	8.0
+
+void record_arrival(Arrival_window *window, double now);
+double phi(const Arrival_window *window, double now, double min_stddev,
+		double pause);
+double phi_deadline(const Arrival_window *window, double threshold,
+		double min_stddev, double pause);
+
+#endif
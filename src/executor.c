@@ -0,0 +1,529 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file executor.c
+ * @brief the executor thread, which runs the START/STOP commands received, so a slow service script blocks neither the receiving of the heartbeats nor the decisions; each command is a job with a deadline, the jobs of different services run in parallel up to action_concurrency and a failed one is retried later with a growing backoff
+ * @author Li Jiliang<tjulijiliang@gmail.com
+ * @version 1.0
+ * @date 2011-11-09
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+
+#include "hast3.h"
+#include "log.h"
+#include "function.h"
+#include "util.h"
+#include "ring.h"
+#include "executor.h"
+
+enum Job_state{
+	Job_Idle=0,
+	/* waiting for a free slot */
+	Job_Queued,
+	/* running the state command, to skip a START/STOP already done */
+	Job_Checking,
+	/* running the START/STOP command */
+	Job_Running,
+	/* failed, waiting to be retried */
+	Job_Backoff
+};
+
+/* the command of a service, a service has one at most */
+typedef struct{
+	int state;
+	int cmd;
+	/* the opposite command received last meanwhile, -1 if none */
+	int next_cmd;
+	/* failed tries of this command */
+	int tries;
+	pid_t pid;
+	int pidfd;
+	int killed;
+	/* when the child is killed, or when the job is retried */
+	double deadline;
+} Job;
+
+static void * executor_main(void *arg);
+static void submit_job(Env *env, int service, int cmd);
+static void start_queued_jobs(Env *env);
+static void begin_job(Env *env, int service);
+static void decide_job(Env *env, int service, int status);
+static void run_job(Env *env, int service);
+static int spawn_job(Env *env, int service, const Command *cmd);
+static void reap_job(Env *env, int service, int status);
+static void fail_job(Env *env, int service);
+static void finish_job(Env *env, int service);
+static void enqueue_job(int service);
+static double check_jobs(Env *env, double now);
+
+extern sem_t mutex;
+
+static Ring actions;
+static pthread_t executor_thread;
+static int executor_started = 0;
+static int stopping = 0;
+/* tells the executor thread there are actions in the ring */
+static int wake_fd = -1;
+
+static Job *jobs = NULL;
+/* the queued jobs in the order they're submitted */
+static int *queue = NULL;
+static int queue_size = 0, queue_head = 0, queue_len = 0;
+/* the jobs holding a slot, checking or running */
+static int busy = 0;
+static struct pollfd *poll_fds = NULL;
+
+/**
+ * @brief allocate the ring and the jobs and start the executor thread, the signals should be blocked already
+ *
+ * @param env Env struct
+ *
+ * @return STATUS_OK on success and STATUS_SVR_ERR on failure
+ */
+int start_executor(Env *env){
+	int i;
+
+	if(init_ring(&actions, ACTION_RING_SIZE, sizeof(Action)) != 0)
+		return STATUS_SVR_ERR;
+
+	jobs = (Job *)calloc(env->service_num, sizeof(Job));
+	queue = (int *)calloc(env->service_num, sizeof(int));
+	poll_fds = (struct pollfd *)calloc(env->action_concurrency + 1,
+			sizeof(struct pollfd));
+	if(jobs == NULL || queue == NULL || poll_fds == NULL)
+		return STATUS_SVR_ERR;
+	for(i = 0; i < env->service_num; i++){
+		jobs[i].next_cmd = -1;
+		jobs[i].pidfd = -1;
+	}
+	queue_size = env->service_num;
+
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(wake_fd < 0)
+		return STATUS_SVR_ERR;
+
+	if(pthread_create(&executor_thread, NULL, executor_main, env) != 0)
+		return STATUS_SVR_ERR;
+	executor_started = 1;
+	return STATUS_OK;
+}
+
+/**
+ * @brief stop the executor thread, the commands running are left to finish by themselves and the queued ones are dropped
+ */
+void stop_executor(){
+	uint64_t one = 1;
+
+	if(executor_started){
+		__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+		if(write(wake_fd, &one, sizeof(one)) == sizeof(one))
+			pthread_join(executor_thread, NULL);
+		executor_started = 0;
+	}
+	if(actions.slots != NULL)
+		free_ring(&actions);
+	if(wake_fd >= 0)
+		close(wake_fd);
+	wake_fd = -1;
+	free(jobs);
+	free(queue);
+	free(poll_fds);
+	jobs = NULL;
+	queue = NULL;
+	poll_fds = NULL;
+}
+
+/**
+ * @brief queue a START/STOP of the service for the executor thread, called by the decision thread
+ *
+ * @param env Env struct
+ * @param service the index of the service
+ * @param cmd HAST3_CMD_START or HAST3_CMD_STOP
+ *
+ * @return STATUS_OK on success and STATUS_CMD_ERR if the ring is full
+ */
+int queue_action(Env *env, int service, int cmd){
+	Action *action;
+	uint64_t one = 1;
+
+	action = (Action *)ring_back(&actions);
+	if(action == NULL){
+		write_log(ERROR, "Too many actions queued, drop the %s of service [%s]",
+				cmd == HAST3_CMD_START ? "START" : "STOP",
+				env->services[service].name);
+		return STATUS_CMD_ERR;
+	}
+	action->service = service;
+	action->cmd = cmd;
+	ring_push(&actions);
+
+	if(write(wake_fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+		write_log(ERROR, "Failed to wake up the executor thread");
+	return STATUS_OK;
+}
+
+/**
+ * @brief take the actions, start the jobs and wait for the children, the deadlines and the retries, till told to exit
+ *
+ * @param arg Env struct
+ *
+ * @return NULL
+ */
+static void * executor_main(void *arg){
+	Env *env = (Env *)arg;
+	Action *action;
+	uint64_t count;
+	double wait;
+	int i, n, timeout;
+
+	for(;;){
+		while((action = (Action *)ring_front(&actions)) != NULL){
+			submit_job(env, action->service, action->cmd);
+			ring_pop(&actions);
+		}
+		if(__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+			break;
+
+		start_queued_jobs(env);
+		wait = check_jobs(env, monotonic_time());
+		/* new jobs may be queued by the retries */
+		if(queue_len > 0 && busy < env->action_concurrency)
+			continue;
+
+		/* the children are waited for by their pidfds */
+		n = 0;
+		poll_fds[n].fd = wake_fd;
+		poll_fds[n++].events = POLLIN;
+		for(i = 0; i < env->service_num && n <= env->action_concurrency; i++)
+			if(jobs[i].pidfd >= 0){
+				poll_fds[n].fd = jobs[i].pidfd;
+				poll_fds[n++].events = POLLIN;
+			}
+
+		timeout = wait < 0 ? -1 : (int)(wait * 1000) + 1;
+		if(poll(poll_fds, n, timeout) < 0 && errno != EINTR){
+			write_log(ERROR, "Executor thread failed to wait for the actions");
+			break;
+		}
+		if(poll_fds[0].revents)
+			while(read(wake_fd, &count, sizeof(count)) > 0)
+				;
+	}
+	return NULL;
+}
+
+/**
+ * @brief reap the children exited, kill the ones past their deadlines and queue the jobs due for a retry
+ *
+ * @param env Env struct
+ * @param now current monotonic time
+ *
+ * @return seconds till the next deadline, -1 if there is none
+ */
+static double check_jobs(Env *env, double now){
+	Job *job;
+	double wait = -1.0, left;
+	int i, status;
+
+	for(i = 0; i < env->service_num; i++){
+		job = &jobs[i];
+		if(job->state == Job_Checking || job->state == Job_Running){
+			if(waitpid(job->pid, &status, WNOHANG) == job->pid){
+				reap_job(env, i, status);
+				continue;
+			}
+			if(!job->killed && job->deadline <= now){
+				write_log(WARN, "Kill the %s command of service [%s] running "
+						"longer than %.1fs", job->state == Job_Checking ?
+						"state" : job->cmd == HAST3_CMD_START ? "start" : "stop",
+						env->services[i].name, env->action_timeout);
+				kill(-job->pid, SIGKILL);
+				job->killed = 1;
+			}
+			/* without a pidfd the child is polled */
+			if(job->pidfd < 0)
+				left = ACTION_POLL_INTERVAL;
+			else if(!job->killed)
+				left = job->deadline - now;
+			else
+				continue;
+		}
+		else if(job->state == Job_Backoff){
+			if(job->deadline <= now){
+				enqueue_job(i);
+				continue;
+			}
+			left = job->deadline - now;
+		}
+		else
+			continue;
+
+		if(wait < 0 || left < wait)
+			wait = left;
+	}
+	return wait;
+}
+
+/**
+ * @brief take a command for the service, the last command submitted wins: the opposite of the one in progress is run after it, and the same one is dropped and cancels the opposite one queued before
+ *
+ * @param env Env struct
+ * @param service the index of the service
+ * @param cmd HAST3_CMD_START or HAST3_CMD_STOP
+ */
+static void submit_job(Env *env, int service, int cmd){
+	Job *job = &jobs[service];
+
+	if(job->state != Job_Idle){
+		if(debug_level > 0)
+			write_log(DEBUG, "Service [%s] is busy, %s the %s%s",
+					env->services[service].name,
+					cmd == job->cmd ? "drop" : "queue",
+					cmd == HAST3_CMD_START ? "START" : "STOP",
+					cmd == job->cmd && job->next_cmd != -1 ?
+					" and cancel the queued one" : "");
+		/* 
+		 * START, STOP and START again leave the service as the command
+		 * in progress does, so the STOP between is not run
+		 */
+		job->next_cmd = cmd == job->cmd ? -1 : cmd;
+		return;
+	}
+
+	job->cmd = cmd;
+	job->next_cmd = -1;
+	job->tries = 0;
+	enqueue_job(service);
+}
+
+/**
+ * @brief queue the job till a slot is free
+ *
+ * @param service the index of the service
+ */
+static void enqueue_job(int service){
+	jobs[service].state = Job_Queued;
+	queue[(queue_head + queue_len++) % queue_size] = service;
+}
+
+/**
+ * @brief begin the queued jobs in their order while there are free slots
+ *
+ * @param env Env struct
+ */
+static void start_queued_jobs(Env *env){
+	int service;
+
+	while(queue_len > 0 && busy < env->action_concurrency){
+		service = queue[queue_head];
+		queue_head = (queue_head + 1) % queue_size;
+		queue_len--;
+		busy++;
+		begin_job(env, service);
+	}
+}
+
+/**
+ * @brief find out whether the command is needed, from the probe of the collect process if it's fresh or by the state command
+ *
+ * @param env Env struct
+ * @param service the index of the service, whose job holds a slot
+ */
+static void begin_job(Env *env, int service){
+	const Command *statecmd = &env->services[service].statecmd;
+	int status;
+
+	status = cached_status(env, service);
+	/* a builtin probe doesn't fork and is answered at once */
+	if(status == -2 && statecmd->builtin != Builtin_None)
+		status = run_command(statecmd);
+	if(status == -2){
+		if(spawn_job(env, service, statecmd) == 0){
+			jobs[service].state = Job_Checking;
+			return;
+		}
+		status = -1;
+	}
+	decide_job(env, service, status);
+}
+
+/**
+ * @brief run the command unless the service is already in the wanted state
+ *
+ * @param env Env struct
+ * @param service the index of the service
+ * @param status exit code of the state command, -1 if it's unknown
+ */
+static void decide_job(Env *env, int service, int status){
+	/* a service of unknown state is started but not stopped */
+	if(jobs[service].cmd == HAST3_CMD_START ? status == 0 : status != 0)
+		finish_job(env, service);
+	else
+		run_job(env, service);
+}
+
+/**
+ * @brief start the START/STOP command of the job
+ *
+ * @param env Env struct
+ * @param service the index of the service
+ */
+static void run_job(Env *env, int service){
+	Service *svc = &env->services[service];
+
+	svc->acted_at = monotonic_time();
+	if(spawn_job(env, service, jobs[service].cmd == HAST3_CMD_START ?
+				&svc->startcmd : &svc->stopcmd) == 0)
+		jobs[service].state = Job_Running;
+	else
+		fail_job(env, service);
+}
+
+/**
+ * @brief spawn the command of the job into its own process group
+ *
+ * @param env Env struct
+ * @param service the index of the service
+ * @param cmd the command
+ *
+ * @return 0 on success and -1 on failure
+ */
+static int spawn_job(Env *env, int service, const Command *cmd){
+	Job *job = &jobs[service];
+
+	job->pid = spawn_command_group(cmd);
+	if(job->pid <= 0){
+		write_log(ERROR, "Failed to execute [%s]", cmd->line);
+		job->pid = 0;
+		return -1;
+	}
+	if(debug_level > 1)
+		write_log(DEBUG, "Run [%s] for service [%s]", cmd->line,
+				env->services[service].name);
+
+	job->pidfd = open_pidfd(job->pid);
+	job->killed = 0;
+	job->deadline = monotonic_time() + env->action_timeout;
+	return 0;
+}
+
+/**
+ * @brief the child of the job has exited
+ *
+ * @param env Env struct
+ * @param service the index of the service
+ * @param status wait status of the child
+ */
+static void reap_job(Env *env, int service, int status){
+	Job *job = &jobs[service];
+	int code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+
+	if(job->pidfd >= 0)
+		close(job->pidfd);
+	job->pidfd = -1;
+	job->pid = 0;
+	if(debug_level > 2)
+		write_log(DEBUG, "Exit code of the command of service [%s] is %d",
+				env->services[service].name, code);
+
+	if(job->state == Job_Checking)
+		decide_job(env, service, code);
+	else if(code != 0)
+		fail_job(env, service);
+	else{
+		if(job->cmd == HAST3_CMD_START){
+			sem_wait(&mutex);
+			env->services[service].tried_cnt = 0;
+			sem_post(&mutex);
+		}
+		finish_job(env, service);
+	}
+}
+
+/**
+ * @brief count the failure and retry the command after the backoff, a START is tried while tried_cnt doesn't exceed max_try_no, so the collect process reports the service as failed after it, and a STOP MAX_TRY_NUM times
+ *
+ * @param env Env struct
+ * @param service the index of the service
+ */
+static void fail_job(Env *env, int service){
+	Job *job = &jobs[service];
+	int retry, factor, i;
+
+	job->tries++;
+	if(job->cmd == HAST3_CMD_START){
+		sem_wait(&mutex);
+		env->services[service].tried_cnt++;
+		retry = env->services[service].tried_cnt <= env->max_try_no;
+		sem_post(&mutex);
+	}
+	else
+		retry = job->tries < MAX_TRY_NUM;
+
+	if(!retry){
+		write_log(WARN, "Failed to %s service [%s] after %d tries",
+				job->cmd == HAST3_CMD_START ? "start" : "stop",
+				env->services[service].name, job->tries);
+		finish_job(env, service);
+		return;
+	}
+
+	/* the slot is free for the others during the backoff */
+	for(factor = 1, i = 1; i < job->tries && factor < ACTION_BACKOFF_LIMIT; i++)
+		factor *= 2;
+	job->state = Job_Backoff;
+	job->deadline = monotonic_time() + env->action_backoff * factor;
+	busy--;
+	if(debug_level > 0)
+		write_log(DEBUG, "Retry to %s service [%s] in %.1fs",
+				job->cmd == HAST3_CMD_START ? "start" : "stop",
+				env->services[service].name, env->action_backoff * factor);
+}
+
+/**
+ * @brief the job is done, the collect process probes the service at once to publish the result, and the command received meanwhile is queued
+ *
+ * @param env Env struct
+ * @param service the index of the service
+ */
+static void finish_job(Env *env, int service){
+	Job *job = &jobs[service];
+
+	busy--;
+	job->state = Job_Idle;
+	env->services[service].probe_now = 1;
+
+	if(job->next_cmd != -1){
+		job->cmd = job->next_cmd;
+		job->next_cmd = -1;
+		job->tries = 0;
+		enqueue_job(service);
+	}
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file executor.h
+ * @brief 
+ * @author Li Jiliang<tjulijiliang@gmail.com
+ * @version 1.0
+ * @date 2011-11-09
+ */
+#ifndef _EXECUTOR_H_
+#define _EXECUTOR_H_
+
+#include "hast3.h"
+
+/* the START/STOP commands waiting for the executor thread */
+#define ACTION_RING_SIZE	256
+
+#define DEFAULT_ACTION_CONCURRENCY	8
+#define DEFAULT_ACTION_TIMEOUT	60.0
+#define DEFAULT_ACTION_BACKOFF	1.0
+/* the wait before a retry grows up to so many times ActionBackoff */
+#define ACTION_BACKOFF_LIMIT	32
+/* the children are polled so often where pidfd_open(2) is missing */
+#define ACTION_POLL_INTERVAL	0.05
+
+typedef struct{
+	int service;
+	int cmd;
+} Action;
+
+int start_executor(Env *env);
+void stop_executor();
+int queue_action(Env *env, int service, int cmd);
+
+#endif
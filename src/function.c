@@ -27,49 +27,99 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <semaphore.h>
 
 #include "hast3.h"
 #include "log.h"
 #include "communicate.h"
 #include "function.h"
 #include "util.h"
-
-#define STATUS_TABLE_RESIZE	10
+#include "probe.h"
+#include "protocol.h"
+#include "reliable.h"
+#include "detector.h"
+#include "timer.h"
+#include "executor.h"
+#include "intern.h"
+#include "matrix.h"
+
+/* the status table starts with this many slots and doubles when full */
+#define STATUS_TABLE_INIT_CAP	16
+
+/* the active nodes by the interned ids of their names */
+static Active_node **id_nodes = NULL;
+static int id_nodes_cap = 0;
+
+/* the expiry timers of the active nodes */
+static Timer_wheel expiry_wheel;
+static int expiry_wheel_ready = 0;
 
 int sort_status_table(Env *env);
-int remove_dead_nodes(Env *env);
+int expire_nodes(Env *env);
+static void remove_node(Env *env, Active_node *node);
 int cmp_active_node(const void *arg1, const void *arg2);
+static int cmp_node_load(const Active_node *node1, const Active_node *node2);
+static Active_node * least_loaded(int service);
 int sort_status_table(Env *env);
 int service_shift(Env *env, const char *out_node, const char *in_node, int service);
 int resize_statue_table(Env *env);
-int free_active_node(Active_node *node);
+int free_active_node(Env *env, Active_node *node);
+static Active_node * find_active_node(const char *nodename);
+static int index_active_node(Env *env, Active_node *node);
 Active_node * malloc_active_node(Env *env);
-int update_status_table(Env *env, Hast3_message *msg, Hast3_message_entry *entries);
-void stop_service(Env *env, int service_index);
-void start_service(Env *env, int service_index);
-int get_status(Env *env,int service_index);
-int deal_service(Env* env, Hast3_message *msg, Hast3_message_entry *entry);
-
-extern sem_t mutex;
+int update_status_table(Env *env, const Hast3_packet *pkt);
+int apply_status_delta(Env *env, const Hast3_packet *pkt);
+int refresh_node(Env *env, const char *nodename);
+static void node_alive(Env *env, Active_node *node);
+static void arm_expiry(Env *env, Active_node *node);
+int update_local_node(Env *env);
+int deal_service(Env* env, const Hast3_packet *pkt, const Hast3_entry *entry);
+static void fill_statues(Active_node *node, Env *env, const Hast3_packet *pkt);
 
 /**
  * @brief perform suitable actions according to the message type, i.e. update the status table if it's a broadcast message and executes the command if it's a command message
  *
  * @param env Env struct
- * @param buf address of the message
+ * @param pkt the decoded message
  *
  * @return STATUS_OK
  */
-int dispatch_message(Env* env, const char *buf){
-	Hast3_message *ptr = (Hast3_message *)buf;
+int dispatch_message(Env* env, const Hast3_packet *pkt){
 	int i;
 
-	if(ptr->type == HAST3_MSG_CMD)
-		for(i = 0; i < ptr->field_num; i++)
-			deal_service(env, ptr, &ptr->data[i]);
-	else if(ptr->type == HAST3_MSG_BCAST)
-		update_status_table(env, ptr, ptr->data);
+	if(pkt->type == HAST3_MSG_CMD){
+		/* 
+		 * acknowledge before running the commands, which may take long,
+		 * the retransmits of the commands already run are acknowledged
+		 * again and dropped, the v1 CMD has serial 0 and is neither
+		 * acknowledged nor retransmitted
+		 */
+		if(pkt->serial != 0){
+			send_ack(env, pkt->nodename, pkt->serial);
+			if(seen_cmd(pkt->nodename, pkt->serial)){
+				if(debug_level > 0)
+					write_log(DEBUG, "Drop duplicated CMD %u from node [%s]",
+							pkt->serial, pkt->nodename);
+				return STATUS_OK;
+			}
+		}
+		for(i = 0; i < pkt->field_num; i++)
+			deal_service(env, pkt, &pkt->data[i]);
+	}
+	else if(pkt->type == HAST3_MSG_ACK)
+		ack_cmd(pkt->nodename, pkt->serial);
+	/* the row of the local node is filled by update_local_node() */
+	else if((pkt->type == HAST3_MSG_BCAST || pkt->type == HAST3_MSG_DELTA) &&
+			strcmp(pkt->nodename, env->nodename) == 0)
+		return STATUS_OK;
+	else if(pkt->type == HAST3_MSG_BCAST)
+		update_status_table(env, pkt);
+	else if(pkt->type == HAST3_MSG_DELTA)
+		apply_status_delta(env, pkt);
+	else if(pkt->type == HAST3_MSG_SNAPREQ){
+		if(debug_level > 0)
+			write_log(DEBUG, "Node [%s] asks for a snapshot", pkt->nodename);
+		env->snapshot_requested = 1;
+	}
 	else{
 		write_log(WARN, "Ignore malformed message");
 	}
@@ -77,162 +127,263 @@ int dispatch_message(Env* env, const char *buf){
 }
 
 /**
- * @brief executes the command
+ * @brief hand the command over to the executor thread
  *
  * @param env Env struct
- * @param msg message header
- * @param entry message entry
+ * @param pkt message header
+ * @param entry message entry, whose service is known to this node
  *
  * @return STATUS_OK on success and STATUS_CMD_ERR on failure
  */
-int deal_service(Env* env, Hast3_message *msg, Hast3_message_entry *entry){
-	int i;
-	for(i = 0; i < env->service_num; i++)
-		if(strcmp(entry->service_name, env->services[i].name) == 0)
-			break;
-	if(i < env->service_num){
-		if(entry->cmd_or_status == HAST3_CMD_START){
-			write_log(INFO, "Get CMD from node [%s] to start service [%s]",
-					msg->nodename, entry->service_name);
-			start_service(env, i);
-		}
-		else if(entry->cmd_or_status == HAST3_CMD_STOP){
-			write_log(INFO, "Get CMD from node [%s] to stop service [%s]",
-					msg->nodename, entry->service_name);
-			stop_service(env, i);
-		}
-		else{
-			write_log(ERROR, "Unknown CMD from node [%s]",
-					msg->nodename);
-			return STATUS_CMD_ERR;
-		}
+int deal_service(Env* env, const Hast3_packet *pkt, const Hast3_entry *entry){
+	int i = entry->service;
+
+	if(entry->cmd_or_status == HAST3_CMD_START){
+		write_log(INFO, "Get CMD from node [%s] to start service [%s]",
+				pkt->nodename, env->services[i].name);
+		return queue_action(env, i, HAST3_CMD_START);
 	}
-	else{
-		write_log(ERROR, "Unknown service [%s] from node [%s]",
-				entry->service_name, msg->nodename);
-		return STATUS_CMD_ERR;
+	else if(entry->cmd_or_status == HAST3_CMD_STOP){
+		write_log(INFO, "Get CMD from node [%s] to stop service [%s]",
+				pkt->nodename, env->services[i].name);
+		return queue_action(env, i, HAST3_CMD_STOP);
 	}
-	return STATUS_OK;
+	write_log(ERROR, "Unknown CMD from node [%s]", pkt->nodename);
+	return STATUS_CMD_ERR;
 }
 
 /**
- * @brief start the service if it's not already started
+ * @brief the probe of the collect process, if it's recent enough and taken after the last START/STOP
  *
- * @param env Env struct 
+ * @param env Env struct
  * @param service_index the index of the service
+ *
+ * @return the status, -2 if the service has to be probed again
  */
-void start_service(Env *env, int service_index){
-	int ind = service_index, status;
-
-	/* if the service is already running, return imediately */
-	status = get_status(env, service_index);
-	if(status == 0)
-		return;
-
-	sem_wait(&mutex);
-	do{
-		if(wrap_system(env->services[ind].startcmd) == 0){
-			env->services[ind].tried_cnt = 0;
-			break;
-		}
-		env->services[ind].tried_cnt++;
-	} while(env->services[ind].tried_cnt <= env->max_try_no);
-	sem_post(&mutex);
+int cached_status(Env *env, int service_index){
+	int result, status;
+	double probed_at;
+	Service *service = &env->services[service_index];
+
+	read_local_status(service, &result, &status, &probed_at);
+	if(result != -1 && probed_at > service->acted_at &&
+			probed_at + env->status_max_age >= monotonic_time()){
+		if(debug_level > 2)
+			write_log(DEBUG, "Reuse the probe of service [%s]: %d",
+					service->name, result);
+		return result;
+	}
+	return -2;
 }
 
 /**
- * @brief stop the service if it's running
+ * @brief update the status table
  *
  * @param env Env struct
- * @param service_index the index of the service
+ * @param pkt a full snapshot, the services missing in it are taken as not running
+ *
+ * @return 0 on success and 1 on failure
  */
-void stop_service(Env *env, int service_index){
-	int ind = service_index, i;
+int update_status_table(Env *env, const Hast3_packet *pkt){
+	int i;
+	Active_node *node;
+
+	/* update the entry */
+	node = find_active_node(pkt->nodename);
+	if(node != NULL){
+		if(debug_level > 0){
+			write_log(DEBUG, "Update status info of node [%s]",
+					pkt->nodename);
+		}
 
-	/* if the service is not running, return imediately */
-	if(get_status(env, service_index) != 0)
-		return;
+		fill_statues(node, env, pkt);
+		node_alive(env, node);
+		return 0;
+	}
+
+	/* insert the new entry */
+	/* more memory should be malloced */
+	if(env->active_node_num >= env->active_node_cap){
+		/* if fails to resize status table, return imediately */
+		if(resize_statue_table(env) != 0){
+			write_log(ERROR, "Failed to resize status table");
+			return 1;
+		}
+	}
+	i = env->active_node_num;
+	node = malloc_active_node(env);
+	/* malloc new nodes failed */
+	if(node == NULL){
+		write_log(ERROR, "Failed to malloc new Active_node");
+		return 1;
+	}
+	if(debug_level > 0){
+		write_log(DEBUG, "Insert status info of node [%s]",
+				pkt->nodename);
+	}
 
-	for(i = 0; i < MAX_TRY_NUM; i++)
-		if(wrap_system(env->services[ind].stopcmd) == 0)
-			break;
+	strcpy(node->nodename, pkt->nodename);
+	if(index_active_node(env, node) != 0){
+		write_log(ERROR, "Failed to index node [%s]", pkt->nodename);
+		free_active_node(env, node);
+		return 1;
+	}
+	env->nodes[i] = node;
+	node->slot = i;
+	fill_statues(node, env, pkt);
+	node_alive(env, node);
+	env->active_node_num++;
+	return 0;
 }
 
 /**
- * @brief get the status of specified service
+ * @brief keep the node in the status table without changing its statues, for the nodes known to be alive by other means than their heartbeats
  *
  * @param env Env struct
- * @param service_index the index of the service
+ * @param nodename name of the node
+ *
+ * @return 0 on success and 1 if the node is not in the table
+ */
+int refresh_node(Env *env, const char *nodename){
+	Active_node *node = find_active_node(nodename);
+
+	if(node == NULL)
+		return 1;
+	node_alive(env, node);
+	return 0;
+}
+
+/**
+ * @brief apply a delta heartbeat to the snapshot of the node, a snapshot is requested if it's missing or out of date
+ *
+ * @param env Env struct
+ * @param pkt the delta heartbeat
  *
- * @return the status on success and -1 on failure
+ * @return 0 on success and 1 if the delta cannot be applied
  */
-int get_status(Env *env,int service_index){
-	int i, status;
-	for(i = 0; i < MAX_TRY_NUM; i++){
-		status = wrap_system(env->services[service_index].statecmd);
-		if(status != -1)
-			return status;
-		usleep(10);
+int apply_status_delta(Env *env, const Hast3_packet *pkt){
+	int j;
+	Active_node *node = find_active_node(pkt->nodename);
+
+	if(node == NULL || !node->has_snapshot || node->generation != pkt->serial){
+		if(debug_level > 0)
+			write_log(DEBUG, "Missing snapshot %d of node [%s], request it",
+					pkt->serial, pkt->nodename);
+		request_snapshot(env, pkt->nodename);
+		/* the node is alive anyway */
+		if(node != NULL)
+			node_alive(env, node);
+		return 1;
 	}
-	return -1;
+
+	/* the delta is against the snapshot, not the last delta */
+	load_node_view(node->statues, node->id, node->snapshot, env->service_num);
+	for(j = 0; j < pkt->field_num; j++)
+		set_node_status(node->statues, node->id, pkt->data[j].service,
+				pkt->data[j].cmd_or_status);
+	node_alive(env, node);
+	return 0;
 }
 
 /**
- * @brief update the status table
+ * @brief note a sign of life of the node and push back its expiry
  *
  * @param env Env struct
- * @param msg message header
- * @param entries message entries
+ * @param node Active_node struct
+ */
+static void node_alive(Env *env, Active_node *node){
+	node->last_update = monotonic_ns();
+	record_arrival(&node->arrivals, (double)node->last_update / 1000000000.0);
+	arm_expiry(env, node);
+}
+
+/**
+ * @brief arm the expiry timer of the node at the earlier of the time its phi reaches phi_threshold and dead_time after its last heartbeat
  *
- * @return 0 on success and 1 on failure
+ * @param env Env struct
+ * @param node Active_node struct
  */
-int update_status_table(Env *env, Hast3_message *msg, Hast3_message_entry *entries){
-	int i, j;
-	for(i = 0; i < env->active_node_num; i++)
-		/* update the entry */
-		if(strcmp(env->nodes[i]->nodename, msg->nodename) == 0){
-			if(debug_level > 0){
-				write_log(DEBUG, "Update status info of node [%s]",
-						msg->nodename);
-			}
+static void arm_expiry(Env *env, Active_node *node){
+	uint64_t expires;
+	double at;
 
-			for(j = 0; j < env->service_num; j++)
-				env->nodes[i]->statues[j] = entries[j].cmd_or_status;
-			time(&env->nodes[i]->last_update);
-			return 0;
-		}
+	if(!expiry_wheel_ready){
+		init_timer_wheel(&expiry_wheel, monotonic_ns());
+		expiry_wheel_ready = 1;
+	}
 
-	/* insert the new entry */
-	if(i >= env->active_node_num){
-		/* more memory should be malloced */
-		if(env->active_node_num >= env->active_node_cap){
-			/* if fails to resize status table, return imediately */
-			if(resize_statue_table(env) != 0){
-				write_log(ERROR, "Failed to resize status table");
-				return 1;
-			}
+	/* the local node lives as long as its collect process */
+	if(strcmp(node->nodename, env->nodename) == 0)
+		expires = (uint64_t)((env->local_heartbeat_at + env->dead_time) *
+				1000000000.0);
+	else{
+		expires = node->last_update + (uint64_t)(env->dead_time * 1000000000.0);
+		/* 
+		 * a heartbeat may be lost without suspicion, and the jitter is
+		 * taken as at least a quarter of the interval
+		 */
+		if(env->phi_threshold > 0.0){
+			at = phi_deadline(&node->arrivals, env->phi_threshold,
+					env->ha_interval / 4, env->ha_interval);
+			if(at >= 0.0 && at * 1000000000.0 < (double)expires)
+				expires = (uint64_t)(at * 1000000000.0);
 		}
-		i = env->active_node_num;
-		env->nodes[i] = malloc_active_node(env);
-		if(env->nodes[i] != NULL){
-			if(debug_level > 0){
-				write_log(DEBUG, "Insert status info of node [%s]",
-						msg->nodename);
-			}
+	}
+	node->expiry.data = node;
+	add_timer(&expiry_wheel, &node->expiry, expires);
+}
 
-			strcpy(env->nodes[i]->nodename, msg->nodename);
-			for(j = 0; j < env->service_num; j++)
-				env->nodes[i]->statues[j] = entries[j].cmd_or_status;
-			time(&env->nodes[i]->last_update);
-			env->active_node_num++;
-		}
-		/* malloc new nodes failed */
-		else{
-			write_log(ERROR, "Failed to malloc new Active_node");
+/**
+ * @brief fill the statues of the node from a full snapshot and keep them as the base of the following delta heartbeats
+ *
+ * @param node Active_node struct, in the status table
+ * @param env Env struct
+ * @param pkt the full snapshot
+ */
+static void fill_statues(Active_node *node, Env *env, const Hast3_packet *pkt){
+	int j;
+
+	init_status_view(node->snapshot, env->service_num);
+	for(j = 0; j < pkt->field_num; j++)
+		put_view_status(node->snapshot, pkt->data[j].service,
+				pkt->data[j].cmd_or_status);
+	load_node_view(node->statues, node->id, node->snapshot, env->service_num);
+	node->generation = pkt->serial;
+	node->has_snapshot = 1;
+}
+
+/**
+ * @brief update the row of the local node from the statuses published by the collect process, without waiting for its own heartbeat
+ *
+ * @param env Env struct
+ *
+ * @return 0 on success and 1 on failure
+ */
+int update_local_node(Env *env){
+	static Hast3_packet *pkt = NULL;
+	int i, result, status;
+	double probed_at;
+
+	/* the collect process is gone, so let the local node expire */
+	if(env->local_heartbeat_at + env->dead_time < monotonic_time())
+		return 1;
+
+	if(pkt == NULL){
+		pkt = alloc_packet(env);
+		if(pkt == NULL)
 			return 1;
-		}
-		return 0;
+		strcpy(pkt->nodename, env->nodename);
+		pkt->type = HAST3_MSG_BCAST;
+		pkt->field_num = env->service_num;
+	}
+
+	for(i = 0; i < env->service_num; i++){
+		read_local_status(&env->services[i], &result, &status, &probed_at);
+		pkt->data[i].service = i;
+		pkt->data[i].cmd_or_status = (short)status;
 	}
+
+	return update_status_table(env, pkt);
 }
 
 /**
@@ -245,10 +396,19 @@ int update_status_table(Env *env, Hast3_message *msg, Hast3_message_entry *entri
 Active_node * malloc_active_node(Env *env){
 	Active_node *tmp = (Active_node *)calloc(1, sizeof(Active_node));
 	if(tmp != NULL){
-		tmp->statues = (int *)calloc(env->service_num, sizeof(int));
-		if(tmp->statues != NULL)
+		tmp->statues = (uint64_t *)malloc(STATUS_VIEW_WORDS(env->service_num) *
+				sizeof(uint64_t));
+		tmp->snapshot = (uint64_t *)malloc(STATUS_VIEW_WORDS(env->service_num) *
+				sizeof(uint64_t));
+		tmp->id = -1;
+		if(tmp->statues != NULL && tmp->snapshot != NULL){
+			init_status_view(tmp->statues, env->service_num);
+			init_status_view(tmp->snapshot, env->service_num);
 			return tmp;
+		}
 		else{
+			free(tmp->statues);
+			free(tmp->snapshot);
 			free(tmp);
 			return NULL;
 		}
@@ -257,15 +417,98 @@ Active_node * malloc_active_node(Env *env){
 		return NULL;
 }
 
+/**
+ * @brief look up the node in the status table by its name
+ *
+ * @param nodename name of the node
+ *
+ * @return the node, NULL if it's not in the table
+ */
+static Active_node * find_active_node(const char *nodename){
+	int id = find_name(nodename);
+
+	if(id < 0 || id >= id_nodes_cap)
+		return NULL;
+	return id_nodes[id];
+}
+
+/**
+ * @brief intern the name of the node, index the node by the id and put its statues into the status matrix
+ *
+ * @param env Env struct
+ * @param node the node to be inserted into the status table
+ *
+ * @return 0 on success and 1 on failure
+ */
+static int index_active_node(Env *env, Active_node *node){
+	Active_node **tmp;
+	int id, cap;
+
+	id = intern_name(node->nodename);
+	if(id < 0)
+		return 1;
+	if(id >= id_nodes_cap){
+		cap = id_nodes_cap > 0 ? id_nodes_cap * 2 : STATUS_TABLE_INIT_CAP;
+		while(cap <= id)
+			cap *= 2;
+		tmp = (Active_node **)realloc(id_nodes, cap * sizeof(Active_node *));
+		if(tmp == NULL){
+			release_name(id);
+			return 1;
+		}
+		memset(tmp + id_nodes_cap, 0,
+				(cap - id_nodes_cap) * sizeof(Active_node *));
+		id_nodes = tmp;
+		id_nodes_cap = cap;
+	}
+	if(resize_status_matrix(env->service_num, id_nodes_cap) != 0){
+		release_name(id);
+		return 1;
+	}
+	id_nodes[id] = node;
+	node->id = id;
+	attach_node(node->statues, id, env->service_num);
+	return 0;
+}
+
+/**
+ * @brief free the status table and its index
+ *
+ * @param env Env struct
+ */
+void free_status_table(Env *env){
+	int i;
+
+	for(i = 0; i < env->active_node_num; i++)
+		free_active_node(env, env->nodes[i]);
+	free(env->nodes);
+	env->nodes = NULL;
+	env->active_node_num = 0;
+	env->active_node_cap = 0;
+	free(id_nodes);
+	id_nodes = NULL;
+	id_nodes_cap = 0;
+	free_status_matrix();
+	free_names();
+}
+
 /**
  * @brief free the Active_node struct
  *
+ * @param env Env struct
  * @param node pointer to Active_node struct
  *
  * @return 0
  */
-int free_active_node(Active_node *node){
+int free_active_node(Env *env, Active_node *node){
+	del_timer(&expiry_wheel, &node->expiry);
+	if(node->id >= 0 && node->id < id_nodes_cap && id_nodes[node->id] == node){
+		detach_node(node->statues, node->id, env->service_num);
+		id_nodes[node->id] = NULL;
+		release_name(node->id);
+	}
 	free(node->statues);
+	free(node->snapshot);
 	free(node);
 	return 0;
 }
@@ -279,7 +522,9 @@ int free_active_node(Active_node *node){
  */
 int resize_statue_table(Env *env){
 	Active_node **tmp = env->nodes;
-	int new_compacity = env->active_node_cap + STATUS_TABLE_RESIZE;
+	/* grow geometrically so that the inserts are amortized O(1) */
+	int new_compacity = env->active_node_cap > 0 ?
+		env->active_node_cap * 2 : STATUS_TABLE_INIT_CAP;
 
 	tmp = realloc(tmp, new_compacity * sizeof(Active_node *));
 	if(tmp == NULL)
@@ -298,54 +543,76 @@ int resize_statue_table(Env *env){
  * @return 0 on success
  */
 int routine_check(Env *env){
-	int active_node_num, i, j, k;
-	Active_node ** nodes;
-	int *statues;
+	int active_node_num, i, j, k, id;
+	Active_node ** nodes, *node;
+	static unsigned long overruns = 0;
+	static unsigned dropped = 0, queue_dropped = 0;
+	unsigned count;
+	/* the status changes seen by the last check and if it did nothing */
+	static unsigned long checked = 0;
+	static int settled = 0;
 
 	/* none or multiple service(s) flag */
 	int mul_or_none_flag = 0;
 	/* break all loop flag */
 	int break_all = 0;
 
-	remove_dead_nodes(env);
-	sort_status_table(env);
+	if(env->heartbeat_overruns != overruns){
+		write_log(WARN, "Collect process missed %lu heartbeat(s) since "
+				"the last check", env->heartbeat_overruns - overruns);
+		overruns = env->heartbeat_overruns;
+	}
+	/* counted by the receiver thread */
+	count = __atomic_load_n(&env->recv_dropped, __ATOMIC_RELAXED);
+	if(count != dropped){
+		write_log(WARN, "Dropped %u message(s) for the full receive buffer "
+				"since the last check", count - dropped);
+		dropped = count;
+	}
+	count = __atomic_load_n(&env->queue_dropped, __ATOMIC_RELAXED);
+	if(count != queue_dropped){
+		write_log(WARN, "Dropped %u message(s) for the full queue of the "
+				"decision thread since the last check", count - queue_dropped);
+		queue_dropped = count;
+	}
+
+	update_local_node(env);
+	expire_nodes(env);
 
 	nodes = env->nodes;
 	active_node_num = env->active_node_num;
 	if(active_node_num <= 0)
 		return 0;
 
-	statues = (int *)calloc(env->service_num, sizeof(int));
-	if(statues == NULL)
-		return 1;
-
-	for(i = 0; i < env->service_num; i++)
-		for(j = 0; j < active_node_num; j++)
-			if(nodes[j]->statues[i] == Service_Running)
-				statues[i]++;
-	for(i = 0; i < env->service_num; i++)
-		if(statues[i] != 1){
-			mul_or_none_flag = 1;
-			break;
-		}
+	/* 
+	 * the decisions only depend on the status table, so a check which
+	 * found nothing to do holds until the table changes
+	 */
+	if(settled && checked == status_changes())
+		return 0;
+	checked = status_changes();
 
-	if(mul_or_none_flag){
+	/* 
+	 * every service running on none or multiple nodes is dealt with in
+	 * the same pass, the commands are sent together at the end
+	 */
+	for(i = next_unsettled(0); i >= 0; i = next_unsettled(i + 1)){
+		mul_or_none_flag = 1;
 		/* none service i is running */
-		if(statues[i] == 0){
+		if(running_count(i) == 0){
 			/* 
-			 * find the node who has the lowest load and whose status of
-			 * service i is not Service_Failed, then ask it to start
-			 * service i
+			 * find the node who has the lowest load, including the services
+			 * it's told to start in this pass, and whose status of service
+			 * i is not Service_Failed, then ask it to start service i
 			 */
-			for(j = 0; j < active_node_num; j++)
-				if(env->nodes[j]->statues[i] != Service_Failed)
-					break;
+			node = least_loaded(i);
+			if(node == NULL)
+				continue;
 
-			send_cmd_to_node(env, nodes[j]->nodename,
-							 env->services[i].name,
-							 HAST3_CMD_START);
+			plan_load(node->id, 1);
+			queue_cmd_to_node(env, node->nodename, i, HAST3_CMD_START);
 			write_log(INFO, "Tell node [%s] to START service [%s]",
-					nodes[j]->nodename,
+					node->nodename,
 					env->services[i].name);
 		}
 		/* multiple services are running */
@@ -354,37 +621,45 @@ int routine_check(Env *env){
 			 * find the node who has the lowest load and whose service i
 			 * is running
 			 */
-			for(j = 0; j < active_node_num; j++)
-				if(nodes[j]->statues[i] == Service_Running)
-					break;
+			node = NULL;
+			for(id = next_node(Service_Running, i, 0); id >= 0;
+					id = next_node(Service_Running, i, id + 1))
+				if(node == NULL || cmp_node_load(id_nodes[id], node) < 0)
+					node = id_nodes[id];
 
 			/* 
 			 * All the other nodes whose service i is running should be 
 			 * commanded to shutdown their service i
 			 */
-			for(j++; j < active_node_num; j++)
-				if(nodes[j]->statues[i] == Service_Running){
-					send_cmd_to_node(env, nodes[j]->nodename,
-							         env->services[i].name,
-									 HAST3_CMD_STOP);
-					write_log(INFO, "Tell node [%s] to STOP service [%s]",
-							nodes[j]->nodename,
-							env->services[i].name);
-				}
+			for(id = next_node(Service_Running, i, 0); id >= 0;
+					id = next_node(Service_Running, i, id + 1)){
+				if(id_nodes[id] == node)
+					continue;
+				plan_load(id, -1);
+				queue_cmd_to_node(env, id_nodes[id]->nodename, i,
+						HAST3_CMD_STOP);
+				write_log(INFO, "Tell node [%s] to STOP service [%s]",
+						id_nodes[id]->nodename,
+						env->services[i].name);
+			}
 		}
 	}
+	clear_planned_loads();
+
 	/* 
 	 * All the services are running with one and only one instance,
-	 * now check if service shift is needed 
+	 * now check if service shift is needed, only the table sorted by
+	 * load tells which pair to shift between
 	 */
-	else{
-		break_all = 0;
+	if(!mul_or_none_flag && most_load() - least_load() >= 2){
+		sort_status_table(env);
 		for(i = 0; i < active_node_num; i++){
-			for(j = active_node_num-1; i < j && nodes[i]->service_cnt + 
-					2 <= nodes[j]->service_cnt; j--){
-				for(k = 0; k < env->service_num; k++){
-					if(nodes[j]->statues[k] == Service_Running &&
-							nodes[i]->statues[k] != Service_Failed){
+			for(j = active_node_num-1; i < j && node_load(nodes[i]->id) +
+					2 <= node_load(nodes[j]->id); j--){
+				for(k = next_running(nodes[j]->statues, env->service_num, 0);
+						k >= 0; k = next_running(nodes[j]->statues,
+							env->service_num, k + 1)){
+					if(!node_has_status(Service_Failed, k, nodes[i]->id)){
 						service_shift(env, nodes[j]->nodename, 
 								nodes[i]->nodename, k);
 						break_all = 1;
@@ -398,8 +673,10 @@ int routine_check(Env *env){
 				break;
 		}
 	}
+	/* the commands are sent again on the next check till they take effect */
+	settled = !mul_or_none_flag && !break_all;
 
-	free(statues);
+	flush_cmds(env);
 	return 0;
 }
 
@@ -416,8 +693,8 @@ int routine_check(Env *env){
 int service_shift(Env *env, const char *out_node, const char *in_node, int service){
 	write_log(INFO, "Shifting service [%s] from node [%s] to node [%s]",
 			env->services[service].name, out_node, in_node);
-	send_cmd_to_node(env, out_node, env->services[service].name, HAST3_CMD_STOP);
-	send_cmd_to_node(env, in_node, env->services[service].name, HAST3_CMD_START);
+	queue_cmd_to_node(env, out_node, service, HAST3_CMD_STOP);
+	queue_cmd_to_node(env, in_node, service, HAST3_CMD_START);
 	return 0;
 }
 
@@ -429,22 +706,58 @@ int service_shift(Env *env, const char *out_node, const char *in_node, int servi
  * @return 0
  */
 int sort_status_table(Env *env){
-	int active_node_num, i, j, count;
-	Active_node **nodes;
+	int i;
 
-	nodes = env->nodes;
-	active_node_num = env->active_node_num;
-	for(i = 0; i < active_node_num; i++){
-		count = 0;
-		for(j = 0; j < env->service_num; j++)
-			if(nodes[i]->statues[j] == Service_Running)
-				count++;
-		nodes[i]->service_cnt = count;
-	}
-	qsort(nodes, active_node_num, sizeof(Active_node *), cmp_active_node);
+	qsort(env->nodes, env->active_node_num, sizeof(Active_node *),
+			cmp_active_node);
+	for(i = 0; i < env->active_node_num; i++)
+		env->nodes[i]->slot = i;
 	return 0;
 }
 
+/**
+ * @brief find the node to start the service on, whose planned load is the lowest and whose status of the service is not Service_Failed, the ties are broken by name
+ *
+ * the planned load is the node_load() of cmp_node_load() plus the STARTs
+ * and STOPs sent to the node in this pass, so before any is sent the node
+ * is the first one of the sorted status table
+ *
+ * @param service index of the service, which is running nowhere
+ *
+ * @return the node, NULL if every node has failed to run the service
+ */
+static Active_node * least_loaded(int service){
+	Active_node *node = NULL;
+	int load, id;
+
+	/* none is running it, so the nodes not failed are the nonrunning ones */
+	for(load = least_load(); node == NULL && load >= 0 && load <= most_load();
+			load++)
+		for(id = first_at_load(load); id >= 0; id = next_at_load(id))
+			if(node_has_status(Service_Nonrunning, service, id) &&
+					(node == NULL ||
+					 strcmp(id_nodes[id]->nodename, node->nodename) < 0))
+				node = id_nodes[id];
+	return node;
+}
+
+/**
+ * @brief compares two Active_node by the services running on them and then by name
+ *
+ * @param node1 Active_node struct
+ * @param node2 Active_node struct
+ *
+ * @return 1 if greater, 0 if equal, -1 otherwise
+ */
+static int cmp_node_load(const Active_node *node1, const Active_node *node2){
+	if(node_load(node1->id) < node_load(node2->id))
+		return -1;
+	else if(node_load(node1->id) > node_load(node2->id))
+		return 1;
+	else
+		return strcmp(node1->nodename, node2->nodename);
+}
+
 /**
  * @brief compares two Active_node
  *
@@ -454,44 +767,79 @@ int sort_status_table(Env *env){
  * @return 1 if greater, 0 if equal, -1 otherwise
  */
 int cmp_active_node(const void *arg1, const void *arg2){
-	Active_node *pnode1 = *(Active_node **)arg1;
-	Active_node *pnode2 = *(Active_node **)arg2;
-	if(pnode1 -> service_cnt < pnode2 -> service_cnt)
-		return -1;
-	else if(pnode1 -> service_cnt > pnode2 ->service_cnt)
-		return 1;
-	else
-		return strcmp(pnode1->nodename, pnode2->nodename);
+	return cmp_node_load(*(Active_node * const *)arg1,
+			*(Active_node * const *)arg2);
 }
 
 /**
- * @brief remove the nodes who haven't annonced for dead_time interval
+ * @brief remove the nodes whose expiry timers have fired, that is whose phi has reached phi_threshold or who haven't annonced for dead_time interval
  *
  * @param env Env struct
  *
  * @return number of deleted items
  */
-int remove_dead_nodes(Env *env){
-	int active_node_num, i, j, delete_cnt=0;
-	Active_node **nodes;
-	time_t now;
+int expire_nodes(Env *env){
+	Timer *timer, *next;
+	Active_node *node;
+	uint64_t now;
+	int local, delete_cnt = 0;
 
-	time(&now);
-	active_node_num = env->active_node_num;
-	nodes = env->nodes;
-	for(i = 0; i < active_node_num; ){
-		if(nodes[i]->last_update < now - env->dead_time){
-			write_log(INFO, "Node: [%s] inactive, delete it now", 
-					nodes[i]->nodename);
-			free_active_node(nodes[i]);
-			delete_cnt++;
-			for(j = i+1; j < active_node_num; j++)
-				env->nodes[j-1] = env->nodes[j];
-			active_node_num--;
-		}
+	if(!expiry_wheel_ready)
+		return 0;
+
+	now = monotonic_ns();
+	for(timer = expire_timers(&expiry_wheel, now); timer != NULL; timer = next){
+		next = timer->next;
+		node = (Active_node *)timer->data;
+
+		/* the row is re-armed as long as the collect process runs */
+		local = strcmp(node->nodename, env->nodename) == 0;
+		if(local && update_local_node(env) == 0)
+			continue;
+
+		if(!local && (double)(now - node->last_update) <
+				env->dead_time * 1000000000.0)
+			write_log(INFO, "Node: [%s] inactive with phi %.1f, delete it now",
+					node->nodename, phi(&node->arrivals,
+						(double)now / 1000000000.0, env->ha_interval / 4,
+						env->ha_interval));
 		else
-			i++;
+			write_log(INFO, "Node: [%s] inactive, delete it now", 
+					node->nodename);
+		remove_node(env, node);
+		delete_cnt++;
 	}
-	env->active_node_num = active_node_num;
 	return delete_cnt;
 }
+
+/**
+ * @brief the time till the next node may expire
+ *
+ * @return time in seconds, 0 if it's due and -1 if no node is active
+ */
+double next_expiry(){
+	int64_t next;
+	uint64_t now;
+
+	if(!expiry_wheel_ready || (next = next_timer(&expiry_wheel)) < 0)
+		return -1.0;
+	now = monotonic_ns();
+	if((uint64_t)next <= now)
+		return 0.0;
+	return (double)((uint64_t)next - now) / 1000000000.0;
+}
+
+/**
+ * @brief remove the node from the status table, the last node takes its place
+ *
+ * @param env Env struct
+ * @param node Active_node struct in the table
+ */
+static void remove_node(Env *env, Active_node *node){
+	int last = --env->active_node_num;
+
+	env->nodes[node->slot] = env->nodes[last];
+	env->nodes[node->slot]->slot = node->slot;
+	env->nodes[last] = NULL;
+	free_active_node(env, node);
+}
@@ -19,7 +19,13 @@
 #ifndef _FUNCTION_H_
 #define _FUNCTION_H_
 
-int dispatch_message(Env* env, const char *buf);
+int dispatch_message(Env* env, const Hast3_packet *pkt);
 int routine_check(Env *env);
+int update_status_table(Env *env, const Hast3_packet *pkt);
+int refresh_node(Env *env, const char *nodename);
+int expire_nodes(Env *env);
+double next_expiry();
+int cached_status(Env *env, int service_index);
+void free_status_table(Env *env);
 
 #endif
@@ -0,0 +1,957 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/**
+ * @file gossip.c
+ * @brief the unicast transport which replaces the multicast heartbeats, the nodes find each other from a few seeds and probe each other SWIM-style, the changes of membership and of the service statuses are piggybacked on the probes and spread to the whole cluster in O(log N) protocol periods
+ * @author Li Jiliang<tjulijiliang@gmail.com
+ * @version 1.0
+ * @date 2011-11-09
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hast3.h"
+#include "function.h"
+#include "gossip.h"
+#include "peer.h"
+#include "probe.h"
+#include "protocol.h"
+#include "util.h"
+
+#define SEED_RESIZE	4
+#define MEMBER_TABLE_RESIZE	16
+/* the PINGREQs served for other nodes at the same time */
+#define RELAY_SLOTS	16
+/* bit 7 of the state byte of a record tells the statuses follow */
+#define RECORD_HAS_STATUS	0x80
+
+enum Member_state{
+	Member_Alive=0,
+	Member_Suspect,
+	Member_Dead
+};
+
+static const char *state_names[] = {"alive", "suspect", "dead"};
+
+typedef struct{
+	char name[NAMELEN];
+	/* where its hast3 listens, 0 for the local node */
+	struct sockaddr_in addr;
+	int state;
+	unsigned incarnation;
+	/* monotonic time of the last change of state */
+	double changed_at;
+	/* the record is piggybacked on so many more messages */
+	int transmits;
+	/* the statuses packed 2 bits per service in the order of the ids */
+	int has_status;
+	unsigned short version;
+	int status_num;
+	unsigned char *packed;
+} Member;
+
+/* a record as read from a message */
+typedef struct{
+	char name[NAMELEN];
+	struct sockaddr_in addr;
+	int state;
+	unsigned incarnation;
+	int has_status;
+	unsigned short version;
+	int status_num;
+	const unsigned char *packed;
+} Record;
+
+/* a PINGREQ being served for another node */
+typedef struct{
+	unsigned short seq;
+	unsigned short origin_seq;
+	struct sockaddr_in origin;
+	double expires_at;
+	int in_use;
+} Relay;
+
+static struct sockaddr_in *seeds = NULL;
+static int seed_num = 0;
+static int seed_cap = 0;
+
+/* sorted by name, the local node included */
+static Member **members = NULL;
+static int member_num = 0;
+static int member_cap = 0;
+static Member *me = NULL;
+/* the members in the random order they are probed in this round */
+static Member **order = NULL;
+static int order_num = 0;
+static int order_next = 0;
+/* where the piggybacked records start in members */
+static int piggyback_next = 0;
+
+static Relay relays[RELAY_SLOTS];
+
+/* the probe of this protocol period */
+static Member *target = NULL;
+static unsigned short probe_seq = 0;
+static int acked = 0;
+static int indirect_sent = 0;
+static double period_at = 0.0;
+static unsigned long periods = 0;
+static unsigned short gossip_seq = 0;
+
+static unsigned char send_buf[MAXBUFSIZE];
+static unsigned char *own_packed = NULL;
+static Hast3_packet *feed_pkt = NULL;
+
+static void start_period(Env *env, double now);
+static void check_probe(Env *env, double now);
+static Member * next_target(Env *env, double now);
+static void refresh_own_status(Env *env);
+static void feed_node(Env *env, const Member *m);
+static Member * apply_record(Env *env, const Record *rec, double now);
+static int overrides(const Record *rec, const Member *m);
+static void change_state(Member *m, int state, double now);
+static int send_gossip(Env *env, int type, unsigned short serial,
+		const struct sockaddr_in *to, const struct sockaddr_in *subject);
+static int put_record(unsigned char *p, const unsigned char *end,
+		const Member *m, int with_status);
+static int get_record(const unsigned char **p, const unsigned char *end,
+		Record *rec);
+static int retransmit_limit();
+static int local_alive(Env *env);
+static unsigned short next_gossip_seq();
+static Member * find_member(const char *name);
+static Member * insert_member(Env *env, const char *name);
+static void purge_members(Env *env, double now);
+static int cmp_member(const void *arg1, const void *arg2);
+
+/**
+ * @brief add a seed, which is contacted while no other node is known
+ *
+ * @param env Env struct whose port is set
+ * @param seed host or address, optionally followed by :port
+ *
+ * @return 0 on success and -1 on failure
+ */
+int add_gossip_seed(Env *env, const char *seed){
+	char host[MAXSTRLEN];
+	char *colon;
+	int port = env->port;
+	struct hostent *hostinfo;
+	struct sockaddr_in *tmp;
+
+	if(strlen(seed) >= sizeof(host))
+		return -1;
+	strcpy(host, seed);
+	colon = strchr(host, ':');
+	if(colon != NULL){
+		*colon++ = '\0';
+		port = atoi(colon);
+		if(port <= 0 || port >= 65536)
+			return -1;
+	}
+
+	hostinfo = gethostbyname(host);
+	if(hostinfo == NULL)
+		return -1;
+
+	if(seed_num >= seed_cap){
+		tmp = realloc(seeds, (seed_cap + SEED_RESIZE) * sizeof(*seeds));
+		if(tmp == NULL)
+			return -1;
+		seeds = tmp;
+		seed_cap += SEED_RESIZE;
+	}
+	memset(&seeds[seed_num], 0, sizeof(*seeds));
+	seeds[seed_num].sin_family = AF_INET;
+	seeds[seed_num].sin_addr = *(struct in_addr *)*hostinfo->h_addr_list;
+	seeds[seed_num].sin_port = htons((uint16_t)port);
+	seed_num++;
+	return 0;
+}
+
+/**
+ * @brief set up the membership with the local node only, must be called before the other functions
+ *
+ * @param env Env struct
+ *
+ * @return STATUS_OK on success and STATUS_SVR_ERR on failure
+ */
+int init_gossip(Env *env){
+	struct sockaddr_in local;
+
+	srandom((unsigned)getpid() ^ (unsigned)time(NULL));
+
+	feed_pkt = alloc_packet(env);
+	own_packed = (unsigned char *)calloc((env->service_num + 3) / 4, 1);
+	me = insert_member(env, env->nodename);
+	if(feed_pkt == NULL || own_packed == NULL || me == NULL)
+		return STATUS_SVR_ERR;
+
+	/* a restarted node must override what's said about its last life */
+	me->incarnation = (unsigned)time(NULL);
+	me->state = Member_Alive;
+
+	/* the commands to the local node are sent over the loopback */
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	local.sin_port = htons((uint16_t)env->port);
+	set_peer_address(env->nodename, &local);
+
+	/* the header, the record count, the own record and the padding */
+	if(HAST3_V2_HEADER_LEN + 1 + 1 + (int)strlen(env->nodename) + 15 +
+			(env->service_num + 3) / 4 + 1 > env->max_datagram)
+		write_log(WARN, "The statuses of %d services don't fit in MaxDatagram "
+				"%d, they are not gossiped", env->service_num,
+				env->max_datagram);
+	return STATUS_OK;
+}
+
+/**
+ * @brief check if the message belongs to the gossip transport
+ *
+ * @param buf[] the message whose integrity is verified
+ * @param len length of the message
+ *
+ * @return 1 if it does and 0 if not
+ */
+int is_gossip_message(const char buf[], int len){
+	const unsigned char *ubuf = (const unsigned char *)buf;
+
+	return len >= HAST3_V2_HEADER_LEN && ubuf[0] == HAST3_V2_MAGIC0 &&
+		ubuf[1] == HAST3_V2_MAGIC1 && ubuf[3] >= HAST3_MSG_PING &&
+		ubuf[3] <= HAST3_MSG_PINGACK;
+}
+
+/**
+ * @brief apply the records piggybacked on a gossip message and answer it
+ *
+ * @param env Env struct
+ * @param buf[] the message whose integrity is verified
+ * @param len length of the message
+ * @param from source address of the message
+ *
+ * @return STATUS_OK on success and STATUS_MSG_CORRPUT on failure
+ */
+int handle_gossip(Env *env, const char buf[], int len,
+		const struct sockaddr_in *from){
+	const unsigned char *p, *end;
+	unsigned short serial;
+	struct sockaddr_in subject;
+	Record rec;
+	Member *sender = NULL;
+	Relay *relay;
+	double now = monotonic_time();
+	int type, count, i;
+
+	/* the others should find out this node is gone with its collector */
+	if(!local_alive(env))
+		return STATUS_OK;
+
+	p = (const unsigned char *)buf + HAST3_V2_HEADER_LEN;
+	end = (const unsigned char *)buf + len;
+	type = ((const unsigned char *)buf)[3];
+	serial = (unsigned short)(((const unsigned char *)buf)[8] << 8 |
+			((const unsigned char *)buf)[9]);
+
+	if(type == HAST3_MSG_PINGREQ){
+		if(end - p < 6)
+			return STATUS_MSG_CORRPUT;
+		memset(&subject, 0, sizeof(subject));
+		subject.sin_family = AF_INET;
+		memcpy(&subject.sin_addr, p, 4);
+		memcpy(&subject.sin_port, p + 4, 2);
+		p += 6;
+	}
+	if(p >= end)
+		return STATUS_MSG_CORRPUT;
+
+	/* the first record is the sender, who doesn't know its own address */
+	count = *p++;
+	for(i = 0; i < count; i++){
+		if(get_record(&p, end, &rec) != 0)
+			return STATUS_MSG_CORRPUT;
+		if(i > 0){
+			apply_record(env, &rec, now);
+			continue;
+		}
+		if(strcmp(rec.name, env->nodename) == 0)
+			return STATUS_OK;
+		if(rec.addr.sin_addr.s_addr == 0){
+			rec.addr.sin_addr = from->sin_addr;
+			rec.addr.sin_port = from->sin_port;
+		}
+		sender = apply_record(env, &rec, now);
+	}
+	if(sender == NULL)
+		return STATUS_MSG_CORRPUT;
+
+	if(type == HAST3_MSG_PING)
+		send_gossip(env, HAST3_MSG_PINGACK, serial, from, NULL);
+	else if(type == HAST3_MSG_PINGREQ){
+		for(i = 0; i < RELAY_SLOTS; i++)
+			if(!relays[i].in_use || relays[i].expires_at < now)
+				break;
+		if(i >= RELAY_SLOTS)
+			return STATUS_OK;
+		relay = &relays[i];
+		relay->seq = next_gossip_seq();
+		relay->origin_seq = serial;
+		relay->origin = *from;
+		relay->expires_at = now + env->ha_interval;
+		relay->in_use = 1;
+		send_gossip(env, HAST3_MSG_PING, relay->seq, &subject, NULL);
+	}
+	else if(type == HAST3_MSG_PINGACK && serial != 0){
+		if(target != NULL && serial == probe_seq){
+			acked = 1;
+			return STATUS_OK;
+		}
+		/* the answer to a PING sent on behalf of another node */
+		for(i = 0; i < RELAY_SLOTS; i++)
+			if(relays[i].in_use && relays[i].seq == serial){
+				relays[i].in_use = 0;
+				send_gossip(env, HAST3_MSG_PINGACK, relays[i].origin_seq,
+						&relays[i].origin, NULL);
+				break;
+			}
+	}
+
+	return STATUS_OK;
+}
+
+/**
+ * @brief how long till run_gossip() has something to do
+ *
+ * @param env Env struct
+ *
+ * @return seconds, 0 if it's overdue
+ */
+double next_gossip(Env *env){
+	double now = monotonic_time(), wait;
+
+	wait = period_at + env->ha_interval - now;
+	if(target != NULL && !acked && !indirect_sent &&
+			period_at + env->ha_interval / 3 - now < wait)
+		wait = period_at + env->ha_interval / 3 - now;
+	return wait > 0.0 ? wait : 0.0;
+}
+
+/**
+ * @brief start a new protocol period or ask for indirect probes when it's time
+ *
+ * @param env Env struct
+ *
+ * @return 0
+ */
+int run_gossip(Env *env){
+	double now = monotonic_time();
+
+	if(!local_alive(env))
+		return 0;
+
+	if(now >= period_at + env->ha_interval)
+		start_period(env, now);
+	else
+		check_probe(env, now);
+	return 0;
+}
+
+/**
+ * @brief free the membership
+ */
+void free_gossip(){
+	int i;
+
+	for(i = 0; i < member_num; i++){
+		free(members[i]->packed);
+		free(members[i]);
+	}
+	free(members);
+	free(order);
+	free(seeds);
+	free(own_packed);
+	free_packet(feed_pkt);
+	members = NULL;
+	order = NULL;
+	seeds = NULL;
+	own_packed = NULL;
+	feed_pkt = NULL;
+	me = NULL;
+	member_num = member_cap = order_num = order_next = 0;
+	seed_num = seed_cap = 0;
+}
+
+/**
+ * @brief the work of each protocol period: judge the last probe, expire the suspects, gossip the own statuses if they've changed, keep the alive nodes in the status table and probe the next node
+ *
+ * @param env Env struct
+ * @param now current monotonic time
+ */
+static void start_period(Env *env, double now){
+	int i, alive = 0;
+	Member *m;
+
+	if(target != NULL && !acked && target->state == Member_Alive){
+		write_log(INFO, "Node [%s] doesn't answer, suspect it", target->name);
+		change_state(target, Member_Suspect, now);
+	}
+	target = NULL;
+
+	/* a suspect has DeadTime to refute */
+	for(i = 0; i < member_num; i++){
+		m = members[i];
+		if(m->state == Member_Suspect && m->changed_at + env->dead_time < now){
+			write_log(INFO, "Node [%s] is dead", m->name);
+			change_state(m, Member_Dead, now);
+		}
+	}
+
+	refresh_own_status(env);
+	/* gossip the own statuses again now and then for the newcomers */
+	if(++periods % env->snapshot_interval == 0)
+		me->transmits = retransmit_limit();
+
+	/* the row of the local node is filled by update_local_node() */
+	for(i = 0; i < member_num; i++){
+		m = members[i];
+		if(m == me || m->state != Member_Alive)
+			continue;
+		alive++;
+		if(m->has_status && refresh_node(env, m->name) != 0)
+			feed_node(env, m);
+	}
+
+	target = next_target(env, now);
+	if(target != NULL){
+		probe_seq = next_gossip_seq();
+		acked = 0;
+		indirect_sent = 0;
+		send_gossip(env, HAST3_MSG_PING, probe_seq, &target->addr, NULL);
+	}
+
+	/* knock on the seeds till some node is known */
+	if(alive == 0)
+		for(i = 0; i < seed_num; i++)
+			send_gossip(env, HAST3_MSG_PING, 0, &seeds[i], NULL);
+
+	period_at = now;
+}
+
+/**
+ * @brief ask some other nodes to probe the target if it hasn't answered in a third of the period
+ *
+ * @param env Env struct
+ * @param now current monotonic time
+ */
+static void check_probe(Env *env, double now){
+	int i, start, sent = 0;
+	Member *m;
+
+	if(target == NULL || acked || indirect_sent ||
+			now < period_at + env->ha_interval / 3)
+		return;
+	indirect_sent = 1;
+
+	start = (int)(random() % member_num);
+	for(i = 0; i < member_num && sent < GOSSIP_INDIRECT_CHECKS; i++){
+		m = members[(start + i) % member_num];
+		if(m == me || m == target || m->state != Member_Alive)
+			continue;
+		send_gossip(env, HAST3_MSG_PINGREQ, probe_seq, &m->addr,
+				&target->addr);
+		sent++;
+	}
+}
+
+/**
+ * @brief pick the node to probe, each node is probed once a round in a random order
+ *
+ * @param env Env struct
+ * @param now current monotonic time
+ *
+ * @return the member on success and NULL if no other node is known
+ */
+static Member * next_target(Env *env, double now){
+	int i, j;
+	Member *m, **tmp;
+
+	while(order_next < order_num){
+		m = order[order_next++];
+		if(m->state != Member_Dead)
+			return m;
+	}
+
+	/* a new round */
+	purge_members(env, now);
+	if(member_num > order_num){
+		tmp = realloc(order, member_num * sizeof(Member *));
+		if(tmp == NULL)
+			return NULL;
+		order = tmp;
+	}
+	order_num = 0;
+	order_next = 0;
+	for(i = 0; i < member_num; i++)
+		if(members[i] != me && members[i]->state != Member_Dead)
+			order[order_num++] = members[i];
+
+	for(i = order_num - 1; i > 0; i--){
+		j = (int)(random() % (i + 1));
+		m = order[i];
+		order[i] = order[j];
+		order[j] = m;
+	}
+
+	return order_num > 0 ? order[order_next++] : NULL;
+}
+
+/**
+ * @brief pack the statuses published by the collect process, a change makes a new version to gossip
+ *
+ * @param env Env struct
+ */
+static void refresh_own_status(Env *env){
+	int i, result, status;
+	double probed_at;
+	size_t size = (env->service_num + 3) / 4;
+
+	memset(own_packed, 0, size);
+	for(i = 0; i < env->service_num; i++){
+		read_local_status(&env->services[i], &result, &status, &probed_at);
+		own_packed[i / 4] |= (unsigned char)((status & 3) << (i % 4 * 2));
+	}
+
+	if(me->has_status && memcmp(own_packed, me->packed, size) == 0)
+		return;
+	memcpy(me->packed, own_packed, size);
+	me->status_num = env->service_num;
+	me->has_status = 1;
+	me->version++;
+	me->transmits = retransmit_limit();
+}
+
+/**
+ * @brief put the statuses of the member into the status table
+ *
+ * @param env Env struct
+ * @param m the member
+ */
+static void feed_node(Env *env, const Member *m){
+	int i;
+
+	strcpy(feed_pkt->nodename, m->name);
+	feed_pkt->type = HAST3_MSG_BCAST;
+	feed_pkt->serial = m->version;
+	feed_pkt->field_num = m->status_num;
+	for(i = 0; i < m->status_num; i++){
+		feed_pkt->data[i].service = i;
+		feed_pkt->data[i].cmd_or_status =
+			(short)((m->packed[i / 4] >> (i % 4 * 2)) & 3);
+	}
+	update_status_table(env, feed_pkt);
+}
+
+/**
+ * @brief merge a record into the membership, the newer incarnation wins, and a rumor about the local node is refuted with a newer incarnation
+ *
+ * @param env Env struct
+ * @param rec the record
+ * @param now current monotonic time
+ *
+ * @return the member on success and NULL if the record is dropped
+ */
+static Member * apply_record(Env *env, const Record *rec, double now){
+	Member *m;
+	size_t size;
+
+	if(strcmp(rec->name, env->nodename) == 0){
+		if(rec->state != Member_Alive && rec->incarnation >= me->incarnation){
+			write_log(WARN, "Refute the rumor that this node is %s",
+					state_names[rec->state]);
+			me->incarnation = rec->incarnation + 1;
+			me->transmits = retransmit_limit();
+		}
+		return me;
+	}
+
+	m = find_member(rec->name);
+	if(m == NULL){
+		/* don't learn of the nodes only to bury them */
+		if(rec->state == Member_Dead || rec->addr.sin_addr.s_addr == 0)
+			return NULL;
+		m = insert_member(env, rec->name);
+		if(m == NULL){
+			write_log(ERROR, "Failed to malloc the member [%s]", rec->name);
+			return NULL;
+		}
+		write_log(INFO, "Node [%s] joins the cluster", rec->name);
+		m->state = rec->state;
+		m->incarnation = rec->incarnation;
+		m->addr = rec->addr;
+		m->changed_at = now;
+		m->transmits = retransmit_limit();
+		set_peer_address(m->name, &m->addr);
+	}
+	else if(overrides(rec, m)){
+		if(rec->state != m->state)
+			write_log(INFO, "Node [%s] is %s", m->name,
+					state_names[rec->state]);
+		m->incarnation = rec->incarnation;
+		change_state(m, rec->state, now);
+	}
+
+	if(m->state == Member_Alive && rec->addr.sin_addr.s_addr != 0 &&
+			(m->addr.sin_addr.s_addr != rec->addr.sin_addr.s_addr ||
+			 m->addr.sin_port != rec->addr.sin_port)){
+		m->addr = rec->addr;
+		set_peer_address(m->name, &m->addr);
+	}
+
+	if(rec->has_status && m->state != Member_Dead &&
+			(!m->has_status || (short)(rec->version - m->version) > 0)){
+		size = (rec->status_num + 3) / 4;
+		memcpy(m->packed, rec->packed, size);
+		m->status_num = rec->status_num;
+		m->version = rec->version;
+		m->has_status = 1;
+		m->transmits = retransmit_limit();
+		feed_node(env, m);
+	}
+
+	return m;
+}
+
+/**
+ * @brief check if the record is newer than what's known of the member
+ *
+ * @param rec the record
+ * @param m the member
+ *
+ * @return 1 if it is and 0 if not
+ */
+static int overrides(const Record *rec, const Member *m){
+	if(rec->state == Member_Alive)
+		return rec->incarnation > m->incarnation;
+	if(rec->state == Member_Suspect)
+		return rec->incarnation > m->incarnation ||
+			(rec->incarnation == m->incarnation && m->state == Member_Alive);
+	return m->state != Member_Dead && rec->incarnation >= m->incarnation;
+}
+
+/**
+ * @brief change the state of the member and have it gossiped
+ *
+ * @param m the member
+ * @param state new state
+ * @param now current monotonic time
+ */
+static void change_state(Member *m, int state, double now){
+	m->state = state;
+	m->changed_at = now;
+	m->transmits = retransmit_limit();
+}
+
+/**
+ * @brief send a gossip message with the own record and as many of the records to spread as fit in MaxDatagram
+ *
+ * @param env Env struct
+ * @param type message type
+ * @param serial sequence number of the probe
+ * @param to address of the receiver
+ * @param subject the node to probe for PINGREQ, NULL otherwise
+ *
+ * @return 0 on success and -1 on failure
+ */
+static int send_gossip(Env *env, int type, unsigned short serial,
+		const struct sockaddr_in *to, const struct sockaddr_in *subject){
+	unsigned char *p, *count;
+	/* a byte is kept to pad the message to even length */
+	const unsigned char *end = send_buf + env->max_datagram - 1;
+	int i, len, num = 0, start;
+	Member *m;
+
+	p = put_v2_header(env, type, serial, send_buf, 0);
+	if(subject != NULL){
+		memcpy(p, &subject->sin_addr, 4);
+		memcpy(p + 4, &subject->sin_port, 2);
+		p += 6;
+	}
+	count = p++;
+
+	len = put_record(p, end, me, 1);
+	if(len == 0)
+		len = put_record(p, end, me, 0);
+	p += len;
+	num++;
+	if(me->transmits > 0)
+		me->transmits--;
+
+	/* take turns, so that every record to spread gets its chance */
+	start = piggyback_next++ % member_num;
+	for(i = 0; i < member_num && num < 255; i++){
+		m = members[(start + i) % member_num];
+		if(m == me || m->transmits <= 0)
+			continue;
+		len = put_record(p, end, m, m->has_status && m->state != Member_Dead);
+		if(len == 0)
+			continue;
+		p += len;
+		num++;
+		m->transmits--;
+	}
+	*count = (unsigned char)num;
+
+	len = (int)seal_v2_message(env, send_buf, (size_t)(p - send_buf));
+	if(sendto(env->server_fd, send_buf, len, 0, (const struct sockaddr *)to,
+				sizeof(*to)) != len)
+		return -1;
+	return 0;
+}
+
+/**
+ * @brief store the record of a member: the length and the name, the state, the incarnation, the address and the port, and optionally the version, the number and the packed statuses
+ *
+ * @param p where the record is stored
+ * @param end end of the buffer
+ * @param m the member
+ * @param with_status whether to store the statuses
+ *
+ * @return number of bytes stored, 0 if there is no room
+ */
+static int put_record(unsigned char *p, const unsigned char *end,
+		const Member *m, int with_status){
+	int name_len = (int)strlen(m->name), size;
+
+	size = 1 + name_len + 1 + 4 + 6;
+	if(with_status)
+		size += 4 + (m->status_num + 3) / 4;
+	if(end - p < size)
+		return 0;
+
+	*p++ = (unsigned char)name_len;
+	memcpy(p, m->name, name_len);
+	p += name_len;
+	*p++ = (unsigned char)(m->state | (with_status ? RECORD_HAS_STATUS : 0));
+	*p++ = (unsigned char)(m->incarnation >> 24);
+	*p++ = (unsigned char)(m->incarnation >> 16);
+	*p++ = (unsigned char)(m->incarnation >> 8);
+	*p++ = (unsigned char)m->incarnation;
+	memcpy(p, &m->addr.sin_addr, 4);
+	memcpy(p + 4, &m->addr.sin_port, 2);
+	p += 6;
+	if(with_status){
+		*p++ = (unsigned char)(m->version >> 8);
+		*p++ = (unsigned char)m->version;
+		*p++ = (unsigned char)(m->status_num >> 8);
+		*p++ = (unsigned char)m->status_num;
+		memcpy(p, m->packed, (m->status_num + 3) / 4);
+	}
+	return size;
+}
+
+/**
+ * @brief read a record and advance the pointer, the statuses beyond the services of this node are dropped
+ *
+ * @param p pointer to the record
+ * @param end end of the message
+ * @param rec where the record is stored
+ *
+ * @return 0 on success and -1 if the record is malformed
+ */
+static int get_record(const unsigned char **p, const unsigned char *end,
+		Record *rec){
+	const unsigned char *q = *p;
+	int name_len, num;
+
+	if(q >= end)
+		return -1;
+	name_len = *q++;
+	if(name_len == 0 || name_len >= NAMELEN || end - q < name_len + 11)
+		return -1;
+	memcpy(rec->name, q, name_len);
+	rec->name[name_len] = '\0';
+	q += name_len;
+
+	rec->state = *q & 3;
+	rec->has_status = (*q++ & RECORD_HAS_STATUS) != 0;
+	if(rec->state > Member_Dead)
+		return -1;
+	rec->incarnation = (unsigned)q[0] << 24 | (unsigned)q[1] << 16 |
+		(unsigned)q[2] << 8 | q[3];
+	q += 4;
+	memset(&rec->addr, 0, sizeof(rec->addr));
+	rec->addr.sin_family = AF_INET;
+	memcpy(&rec->addr.sin_addr, q, 4);
+	memcpy(&rec->addr.sin_port, q + 4, 2);
+	q += 6;
+
+	if(rec->has_status){
+		if(end - q < 4)
+			return -1;
+		rec->version = (unsigned short)(q[0] << 8 | q[1]);
+		num = q[2] << 8 | q[3];
+		q += 4;
+		if(end - q < (num + 3) / 4)
+			return -1;
+		rec->packed = q;
+		q += (num + 3) / 4;
+		rec->status_num = num < feed_pkt->capacity ? num : feed_pkt->capacity;
+	}
+
+	*p = q;
+	return 0;
+}
+
+/**
+ * @brief how many messages piggyback a new record, GOSSIP_RETRANSMIT_MULT times log2 of the cluster size
+ *
+ * @return number of messages
+ */
+static int retransmit_limit(){
+	int n, bits = 0;
+
+	for(n = member_num; n > 0; n >>= 1)
+		bits++;
+	return GOSSIP_RETRANSMIT_MULT * bits;
+}
+
+/**
+ * @brief check if the collect process is still sending heartbeats
+ *
+ * @param env Env struct
+ *
+ * @return 1 if it is and 0 if not
+ */
+static int local_alive(Env *env){
+	return env->local_heartbeat_at + env->dead_time >= monotonic_time();
+}
+
+/**
+ * @brief the sequence number of a new probe, never 0
+ *
+ * @return sequence number
+ */
+static unsigned short next_gossip_seq(){
+	if(gossip_seq == 0)
+		gossip_seq = (unsigned short)random();
+	if(++gossip_seq == 0)
+		gossip_seq = 1;
+	return gossip_seq;
+}
+
+/**
+ * @brief find the member by name
+ *
+ * @param name name of the node
+ *
+ * @return the member on success and NULL if it's unknown
+ */
+static Member * find_member(const char *name){
+	Member key, *pkey = &key, **found;
+
+	if(member_num == 0)
+		return NULL;
+	strcpy(key.name, name);
+	found = bsearch(&pkey, members, member_num, sizeof(Member *), cmp_member);
+	return found != NULL ? *found : NULL;
+}
+
+/**
+ * @brief insert a new member in order
+ *
+ * @param env Env struct
+ * @param name name of the node
+ *
+ * @return the member on success and NULL on failure
+ */
+static Member * insert_member(Env *env, const char *name){
+	Member *m, **tmp;
+	int i;
+
+	if(member_num >= member_cap){
+		tmp = realloc(members,
+				(member_cap + MEMBER_TABLE_RESIZE) * sizeof(Member *));
+		if(tmp == NULL)
+			return NULL;
+		members = tmp;
+		member_cap += MEMBER_TABLE_RESIZE;
+	}
+
+	m = (Member *)calloc(1, sizeof(Member));
+	if(m == NULL)
+		return NULL;
+	m->packed = (unsigned char *)calloc((env->service_num + 3) / 4, 1);
+	if(m->packed == NULL){
+		free(m);
+		return NULL;
+	}
+	strcpy(m->name, name);
+
+	for(i = member_num; i > 0 && strcmp(members[i-1]->name, name) > 0; i--)
+		members[i] = members[i-1];
+	members[i] = m;
+	member_num++;
+	return m;
+}
+
+/**
+ * @brief forget the members dead for long, whose death has been spread
+ *
+ * @param env Env struct
+ * @param now current monotonic time
+ */
+static void purge_members(Env *env, double now){
+	int i, j;
+	Member *m;
+
+	for(i = 0, j = 0; i < member_num; i++){
+		m = members[i];
+		if(m->state == Member_Dead && m->transmits <= 0 &&
+				m->changed_at + 2 * env->dead_time < now){
+			free(m->packed);
+			free(m);
+			continue;
+		}
+		members[j++] = m;
+	}
+	member_num = j;
+}
+
+/**
+ * @brief compares two members by name
+ *
+ * @param arg1 pointer to pointer to Member
+ * @param arg2 pointer to pointer to Member
+ *
+ * @return result of strcmp
+ */
+static int cmp_member(const void *arg1, const void *arg2){
+	return strcmp((*(Member * const *)arg1)->name,
+			(*(Member * const *)arg2)->name);
+}
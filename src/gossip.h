@@ -0,0 +1,43 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+#ifndef _GOSSIP_H_
+#define _GOSSIP_H_
+
+#include <netinet/in.h>
+
+#include "hast3.h"
+
+#define HAST3_TRANSPORT_MULTICAST	0
+#define HAST3_TRANSPORT_GOSSIP	1
+
+/* the nodes asked to probe a node which doesn't answer */
+#define GOSSIP_INDIRECT_CHECKS	3
+/* a new record is piggybacked on so many times log2 N messages */
+#define GOSSIP_RETRANSMIT_MULT	3
+
+int add_gossip_seed(Env *env, const char *seed);
+int init_gossip(Env *env);
+int is_gossip_message(const char buf[], int len);
+int handle_gossip(Env *env, const char buf[], int len,
+		const struct sockaddr_in *from);
+double next_gossip(Env *env);
+int run_gossip(Env *env);
+void free_gossip();
+
+#endif
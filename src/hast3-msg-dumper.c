@@ -34,11 +34,87 @@
 #include <stdlib.h>
 
 #include "communicate.h"
+#include "protocol.h"
+#include "checksum.h"
 
 #define HELLO_PORT 10015
 #define HELLO_GROUP "225.0.0.37"
 #define MSGBUFSIZE 3256
 
+/**
+ * @brief read a varint of the v2 format
+ *
+ * @param p pointer to the varint, advanced past it
+ * @param end end of the message
+ *
+ * @return the integer, 0 if it's truncated
+ */
+static unsigned read_varint(const unsigned char **p, const unsigned char *end)
+{
+	unsigned value = 0;
+	int shift;
+
+	for(shift = 0; shift < 35 && *p < end; shift += 7){
+		value |= (unsigned)(**p & 0x7f) << shift;
+		if((*(*p)++ & 0x80) == 0)
+			break;
+	}
+	return value;
+}
+
+/**
+ * @brief dump a message of the v2 format, the services and the nodes are shown by their ids
+ *
+ * @param buf the message
+ * @param len length of the message
+ */
+static void dump_v2(const unsigned char *buf, int len)
+{
+	const unsigned char *p = buf + HAST3_V2_HEADER_LEN, *end = buf + len;
+	const unsigned char *packed;
+	unsigned count = 0, i, id, first = 0;
+
+	printf("version:\t%d\n", buf[2]);
+	printf("check:\t\t%s\n",
+			buf[4] & HAST3_V2_FLAG_CRC32C ? "crc32c" : "sum");
+	printf("node id:\t%d\n", buf[6] << 8 | buf[7]);
+	printf("msg type:\t%d\n", buf[3]);
+	printf("serial:\t\t%d\n", buf[8] << 8 | buf[9]);
+	if(buf[4] & HAST3_V2_FLAG_PART){
+		i = read_varint(&p, end);
+		printf("part:\t\t%u of %u\n", i, read_varint(&p, end));
+		first = read_varint(&p, end);
+		printf("first service:\t%u\n", first);
+	}
+	if(buf[3] != HAST3_MSG_SNAPREQ && buf[3] != HAST3_MSG_ACK)
+		count = read_varint(&p, end);
+	printf("field num:\t%u\n", count);
+
+	if(buf[3] == HAST3_MSG_BCAST){
+		for(i = 0; i < count && p + i / 4 < end; i++)
+			printf("\tservice %u:\t%d\n", first + i,
+					(p[i / 4] >> (i % 4 * 2)) & 3);
+	}
+	else if(buf[3] == HAST3_MSG_DELTA){
+		/* the statuses follow all the ids */
+		packed = p;
+		for(i = 0; i < count; i++)
+			read_varint(&packed, end);
+		for(i = 0; i < count && packed + i / 4 < end; i++){
+			id = read_varint(&p, end);
+			printf("\tservice %u:\t%d\n", id,
+					(packed[i / 4] >> (i % 4 * 2)) & 3);
+		}
+	}
+	else if(buf[3] == HAST3_MSG_CMD){
+		for(i = 0; i < count && p < end; i++){
+			id = read_varint(&p, end);
+			if(p < end)
+				printf("\tservice %u:\tcmd %d\n", id, *p++);
+		}
+	}
+}
+
 int main(int argc, char *argv[])
 {
      struct sockaddr_in addr;
@@ -84,8 +160,11 @@ int main(int argc, char *argv[])
 
 	 Hast3_message *ptr;
 	 Hast3_message_entry *entry;
+	 size_t header_len;
 	 int i;
 
+     printf("checksum:\t%s\n\n", checksum_impl());
+
      /* now just enter a read-print loop */
      while (1) {
 	  addrlen=sizeof(addr);
@@ -95,11 +174,26 @@ int main(int argc, char *argv[])
 	       exit(1);
 	  }
 	  printf("%d bytes received\n", nbytes);
+	  if(verify_message(msgbuf, nbytes) != 0)
+		  printf("integrity:\tcorrupt\n");
+	  if(nbytes >= HAST3_V2_HEADER_LEN &&
+			  (unsigned char)msgbuf[0] == HAST3_V2_MAGIC0 &&
+			  (unsigned char)msgbuf[1] == HAST3_V2_MAGIC1){
+		  dump_v2((unsigned char *)msgbuf, nbytes);
+		  printf("\n\n");
+		  continue;
+	  }
 	  ptr = (Hast3_message *)&msgbuf;
 	  printf("node name:\t%s\n", ptr->nodename);
 	  printf("msg type:\t%d\n", ptr->type);
 	  printf("field num:\t%d\n", ptr->field_num);
-	  entry = (Hast3_message_entry *)(msgbuf+sizeof(Hast3_message));
+	  header_len = sizeof(Hast3_message);
+	  /* the extended header is told apart by the length only */
+	  if((nbytes - header_len) % sizeof(Hast3_message_entry) != 0){
+		  header_len = sizeof(Hast3_message_ext);
+		  printf("serial:\t\t%d\n", ((Hast3_message_ext *)&msgbuf)->serial);
+	  }
+	  entry = (Hast3_message_entry *)(msgbuf+header_len);
 	  for(i = 0; i < ptr->field_num; i++){
 		  printf("\tservice_name:\t%s\n", entry[i].service_name);
 		  printf("\tcmd_or_status:\t%d\n", entry[i].cmd_or_status);
@@ -22,33 +22,148 @@
 #include <time.h>
 
 #include "log.h"
+#include "timer.h"
 
 #define MAXSTRLEN 1024
 #define MAXBUFSIZE 2048
 #define MAXFILENAMELEN PATH_MAX
 #define NAMELEN 16
+#define MAXCMDARGS 64
+
+enum Builtin_type{
+	Builtin_None=0,
+	Builtin_Process,
+	Builtin_Pidfile
+};
+
+/* 
+ * a command line tokenized once at config time, commands which need the
+ * shell syntax are passed to /bin/sh -c as they are, builtin probes are
+ * answered by hast3 itself with argv[0] as their argument
+ */
+typedef struct{
+	char line[MAXSTRLEN];
+	char words[MAXSTRLEN];
+	char *argv[MAXCMDARGS + 1];
+	int use_shell;
+	int builtin;
+} Command;
 
 typedef struct{
 	char name[NAMELEN];
-	char startcmd[MAXSTRLEN];
-	char stopcmd[MAXSTRLEN];
-	char statecmd[MAXSTRLEN];
+	Command startcmd;
+	Command stopcmd;
+	Command statecmd;
+	double probe_interval;
 	int tried_cnt;
+	/* set by the main process to have the service probed at once */
+	volatile int probe_now;
+	/* 
+	 * the last probe of the collect process, written by it only and read
+	 * with read_local_status(), status_seq is odd while it's written
+	 */
+	volatile unsigned status_seq;
+	volatile int local_result;
+	volatile int local_status;
+	volatile double probed_at;
+	/* the last START/STOP run by the main process, written by it only */
+	double acted_at;
 } Service;
 
+/* the inter-arrival times of the last heartbeats of a node */
+#define PHI_WINDOW	64
+
+typedef struct{
+	double intervals[PHI_WINDOW];
+	int num;
+	int next;
+	double sum;
+	double sum_sq;
+	/* monotonic time of the last heartbeat, 0 before the first one */
+	double last_arrival;
+} Arrival_window;
+
 typedef struct Active_node{
 	char nodename[NAMELEN];
-	int *statues;
-	time_t last_update;
-	int service_cnt;
+	/* 
+	 * the statues packed 2 bits per service, mirrored by the status
+	 * matrix of matrix.c under the id
+	 */
+	uint64_t *statues;
+	/* the last full snapshot, which the delta heartbeats apply to */
+	uint64_t *snapshot;
+	unsigned short generation;
+	int has_snapshot;
+	/* monotonic time of the last heartbeat in nanoseconds */
+	uint64_t last_update;
+	Arrival_window arrivals;
+	/* fires when the node is judged dead, re-armed on each heartbeat */
+	Timer expiry;
+	/* index in the nodes of Env */
+	int slot;
+	/* the interned id of nodename, stable while the node is in the table */
+	int id;
 } Active_node;
 
 typedef struct{
 	double ha_interval;
-	int  dead_time;
+	double dead_time;
+	/* a node is dead once its phi reaches this, 0 to wait for DeadTime */
+	double phi_threshold;
 	int max_try_no;
+	int probe_concurrency;
+	int adaptive_probe;
+	double probe_max_interval;
+	int watch_pid;
+	int skip_missed_ticks;
+	/* heartbeats missed by the collect process, written by it only */
+	volatile unsigned long heartbeat_overruns;
+	int delta_heartbeat;
+	int snapshot_interval;
+	/* set by the main process when a peer asks for a full snapshot */
+	volatile int snapshot_requested;
+	/* a probe result younger than this is used instead of probing again */
+	double status_max_age;
+	/* monotonic time of the last heartbeat of the collect process */
+	volatile double local_heartbeat_at;
+	/* wire format of the messages sent, the both are accepted */
+	int protocol;
+	/* integrity check of the v2 messages sent */
+	int checksum_mode;
+	/* the cluster nodes listed in config, node id is index + 1 */
+	int cluster_size;
+	char (*cluster_nodes)[NAMELEN];
+	int node_id;
 	int port;
 	int server_fd;
+	/* socket sending the messages to a single node */
+	int cmd_fd;
+	/* how long an address learned from the heartbeats is trusted */
+	double peer_ttl;
+	/* the first wait for the ACK of a CMD, doubled on each retransmit */
+	double cmd_timeout;
+	int cmd_retries;
+	/* the START/STOP commands run at the same time at most */
+	int action_concurrency;
+	/* a START/STOP command running longer is killed with its group */
+	double action_timeout;
+	/* the wait before the first retry of a failed command, then doubled */
+	double action_backoff;
+	/* SO_RCVBUF of server_fd, 0 for the default of the kernel */
+	int recv_buffer;
+	/* 
+	 * datagrams dropped by the kernel as reported by SO_RXQ_OVFL and
+	 * messages dropped by the receiver thread for the full queue, both
+	 * written by the receiver thread and read atomically
+	 */
+	unsigned recv_dropped;
+	unsigned queue_dropped;
+	/* multicast heartbeats or unicast gossip */
+	int transport;
+	/* a v2 snapshot longer than this is sent in parts */
+	int max_datagram;
+	/* send the parts of a snapshot with a single UDP_SEGMENT write */
+	int udp_gso;
 	char config[MAXFILENAMELEN];
 	char logdir[MAXFILENAMELEN];
 	char nodename[NAMELEN];
@@ -78,6 +193,22 @@ enum Service_status{
 
 #define HAST3_MSG_BCAST	0
 #define HAST3_MSG_CMD	1
+/* only the entries changed since the snapshot of generation serial */
+#define HAST3_MSG_DELTA	2
+/* ask the node to multicast a full snapshot */
+#define HAST3_MSG_SNAPREQ	3
+/* the CMD of sequence number serial is received */
+#define HAST3_MSG_ACK	4
+/* 
+ * the gossip transport, serial is the sequence number of the probe:
+ * PING asks for a PINGACK, PINGREQ asks the receiver to ping another node
+ * on behalf of the sender and forward its PINGACK
+ */
+#define HAST3_MSG_PING	5
+#define HAST3_MSG_PINGREQ	6
+#define HAST3_MSG_PINGACK	7
+
+#define DEFAULT_SNAPSHOT_INTERVAL	10
 
 #define HAST3_CMD_START	0
 #define HAST3_CMD_STOP	1
@@ -87,6 +218,7 @@ typedef struct {
 	short cmd_or_status;
 } Hast3_message_entry;
 
+/* the v1 header, its 22 bytes are frozen for the older versions */
 typedef struct {
 	char nodename[NAMELEN];
 	short type;
@@ -95,6 +227,43 @@ typedef struct {
 	Hast3_message_entry data[0];
 } Hast3_message;
 
+/* 
+ * the v1 header of the message types the older versions do not know, and
+ * of the BCAST when DeltaHeartbeat is set
+ */
+typedef struct {
+	char nodename[NAMELEN];
+	short type;
+	short field_num;
+	unsigned short checksum;
+	/* snapshot generation for BCAST and DELTA, sequence number for ACK */
+	unsigned short serial;
+	Hast3_message_entry data[0];
+} Hast3_message_ext;
+
+/* a received message decoded from either wire format */
+typedef struct {
+	/* index of the service in env->services */
+	int service;
+	short cmd_or_status;
+} Hast3_entry;
+
+typedef struct {
+	char nodename[NAMELEN];
+	short type;
+	/* 
+	 * snapshot generation for BCAST and DELTA, sequence number for CMD
+	 * and ACK, 0 for the CMD of protocol 1 which is not acknowledged
+	 */
+	unsigned short serial;
+	/* index and count of the parts of a snapshot sent in parts, 0 and 1 otherwise */
+	int part;
+	int parts;
+	int field_num;
+	int capacity;
+	Hast3_entry *data;
+} Hast3_packet;
+
 #define MAX_TRY_NUM 3
 
 extern int debug_level;
@@ -0,0 +1,212 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file intern.c
+ * @brief interns the node names to compact ids through an open-addressing hash index
+ * @author Li Jiliang<tjulijiliang@gmail.com
+ * @version 1.0
+ * @date 2011-11-09
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hast3.h"
+#include "intern.h"
+#include "util.h"
+
+/* ids of the names, -1 for an empty slot, probed linearly */
+static int *slots = NULL;
+static unsigned slot_mask = 0;
+/* the names and their hashes by id */
+static char (*names)[NAMELEN] = NULL;
+static uint32_t *hashes = NULL;
+static int id_cap = 0;
+/* ids ever handed out, the released ones are reused first */
+static int id_limit = 0;
+static int *free_ids = NULL;
+static int free_num = 0;
+static int live = 0;
+
+static int grow_slots();
+static int grow_ids();
+
+/**
+ * @brief double the hash index and put the names back
+ *
+ * @return 0 on success and 1 on failure
+ */
+static int grow_slots(){
+	unsigned size = slots == NULL ? INTERN_INIT_SLOTS : (slot_mask + 1) * 2;
+	int *tmp;
+	unsigned i, j;
+
+	tmp = (int *)malloc(size * sizeof(int));
+	if(tmp == NULL)
+		return 1;
+	memset(tmp, 0xff, size * sizeof(int));
+	for(i = 0; slots != NULL && i <= slot_mask; i++){
+		if(slots[i] < 0)
+			continue;
+		for(j = hashes[slots[i]] & (size - 1); tmp[j] >= 0;
+				j = (j + 1) & (size - 1))
+			;
+		tmp[j] = slots[i];
+	}
+	free(slots);
+	slots = tmp;
+	slot_mask = size - 1;
+	return 0;
+}
+
+/**
+ * @brief double the arrays indexed by id
+ *
+ * @return 0 on success and 1 on failure
+ */
+static int grow_ids(){
+	int cap = id_cap == 0 ? INTERN_INIT_SLOTS / 2 : id_cap * 2;
+	void *tmp;
+
+	tmp = realloc(names, cap * sizeof(*names));
+	if(tmp == NULL)
+		return 1;
+	names = tmp;
+	tmp = realloc(hashes, cap * sizeof(*hashes));
+	if(tmp == NULL)
+		return 1;
+	hashes = tmp;
+	tmp = realloc(free_ids, cap * sizeof(*free_ids));
+	if(tmp == NULL)
+		return 1;
+	free_ids = tmp;
+	id_cap = cap;
+	return 0;
+}
+
+/**
+ * @brief look up the id of the name
+ *
+ * @param name the node name
+ *
+ * @return the id, -1 if the name is not interned
+ */
+int find_name(const char *name){
+	unsigned i;
+
+	if(slots == NULL)
+		return -1;
+	for(i = hash_name(name) & slot_mask; slots[i] >= 0; i = (i + 1) & slot_mask)
+		if(strncmp(names[slots[i]], name, NAMELEN) == 0)
+			return slots[i];
+	return -1;
+}
+
+/**
+ * @brief intern the name, the id is kept until the name is released
+ *
+ * @param name the node name
+ *
+ * @return the id, -1 if memory runs out
+ */
+int intern_name(const char *name){
+	int id;
+	unsigned i;
+
+	id = find_name(name);
+	if(id >= 0)
+		return id;
+
+	/* keep the load factor under 1/2 so the probes stay short */
+	if((slots == NULL || (unsigned)(live + 1) * 2 > slot_mask + 1) &&
+			grow_slots() != 0)
+		return -1;
+	if(free_num > 0)
+		id = free_ids[--free_num];
+	else{
+		if(id_limit >= id_cap && grow_ids() != 0)
+			return -1;
+		id = id_limit++;
+	}
+
+	strncpy(names[id], name, NAMELEN - 1);
+	names[id][NAMELEN - 1] = '\0';
+	hashes[id] = hash_name(names[id]);
+	for(i = hashes[id] & slot_mask; slots[i] >= 0; i = (i + 1) & slot_mask)
+		;
+	slots[i] = id;
+	live++;
+	return id;
+}
+
+/**
+ * @brief forget the name of the id, the id may be handed out again
+ *
+ * @param id the id from intern_name()
+ */
+void release_name(int id){
+	unsigned i, j, k;
+
+	if(slots == NULL || id < 0 || id >= id_limit)
+		return;
+	for(i = hashes[id] & slot_mask; slots[i] != id; i = (i + 1) & slot_mask)
+		if(slots[i] < 0)
+			return;
+
+	/* 
+	 * shift the following entries of the cluster back instead of leaving
+	 * a tombstone, an entry moves if its home slot isn't in (i, j]
+	 */
+	slots[i] = -1;
+	for(j = (i + 1) & slot_mask; slots[j] >= 0; j = (j + 1) & slot_mask){
+		k = hashes[slots[j]] & slot_mask;
+		if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		slots[i] = slots[j];
+		slots[j] = -1;
+		i = j;
+	}
+	free_ids[free_num++] = id;
+	live--;
+}
+
+/**
+ * @brief upper bound of the ids handed out, for the arrays indexed by id
+ *
+ * @return the bound
+ */
+int name_id_limit(){
+	return id_limit;
+}
+
+/**
+ * @brief free the index and the names
+ */
+void free_names(){
+	free(slots);
+	free(names);
+	free(hashes);
+	free(free_ids);
+	slots = NULL;
+	names = NULL;
+	hashes = NULL;
+	free_ids = NULL;
+	slot_mask = 0;
+	id_cap = id_limit = free_num = live = 0;
+}
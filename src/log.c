@@ -24,6 +24,7 @@
  * @version 1.0
  * @date 2011-11-09
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdarg.h>
 #include <unistd.h>
@@ -31,12 +32,15 @@
 #include <time.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "hast3.h"
 #include "log.h"
 #include "util.h"
 
 /* static functions */
+static void put_log(enum log_type type, const char *entry, time_t now);
+static int rotate_log(char old_path[]);
 static int compress(const char *path);
 static int decompress(const char *path);
 
@@ -46,6 +50,8 @@ static char log_names[TOTAL_LOG_TYPE][7] =
 static int log_size = 0;
 static time_t next_day_mark;
 static char logpath[FILENAME_MAX];
+/* the threads of the main process share the log, recursive for the rotation */
+static pthread_mutex_t log_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 
 /**
  * @brief open the log file
@@ -98,9 +104,9 @@ int open_log(const char *path){
  * @return STATUS_OK
  */
 int write_log(enum log_type type, const char *format, ...){
-	char log_entry[MAXBUFSIZE];
+	char log_entry[MAXBUFSIZE], old_path[FILENAME_MAX];
 	va_list arg_ptr;
-	int len;
+	int len, rotated = 0;
 	time_t now;
 
 	va_start(arg_ptr, format);
@@ -108,21 +114,15 @@ int write_log(enum log_type type, const char *format, ...){
 	va_end(arg_ptr);
 
 	time(&now);
-	fprintf(log_fp, "[%s] %s\t%s\n\n", log_names[type], ctime(&now),
-			log_entry);
-	
-	if(++log_size % FLUSH_LOG_NUM == 0){
-		log_size = 0;
-		fflush(log_fp);
-	}
+	pthread_mutex_lock(&log_lock);
+	put_log(type, log_entry, now);
+	if(now > next_day_mark)
+		rotated = rotate_log(old_path);
+	pthread_mutex_unlock(&log_lock);
 
-	if(now > next_day_mark){
-		/* close and compress the log */
-		close_log();
-		*strrchr(logpath, '/') = '\0';
-		/* open the new log */
-		open_log(logpath);
-	}
+	/* gzip may take long, the other threads go on logging meanwhile */
+	if(rotated)
+		compress(old_path);
 
 	return STATUS_OK;
 }
@@ -134,13 +134,65 @@ int write_log(enum log_type type, const char *format, ...){
  */
 int close_log(){
 	write_log(INFO, "Close the log by PID: %d", getpid());
+	pthread_mutex_lock(&log_lock);
 	fclose(log_fp);
+	pthread_mutex_unlock(&log_lock);
 	compress(logpath);
 	return STATUS_OK;
 }
 
 /**
- * @brief compress the log
+ * @brief write a record to the log, called with log_lock held
+ *
+ * @param type log type
+ * @param entry log content
+ * @param now time of the record
+ */
+static void put_log(enum log_type type, const char *entry, time_t now){
+	char stamp[32];
+
+	fprintf(log_fp, "[%s] %s\t%s\n\n", log_names[type], ctime_r(&now, stamp),
+			entry);
+	
+	if(++log_size % FLUSH_LOG_NUM == 0){
+		log_size = 0;
+		fflush(log_fp);
+	}
+}
+
+/**
+ * @brief switch to the log of the new day, called with log_lock held, the old log is left for the caller to compress
+ *
+ * @param old_path[] where the path of the old log is stored
+ *
+ * @return 1 if the old log is closed and 0 if it's kept for the new log cannot be opened
+ */
+static int rotate_log(char old_path[]){
+	char entry[64], dir[FILENAME_MAX];
+	FILE *old_fp = log_fp, *new_fp;
+
+	/* open_log() writes logpath, so the directory is copied out */
+	strcpy(old_path, logpath);
+	strcpy(dir, logpath);
+	*strrchr(dir, '/') = '\0';
+	if(open_log(dir) != STATUS_OK){
+		strcpy(logpath, old_path);
+		log_fp = old_fp;
+		return 0;
+	}
+
+	/* the close record goes to the old log, just like close_log() */
+	new_fp = log_fp;
+	log_fp = old_fp;
+	snprintf(entry, sizeof(entry), "Close the log by PID: %d", getpid());
+	put_log(INFO, entry, time(NULL));
+	fclose(old_fp);
+	log_fp = new_fp;
+	return 1;
+}
+
+/**
+ * @brief compress the log in the background, only the shell which starts gzip is waited for
  *
  * @param path log path
  *
@@ -151,7 +203,7 @@ static int compress(const char *path){
 	if(access("/bin/gzip", X_OK) || access(path, F_OK) )
 		return 1;
 
-	snprintf(cmd, sizeof(cmd), "/bin/gzip -qf %s", path);
+	snprintf(cmd, sizeof(cmd), "/bin/gzip -qf %s &", path);
 
 	return wrap_system(cmd);
 }
@@ -34,22 +34,32 @@
 #include <semaphore.h>
 
 #include <sys/types.h>
-#include <sys/time.h>
-#include <sys/select.h>
+#include <sys/wait.h>
 #include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
 
 #include "hast3.h"
 #include "communicate.h"
 #include "log.h"
 #include "collect.h"
 #include "function.h"
+#include "protocol.h"
+#include "checksum.h"
+#include "peer.h"
+#include "reliable.h"
+#include "reassembly.h"
+#include "gossip.h"
+#include "reactor.h"
+#include "receiver.h"
+#include "executor.h"
 
 /* global lock */
 sem_t mutex;
 /* global variables */
 Env *env;
 int debug_level = 0;
-static sig_atomic_t routine_check_flag = 0;
+static int routine_check_flag = 0;
 
 #define EXIT_BEFORE_UDP		0
 #define EXIT_BEFORE_LOG 	1
@@ -62,19 +72,20 @@ static void free_runtime_mem();
 
 int initialize(Env *env);
 int server_exit(int exit_level);
-void hast3_die(int signum);
-void set_routine_check_flag(int signum);
 static int main_loop();
+static int open_routine_timer();
+static int open_signal_fd();
+static void handle_inbound(int fd);
+static void handle_routine_timer(int fd);
+static void handle_signals(int fd);
 
 /* config.c */
 int init_config(Env *env, const char *config);
 
 int main(int argc, char *argv[])
 {
-	struct itimerval newitimer;
-	double value;
 	int daemon_flag = 1;
-	int opt;
+	int opt, status;
 	char config[MAXFILENAMELEN] = "/etc/hast3/hast3.conf-custom";
 	char shortopt[] = "bfc:dhv";
 	struct option longopt[] = {
@@ -143,7 +154,12 @@ int main(int argc, char *argv[])
 
 	/* initialize the globalenv struct according to config file */
 	memset(env, 0, sizeof(Env));
-	init_config(env, config);
+	status = init_config(env, config);
+	if(status != STATUS_OK){
+		fprintf(stderr, "Cannot load the config %s, error code: %d\n",
+				config, status);
+		server_exit(EXIT_BEFORE_UDP);
+	}
 
 	if(daemon_flag)
 		daemon(0, 0);
@@ -151,22 +167,11 @@ int main(int argc, char *argv[])
 	/* system initialization */
 	initialize(env);
 
-	signal(SIGINT, hast3_die);
 	//signal(SIGCHLD, SIG_IGN);
 	signal(SIGQUIT, SIG_IGN);
 	signal(SIGTTIN, SIG_IGN);
 	signal(SIGTTOU, SIG_IGN);
 
-	/* set up SIGALRM signal */
-	signal(SIGALRM, set_routine_check_flag);
-
-	/* performs routine check every 5 * ha_interval */
-	value = 5 * env->ha_interval;
-	newitimer.it_interval.tv_sec = (int )value;
-	newitimer.it_interval.tv_usec = (value - (int)value)*1000000;
-	newitimer.it_value = newitimer.it_interval;
-	setitimer(ITIMER_REAL, &newitimer, NULL);
-
 	/* go to the main loop */
 	exit(main_loop());
 
@@ -182,6 +187,7 @@ int main(int argc, char *argv[])
  */
 int initialize(Env *env){
 	int status;
+	const char *impl;
 
 	/* start the server */
 	status = build_server(env);
@@ -198,6 +204,20 @@ int initialize(Env *env){
 		server_exit(EXIT_BEFORE_LOG);
 	}
 
+	if(env->transport == HAST3_TRANSPORT_GOSSIP &&
+			init_gossip(env) != STATUS_OK){
+		fprintf(stderr, "Cannot start the gossip\n");
+		server_exit(EXIT_BEFORE_CLECT);
+	}
+
+	/* 
+	 * pick the checksum implementations before the collect process forks
+	 * and the threads start
+	 */
+	impl = checksum_impl();
+	if(debug_level > 0)
+		write_log(DEBUG, "Checksum implementation: %s", impl);
+
 	/* start the collect process */
 	status = start_collect(env);
 	if(status != STATUS_OK){
@@ -243,61 +263,178 @@ int server_exit(int exit_level){
 }
 
 /**
- * @brief set the routine_check_flag
+ * @brief system main loop
  *
- * @param signum signal number
+ * @return loop forever and no return
  */
-void set_routine_check_flag(int signum){
-	routine_check_flag = 1;
+static int main_loop(){
+	double wait, next;
+	int loop=1, timer_fd, signal_fd;
+
+	/* 
+	 * the signals are blocked before the threads start, so they all go
+	 * to the signalfd; this thread becomes the decision thread, which
+	 * owns the status table, while the messages are received and the
+	 * commands run by the others
+	 */
+	signal_fd = open_signal_fd();
+	if(signal_fd < 0 || start_receiver(env) != STATUS_OK ||
+			start_executor(env) != STATUS_OK){
+		write_log(ERROR, "Failed to start the threads");
+		return STATUS_SVR_ERR;
+	}
+
+	/* the messages, the routine check and the signals are waited for alike */
+	timer_fd = open_routine_timer();
+	if(timer_fd < 0 || init_reactor() != STATUS_OK ||
+			add_event_source(receiver_fd(), handle_inbound) != STATUS_OK ||
+			add_event_source(timer_fd, handle_routine_timer) != STATUS_OK ||
+			add_event_source(signal_fd, handle_signals) != STATUS_OK){
+		write_log(ERROR, "Failed to set up the event loop");
+		return STATUS_SVR_ERR;
+	}
+
+	while(loop){
+		/* 
+		 * sleep till the earliest of the retransmits, the gossip and the
+		 * expiry of the nodes, or till an event if none is pending
+		 */
+		wait = next_retransmit();
+		if(env->transport == HAST3_TRANSPORT_GOSSIP){
+			next = next_gossip(env);
+			if(wait < 0 || next < wait)
+				wait = next;
+		}
+		next = next_expiry();
+		if(next >= 0 && (wait < 0 || next < wait))
+			wait = next;
+
+		if(wait_events(wait) < 0)
+			loop = 0;
+
+		retransmit_cmds(env);
+		if(env->transport == HAST3_TRANSPORT_GOSSIP)
+			run_gossip(env);
+		/* the services of a dead node are taken over without waiting */
+		if(expire_nodes(env) > 0)
+			routine_check_flag = 1;
+		if(routine_check_flag){
+			routine_check_flag = 0;
+			routine_check(env);
+		}
+	}
+	
+	close_reactor();
+	close(timer_fd);
+	close(signal_fd);
+	return STATUS_SVR_ERR;
 }
 
 /**
- * @brief system exit
+ * @brief create a timerfd which expires every 5 * ha_interval for the routine check
  *
- * @param signum signal number
+ * @return the timerfd on success and -1 on failure
  */
-void hast3_die(int signum){
-	server_exit(EXIT_FINAL);
-	exit(EXIT_FAILURE);
+static int open_routine_timer(){
+	int fd;
+	double value = 5 * env->ha_interval;
+	struct itimerspec its;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(fd < 0)
+		return -1;
+
+	its.it_interval.tv_sec = (time_t)value;
+	its.it_interval.tv_nsec = (long)((value - (time_t)value) * 1000000000);
+	its.it_value = its.it_interval;
+	if(timerfd_settime(fd, 0, &its, NULL) != 0){
+		close(fd);
+		return -1;
+	}
+	return fd;
 }
 
 /**
- * @brief system main loop
+ * @brief block the signals the main process handles and read them from a signalfd instead, so they never interrupt it
  *
- * @return loop forever and no return
+ * @return the signalfd on success and -1 on failure
  */
-static int main_loop(){
-	double value;
-	struct timeval timeout;
-	fd_set readfds, testfds;
-	int loop=1, result;
-	char buf[MAXBUFSIZE];
-
-	FD_ZERO(&readfds);
-	FD_SET(env->server_fd, &readfds);
-	value = 2 * env->ha_interval;
+static int open_signal_fd(){
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGCHLD);
+	if(sigprocmask(SIG_BLOCK, &mask, NULL) != 0)
+		return -1;
+	return signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
 
-	while(loop){
-		timeout.tv_sec = (int)value;
-		timeout.tv_usec = (value - (int)value) * 1000000;
-		testfds = readfds;
-
-		result = select(FD_SETSIZE, &testfds, NULL, NULL, &timeout);
-		if(result == -1){
-			if(errno == EINTR)
-				continue;
-		}
-		else if(result == 1){
-			if(get_and_check_message(env->server_fd, buf) == STATUS_OK)
-				dispatch_message(env, buf);
+/**
+ * @brief dispatch the messages handed over by the receiver thread
+ *
+ * @param fd the eventfd of the receiver thread
+ */
+static void handle_inbound(int fd){
+	uint64_t count;
+	Inbound *in;
+
+	/* cleared before the ring is drained, so no message is left behind */
+	if(read(fd, &count, sizeof(count)) != sizeof(count))
+		return;
+	while((in = next_inbound()) != NULL){
+		if(in->kind == INBOUND_GOSSIP)
+			handle_gossip(env, in->buf, in->len, &in->from);
+		else{
+			learn_peer(in->pkt->nodename, &in->from);
+			dispatch_message(env, in->pkt);
 		}
-		if(routine_check_flag){
-			routine_check_flag = 0;
-			routine_check(env);
+		release_inbound();
+	}
+}
+
+/**
+ * @brief the routine check is due
+ *
+ * @param fd the timerfd
+ */
+static void handle_routine_timer(int fd){
+	uint64_t expirations;
+
+	if(read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+		routine_check_flag = 1;
+}
+
+/**
+ * @brief exit on SIGINT and SIGTERM, report the exit of the collect process on SIGCHLD
+ *
+ * @param fd the signalfd
+ */
+static void handle_signals(int fd){
+	struct signalfd_siginfo info;
+	int status;
+
+	while(read(fd, &info, sizeof(info)) == sizeof(info)){
+		switch(info.ssi_signo){
+			case SIGINT:
+			case SIGTERM:
+				write_log(INFO, "Caught signal %d, exit now", info.ssi_signo);
+				server_exit(EXIT_FINAL);
+				break;
+
+			case SIGCHLD:
+				/* the children running commands are waited for by their runners */
+				if(collect_exited(&status))
+					write_log(ERROR, "Collect process exited with status %d",
+							WIFEXITED(status) ? WEXITSTATUS(status) :
+							128 + WTERMSIG(status));
+				break;
+
+			default:
+				break;
 		}
 	}
-	
-	return STATUS_OK;
 }
 
 /**
@@ -335,17 +472,22 @@ static void show_usage(){
  * @brief clean up resources
  */
 static void free_runtime_mem(){
-	int i;
+	/* stop the threads before what they use is freed */
+	stop_receiver();
+	stop_executor();
 
 	/* free the status table staff */
-	for(i = 0; i < env->active_node_num; i++){
-		free(env->nodes[i]->statues);
-		free(env->nodes[i]);
-	};
-	free(env->nodes);
+	free_status_table(env);
+
+	free(env->cluster_nodes);
+	free_peers();
+	free_reassembly();
+	free_gossip();
+	close_reactor();
 
 	/* free the services */
-	free(env->services);
+	free_service_index();
+	munmap(env->services, env->service_num * sizeof(Service));
 
 	/* destroy the mutex */
 	sem_destroy(&mutex);
@@ -0,0 +1,651 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file matrix.c
+ * @brief the statuses of the services on the active nodes as dense bitsets, so that the counts and the searches are popcount and ctz over whole words
+ * @author Li Jiliang<tjulijiliang@gmail.com
+ * @version 1.0
+ * @date 2011-11-09
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hast3.h"
+#include "matrix.h"
+
+#define BITSET_WORDS(n)	(((n) + 63) / 64)
+/* the low bit of every 2 bits status */
+#define LOW_BITS	0x5555555555555555ULL
+
+/* a bitset per status and service, each of row_words words */
+static uint64_t *rows[3] = {NULL, NULL, NULL};
+static int row_words = 0;
+static int matrix_services = 0;
+
+/* the running nodes of each service, and the services not on exactly one */
+static int *running_cnt = NULL;
+static uint64_t *unsettled = NULL;
+
+/* 
+ * the load index: the running services of each node id, and the ids in
+ * doubly linked buckets by their load plus the commands planned by the
+ * current check, from min_key to max_key
+ */
+static int *loads = NULL;
+static int *keys = NULL;
+static int *bucket_next = NULL;
+static int *bucket_prev = NULL;
+static int *buckets = NULL;
+static int id_cap = 0;
+static int indexed_num = 0;
+static int min_key = -1, max_key = -1;
+/* the ids planned in the current check, marked by the check count */
+static int *planned = NULL;
+static int planned_num = 0;
+static int *plan_marks = NULL;
+static int plan_pass = 1;
+
+/* bumped on every change of the statuses or of the nodes */
+static unsigned long changes = 0;
+
+static int normalize(int status);
+static int alloc_aggregates(int service_num);
+static int grow_ids(int cap);
+static void settle(int service);
+static void bucket_insert(int id, int key);
+static void bucket_remove(int id);
+static void add_running(int service, int id, int delta);
+
+/**
+ * @brief the statuses other than Running and Failed are taken as Nonrunning
+ */
+static int normalize(int status){
+	if(status == Service_Running || status == Service_Failed)
+		return status;
+	return Service_Nonrunning;
+}
+
+/**
+ * @brief make room in the bitsets and the load index for the node ids below node_cap, the bits already set are kept. The services are never changed once a node is attached.
+ *
+ * @param service_num number of services
+ * @param node_cap upper bound of the node ids
+ *
+ * @return 0 on success and 1 on failure
+ */
+int resize_status_matrix(int service_num, int node_cap){
+	int words = BITSET_WORDS(node_cap), i, j;
+	uint64_t *tmp[3];
+
+	if(service_num != matrix_services && alloc_aggregates(service_num) != 0)
+		return 1;
+	if(words * 64 > id_cap && grow_ids(words * 64) != 0)
+		return 1;
+	if(service_num == matrix_services && words <= row_words)
+		return 0;
+	for(i = 0; i < 3; i++){
+		tmp[i] = (uint64_t *)calloc((size_t)service_num * words + 1,
+				sizeof(uint64_t));
+		if(tmp[i] == NULL){
+			while(i-- > 0)
+				free(tmp[i]);
+			return 1;
+		}
+	}
+	for(i = 0; i < 3; i++){
+		if(service_num == matrix_services)
+			for(j = 0; j < service_num; j++)
+				memcpy(tmp[i] + (size_t)j * words,
+						rows[i] + (size_t)j * row_words,
+						row_words * sizeof(uint64_t));
+		free(rows[i]);
+		rows[i] = tmp[i];
+	}
+	row_words = words;
+	matrix_services = service_num;
+	return 0;
+}
+
+/**
+ * @brief allocate the aggregates of the services, none of them is running on any node yet
+ *
+ * @param service_num number of services
+ *
+ * @return 0 on success and 1 on failure
+ */
+static int alloc_aggregates(int service_num){
+	int i;
+
+	free(running_cnt);
+	free(unsettled);
+	free(buckets);
+	running_cnt = (int *)calloc(service_num + 1, sizeof(int));
+	unsettled = (uint64_t *)calloc(BITSET_WORDS(service_num) + 1,
+			sizeof(uint64_t));
+	/* a node runs at most all the services */
+	buckets = (int *)malloc((service_num + 1) * sizeof(int));
+	if(running_cnt == NULL || unsettled == NULL || buckets == NULL)
+		return 1;
+	for(i = 0; i < service_num; i++)
+		unsettled[i / 64] |= 1ULL << (i % 64);
+	for(i = 0; i <= service_num; i++)
+		buckets[i] = -1;
+	indexed_num = 0;
+	min_key = max_key = -1;
+	planned_num = 0;
+	return 0;
+}
+
+/**
+ * @brief grow the arrays of the load index indexed by node id
+ *
+ * @param cap the new number of ids
+ *
+ * @return 0 on success and 1 on failure
+ */
+static int grow_ids(int cap){
+	int **arrays[] = {&loads, &keys, &bucket_next, &bucket_prev, &planned,
+		&plan_marks};
+	int *tmp;
+	unsigned i;
+
+	for(i = 0; i < sizeof(arrays) / sizeof(arrays[0]); i++){
+		tmp = (int *)realloc(*arrays[i], cap * sizeof(int));
+		if(tmp == NULL)
+			return 1;
+		memset(tmp + id_cap, 0, (cap - id_cap) * sizeof(int));
+		*arrays[i] = tmp;
+	}
+	id_cap = cap;
+	return 0;
+}
+
+/**
+ * @brief free the bitsets and the aggregates
+ */
+void free_status_matrix(){
+	int i;
+
+	for(i = 0; i < 3; i++){
+		free(rows[i]);
+		rows[i] = NULL;
+	}
+	free(running_cnt);
+	free(unsettled);
+	free(buckets);
+	free(loads);
+	free(keys);
+	free(bucket_next);
+	free(bucket_prev);
+	free(planned);
+	free(plan_marks);
+	running_cnt = NULL;
+	unsettled = NULL;
+	buckets = loads = keys = bucket_next = bucket_prev = planned = NULL;
+	plan_marks = NULL;
+	row_words = 0;
+	matrix_services = 0;
+	id_cap = indexed_num = planned_num = 0;
+	min_key = max_key = -1;
+}
+
+/**
+ * @brief mark the service unsettled unless it's running on exactly one node
+ */
+static void settle(int service){
+	if(running_cnt[service] == 1)
+		unsettled[service / 64] &= ~(1ULL << (service % 64));
+	else
+		unsettled[service / 64] |= 1ULL << (service % 64);
+}
+
+/**
+ * @brief put the id into the bucket of the key
+ */
+static void bucket_insert(int id, int key){
+	keys[id] = key;
+	bucket_prev[id] = -1;
+	bucket_next[id] = buckets[key];
+	if(buckets[key] >= 0)
+		bucket_prev[buckets[key]] = id;
+	buckets[key] = id;
+	if(indexed_num++ == 0)
+		min_key = max_key = key;
+	else if(key < min_key)
+		min_key = key;
+	else if(key > max_key)
+		max_key = key;
+}
+
+/**
+ * @brief take the id out of its bucket, min_key and max_key move on past the buckets left empty
+ */
+static void bucket_remove(int id){
+	int key = keys[id];
+
+	if(bucket_prev[id] >= 0)
+		bucket_next[bucket_prev[id]] = bucket_next[id];
+	else
+		buckets[key] = bucket_next[id];
+	if(bucket_next[id] >= 0)
+		bucket_prev[bucket_next[id]] = bucket_prev[id];
+
+	if(--indexed_num == 0){
+		min_key = max_key = -1;
+		return;
+	}
+	if(buckets[key] >= 0)
+		return;
+	if(key == min_key)
+		while(buckets[min_key] < 0)
+			min_key++;
+	if(key == max_key)
+		while(buckets[max_key] < 0)
+			max_key--;
+}
+
+/**
+ * @brief count the service as started or stopped on the node
+ */
+static void add_running(int service, int id, int delta){
+	running_cnt[service] += delta;
+	settle(service);
+	loads[id] += delta;
+	bucket_remove(id);
+	bucket_insert(id, keys[id] + delta);
+}
+
+/**
+ * @brief set every service of the view, and the padding after them, to Nonrunning
+ *
+ * @param view the view of a node
+ * @param service_num number of services
+ */
+void init_status_view(uint64_t *view, int service_num){
+	int i;
+
+	for(i = 0; i < STATUS_VIEW_WORDS(service_num); i++)
+		view[i] = LOW_BITS * Service_Nonrunning;
+}
+
+/**
+ * @brief the status of the service in the view of a node
+ *
+ * @param view the view of a node
+ * @param service index of the service
+ *
+ * @return the status
+ */
+int view_status(const uint64_t *view, int service){
+	return (view[service / STATUS_PER_WORD] >>
+			(service % STATUS_PER_WORD * 2)) & 3;
+}
+
+/**
+ * @brief change the view alone, for the views which are not in the bitsets such as the snapshots
+ *
+ * @param view the view of a node
+ * @param service index of the service
+ * @param status the status
+ */
+void put_view_status(uint64_t *view, int service, int status){
+	int shift = service % STATUS_PER_WORD * 2;
+	uint64_t *word = &view[service / STATUS_PER_WORD];
+
+	*word = (*word & ~(3ULL << shift)) |
+		((uint64_t)normalize(status) << shift);
+}
+
+/**
+ * @brief count the running services in the view
+ *
+ * @param view the view of a node
+ * @param service_num number of services
+ *
+ * @return the count
+ */
+int count_running(const uint64_t *view, int service_num){
+	int i, count = 0;
+
+	/* Service_Running is 0, so both bits of it are clear */
+	for(i = 0; i < STATUS_VIEW_WORDS(service_num); i++)
+		count += __builtin_popcountll(~(view[i] | view[i] >> 1) & LOW_BITS);
+	return count;
+}
+
+/**
+ * @brief find the next running service in the view
+ *
+ * @param view the view of a node
+ * @param service_num number of services
+ * @param from index of the first service to look at
+ *
+ * @return index of the service, -1 if none is running from there on
+ */
+int next_running(const uint64_t *view, int service_num, int from){
+	int i = from / STATUS_PER_WORD;
+	uint64_t mask;
+
+	if(from >= service_num)
+		return -1;
+	mask = ~(view[i] | view[i] >> 1) & LOW_BITS &
+		(~0ULL << (from % STATUS_PER_WORD * 2));
+	for(;;){
+		if(mask != 0)
+			return i * STATUS_PER_WORD + __builtin_ctzll(mask) / 2;
+		if(++i >= STATUS_VIEW_WORDS(service_num))
+			return -1;
+		mask = ~(view[i] | view[i] >> 1) & LOW_BITS;
+	}
+}
+
+/**
+ * @brief put the statuses of the view into the bitsets under the node id
+ *
+ * @param view the view of the node
+ * @param id the node id, below the node_cap of resize_status_matrix()
+ * @param service_num number of services
+ */
+void attach_node(const uint64_t *view, int id, int service_num){
+	int i;
+
+	for(i = 0; i < service_num; i++)
+		rows[view_status(view, i)][(size_t)i * row_words + id / 64] |=
+			1ULL << (id % 64);
+	loads[id] = 0;
+	bucket_insert(id, 0);
+	for(i = next_running(view, service_num, 0); i >= 0;
+			i = next_running(view, service_num, i + 1))
+		add_running(i, id, 1);
+	changes++;
+}
+
+/**
+ * @brief remove the node id from the bitsets, so that the id may be reused
+ *
+ * @param view the view of the node
+ * @param id the node id
+ * @param service_num number of services
+ */
+void detach_node(const uint64_t *view, int id, int service_num){
+	int i;
+
+	for(i = 0; i < service_num; i++)
+		rows[view_status(view, i)][(size_t)i * row_words + id / 64] &=
+			~(1ULL << (id % 64));
+	for(i = next_running(view, service_num, 0); i >= 0;
+			i = next_running(view, service_num, i + 1)){
+		running_cnt[i]--;
+		settle(i);
+	}
+	bucket_remove(id);
+	changes++;
+}
+
+/**
+ * @brief change the status of the service on an attached node
+ *
+ * @param view the view of the node
+ * @param id the node id
+ * @param service index of the service
+ * @param status the status
+ */
+void set_node_status(uint64_t *view, int id, int service, int status){
+	int old = view_status(view, service);
+	size_t word = (size_t)service * row_words + id / 64;
+
+	status = normalize(status);
+	if(status == old)
+		return;
+	rows[old][word] &= ~(1ULL << (id % 64));
+	rows[status][word] |= 1ULL << (id % 64);
+	put_view_status(view, service, status);
+	if(old == Service_Running)
+		add_running(service, id, -1);
+	else if(status == Service_Running)
+		add_running(service, id, 1);
+	changes++;
+}
+
+/**
+ * @brief copy a view into the view of an attached node, only the changed services touch the bitsets
+ *
+ * @param view the view of the node
+ * @param id the node id
+ * @param from the view to copy
+ * @param service_num number of services
+ */
+void load_node_view(uint64_t *view, int id, const uint64_t *from,
+		int service_num){
+	int i, service;
+	uint64_t diff;
+
+	for(i = 0; i < STATUS_VIEW_WORDS(service_num); i++){
+		/* a bit of each changed status, the padding never differs */
+		diff = view[i] ^ from[i];
+		diff = (diff | diff >> 1) & LOW_BITS;
+		while(diff != 0){
+			service = i * STATUS_PER_WORD + __builtin_ctzll(diff) / 2;
+			set_node_status(view, id, service, view_status(from, service));
+			diff &= diff - 1;
+		}
+	}
+}
+
+/**
+ * @brief count the nodes on which the service has the status
+ *
+ * @param status the status
+ * @param service index of the service
+ *
+ * @return the count
+ */
+int count_nodes(int status, int service){
+	const uint64_t *row = rows[status] + (size_t)service * row_words;
+	int i, count = 0;
+
+	for(i = 0; i < row_words; i++)
+		count += __builtin_popcountll(row[i]);
+	return count;
+}
+
+/**
+ * @brief find the next node on which the service has the status
+ *
+ * @param status the status
+ * @param service index of the service
+ * @param from the first node id to look at
+ *
+ * @return the node id, -1 if there is none from there on
+ */
+int next_node(int status, int service, int from){
+	const uint64_t *row = rows[status] + (size_t)service * row_words;
+	int i = from / 64;
+	uint64_t mask;
+
+	if(i >= row_words)
+		return -1;
+	mask = row[i] & (~0ULL << (from % 64));
+	for(;;){
+		if(mask != 0)
+			return i * 64 + __builtin_ctzll(mask);
+		if(++i >= row_words)
+			return -1;
+		mask = row[i];
+	}
+}
+
+/**
+ * @brief whether the service has the status on the node
+ *
+ * @param status the status
+ * @param service index of the service
+ * @param id the node id
+ *
+ * @return 1 if so and 0 otherwise
+ */
+int node_has_status(int status, int service, int id){
+	if(id / 64 >= row_words)
+		return 0;
+	return (rows[status][(size_t)service * row_words + id / 64] >>
+			(id % 64)) & 1;
+}
+
+/**
+ * @brief the number of nodes running the service, kept up to date by the changes
+ *
+ * @param service index of the service
+ *
+ * @return the count
+ */
+int running_count(int service){
+	return running_cnt[service];
+}
+
+/**
+ * @brief find the next service which is running on none or multiple nodes
+ *
+ * @param from index of the first service to look at
+ *
+ * @return index of the service, -1 if there is none from there on
+ */
+int next_unsettled(int from){
+	int i = from / 64, words = BITSET_WORDS(matrix_services);
+	uint64_t mask;
+
+	if(from >= matrix_services)
+		return -1;
+	mask = unsettled[i] & (~0ULL << (from % 64));
+	for(;;){
+		if(mask != 0)
+			return i * 64 + __builtin_ctzll(mask);
+		if(++i >= words)
+			return -1;
+		mask = unsettled[i];
+	}
+}
+
+/**
+ * @brief the number of services running on the node
+ *
+ * @param id the node id
+ *
+ * @return the load
+ */
+int node_load(int id){
+	return loads[id];
+}
+
+/**
+ * @brief the load of the node plus the commands planned for it
+ *
+ * @param id the node id
+ *
+ * @return the planned load
+ */
+int planned_load(int id){
+	return keys[id];
+}
+
+/**
+ * @brief the least planned load of the attached nodes
+ *
+ * @return the load, -1 if no node is attached
+ */
+int least_load(){
+	return min_key;
+}
+
+/**
+ * @brief the most planned load of the attached nodes
+ *
+ * @return the load, -1 if no node is attached
+ */
+int most_load(){
+	return max_key;
+}
+
+/**
+ * @brief the first node id in the bucket of the planned load
+ *
+ * @param load the planned load
+ *
+ * @return the node id, -1 if the bucket is empty
+ */
+int first_at_load(int load){
+	if(load < 0 || load > matrix_services)
+		return -1;
+	return buckets[load];
+}
+
+/**
+ * @brief the next node id in the same bucket
+ *
+ * @param id the node id
+ *
+ * @return the node id, -1 at the end of the bucket
+ */
+int next_at_load(int id){
+	return bucket_next[id];
+}
+
+/**
+ * @brief move the node in the load index by the START or STOP told to it, until clear_planned_loads()
+ *
+ * @param id the node id
+ * @param delta 1 for a START and -1 for a STOP
+ */
+void plan_load(int id, int delta){
+	int key = keys[id] + delta;
+
+	if(key < 0 || key > matrix_services)
+		return;
+	if(plan_marks[id] != plan_pass){
+		plan_marks[id] = plan_pass;
+		planned[planned_num++] = id;
+	}
+	bucket_remove(id);
+	bucket_insert(id, key);
+}
+
+/**
+ * @brief put the nodes back in the load index by their loads
+ */
+void clear_planned_loads(){
+	int id;
+
+	while(planned_num > 0){
+		id = planned[--planned_num];
+		if(keys[id] == loads[id])
+			continue;
+		bucket_remove(id);
+		bucket_insert(id, loads[id]);
+	}
+	plan_pass++;
+}
+
+/**
+ * @brief the number of changes of the statuses and of the nodes so far, equal numbers mean nothing has changed in between
+ *
+ * @return the number
+ */
+unsigned long status_changes(){
+	return changes;
+}
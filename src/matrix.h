@@ -0,0 +1,69 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file matrix.h
+ * @brief 
+ * @author Li Jiliang<tjulijiliang@gmail.com
+ * @version 1.0
+ * @date 2011-11-09
+ */
+#ifndef _MATRIX_H_
+#define _MATRIX_H_
+
+#include <stdint.h>
+
+/* 
+ * The statuses of the cluster are kept twice: a bitset per service and
+ * status whose bits are the node ids, and the view of each node with 2
+ * bits per service. A status other than Running or Failed is Nonrunning.
+ * The running count of each service and the load of each node are kept
+ * along with them, the nodes are bucketed by load.
+ */
+#define STATUS_PER_WORD	32
+#define STATUS_VIEW_WORDS(service_num)	\
+	(((service_num) + STATUS_PER_WORD - 1) / STATUS_PER_WORD)
+
+int resize_status_matrix(int service_num, int node_cap);
+void free_status_matrix();
+void init_status_view(uint64_t *view, int service_num);
+int view_status(const uint64_t *view, int service);
+void put_view_status(uint64_t *view, int service, int status);
+int count_running(const uint64_t *view, int service_num);
+int next_running(const uint64_t *view, int service_num, int from);
+void attach_node(const uint64_t *view, int id, int service_num);
+void detach_node(const uint64_t *view, int id, int service_num);
+void set_node_status(uint64_t *view, int id, int service, int status);
+void load_node_view(uint64_t *view, int id, const uint64_t *from,
+		int service_num);
+int count_nodes(int status, int service);
+int next_node(int status, int service, int from);
+int node_has_status(int status, int service, int id);
+int running_count(int service);
+int next_unsettled(int from);
+int node_load(int id);
+int planned_load(int id);
+int least_load();
+int most_load();
+int first_at_load(int load);
+int next_at_load(int id);
+void plan_load(int id, int delta);
+void clear_planned_loads();
+unsigned long status_changes();
+
+#endif
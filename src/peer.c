@@ -0,0 +1,232 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/**
+ * @file peer.c
+ * @brief cache of the addresses of the other nodes, learned from their heartbeats or given in config, so that the commands are sent without asking the resolver
+ * @author Li Jiliang<tjulijiliang@gmail.com
+ * @version 1.0
+ * @date 2011-11-09
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hast3.h"
+#include "peer.h"
+#include "util.h"
+
+#define PEER_TABLE_RESIZE	8
+
+typedef struct{
+	char nodename[NAMELEN];
+	struct in_addr addr;
+	/* in network byte order, 0 for the Port in config */
+	in_port_t port;
+	/* monotonic time the address was learned, unused if it's static */
+	double learned_at;
+	int is_static;
+} Peer;
+
+/* sorted by node name */
+static Peer *peers = NULL;
+static int peer_num = 0;
+static int peer_cap = 0;
+
+static Peer * find_peer(const char *node);
+static Peer * insert_peer(const char *node);
+static int cmp_peer(const void *arg1, const void *arg2);
+
+/**
+ * @brief add an address given in config, which is never replaced by the learned ones
+ *
+ * @param node name of the node
+ * @param addr address in dotted decimal
+ *
+ * @return 0 on success and -1 on failure
+ */
+int add_static_peer(const char *node, const char *addr){
+	Peer *peer;
+	struct in_addr in;
+
+	if(strlen(node) >= NAMELEN || inet_aton(addr, &in) == 0)
+		return -1;
+
+	peer = insert_peer(node);
+	if(peer == NULL)
+		return -1;
+	peer->addr = in;
+	peer->is_static = 1;
+	return 0;
+}
+
+/**
+ * @brief remember the source address of a message from the node
+ *
+ * @param node name of the node
+ * @param from source address of the message
+ */
+void learn_peer(const char *node, const struct sockaddr_in *from){
+	Peer *peer;
+
+	if(from->sin_family != AF_INET)
+		return;
+
+	peer = find_peer(node);
+	if(peer == NULL)
+		peer = insert_peer(node);
+	if(peer == NULL || peer->is_static)
+		return;
+
+	peer->addr = from->sin_addr;
+	peer->learned_at = monotonic_time();
+}
+
+/**
+ * @brief remember the address and the port the hast3 of the node listens on, as told by the gossip
+ *
+ * @param node name of the node
+ * @param addr address of the node
+ */
+void set_peer_address(const char *node, const struct sockaddr_in *addr){
+	Peer *peer;
+
+	peer = insert_peer(node);
+	if(peer == NULL || peer->is_static)
+		return;
+
+	peer->addr = addr->sin_addr;
+	peer->port = addr->sin_port;
+	peer->learned_at = monotonic_time();
+}
+
+/**
+ * @brief get the address of the hast3 of the node, the resolver is only asked if nothing is heard from the node for peer_ttl
+ *
+ * @param env Env struct
+ * @param node name of the node
+ * @param address where the address is stored
+ *
+ * @return 0 on success and -1 on failure
+ */
+int lookup_peer(Env *env, const char *node, struct sockaddr_in *address){
+	Peer *peer;
+	struct hostent *hostinfo;
+
+	peer = find_peer(node);
+	if(peer == NULL ||
+			(!peer->is_static &&
+			 peer->learned_at + env->peer_ttl < monotonic_time())){
+		hostinfo = gethostbyname(node);
+		if(hostinfo != NULL){
+			if(peer == NULL)
+				peer = insert_peer(node);
+			if(peer != NULL){
+				peer->addr = *(struct in_addr *)*hostinfo->h_addr_list;
+				peer->learned_at = monotonic_time();
+			}
+		}
+		/* an expired address is still better than none */
+		if(peer == NULL)
+			return -1;
+	}
+
+	memset(address, 0, sizeof(struct sockaddr_in));
+	address->sin_family = AF_INET;
+	address->sin_port = peer->port != 0 ? peer->port :
+		htons((uint16_t)env->port);
+	address->sin_addr = peer->addr;
+	return 0;
+}
+
+/**
+ * @brief free the cache
+ */
+void free_peers(){
+	free(peers);
+	peers = NULL;
+	peer_num = 0;
+	peer_cap = 0;
+}
+
+/**
+ * @brief find the cached address of the node
+ *
+ * @param node name of the node
+ *
+ * @return address of the entry on success and NULL if it's not cached
+ */
+static Peer * find_peer(const char *node){
+	Peer key;
+
+	if(peer_num == 0)
+		return NULL;
+	strncpy(key.nodename, node, NAMELEN - 1);
+	key.nodename[NAMELEN-1] = '\0';
+	return bsearch(&key, peers, peer_num, sizeof(Peer), cmp_peer);
+}
+
+/**
+ * @brief find the entry of the node or insert an empty one in order
+ *
+ * @param node name of the node
+ *
+ * @return address of the entry on success and NULL on failure
+ */
+static Peer * insert_peer(const char *node){
+	Peer *tmp;
+	int i;
+
+	tmp = find_peer(node);
+	if(tmp != NULL)
+		return tmp;
+
+	if(peer_num >= peer_cap){
+		tmp = realloc(peers, (peer_cap + PEER_TABLE_RESIZE) * sizeof(Peer));
+		if(tmp == NULL)
+			return NULL;
+		peers = tmp;
+		peer_cap += PEER_TABLE_RESIZE;
+	}
+
+	for(i = peer_num; i > 0 && strcmp(peers[i-1].nodename, node) > 0; i--)
+		peers[i] = peers[i-1];
+	memset(&peers[i], 0, sizeof(Peer));
+	strncpy(peers[i].nodename, node, NAMELEN - 1);
+	peer_num++;
+	return &peers[i];
+}
+
+/**
+ * @brief compares two Peer by node name
+ *
+ * @param arg1 pointer to Peer
+ * @param arg2 pointer to Peer
+ *
+ * @return result of strcmp
+ */
+static int cmp_peer(const void *arg1, const void *arg2){
+	return strcmp(((const Peer *)arg1)->nodename,
+			((const Peer *)arg2)->nodename);
+}
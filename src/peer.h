@@ -0,0 +1,32 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+#ifndef _PEER_H_
+#define _PEER_H_
+
+#include <netinet/in.h>
+
+#include "hast3.h"
+
+int add_static_peer(const char *node, const char *addr);
+void learn_peer(const char *node, const struct sockaddr_in *from);
+void set_peer_address(const char *node, const struct sockaddr_in *addr);
+int lookup_peer(Env *env, const char *node, struct sockaddr_in *address);
+void free_peers();
+
+#endif
@@ -0,0 +1,291 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/**
+ * @file probe.c
+ * @brief concurrent execution of the state commands for the collect process
+ * @author Li Jiliang<tjulijiliang@gmail.com
+ * @version 1.0
+ * @date 2011-11-09
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "hast3.h"
+#include "probe.h"
+#include "util.h"
+#include "proc.h"
+
+typedef struct{
+	pid_t pid;
+	int service_index;
+} Probe_slot;
+
+/* when and how often a service is probed */
+typedef struct{
+	double next_probe;
+	double interval;
+	int last_result;
+	int kicked;
+} Probe_schedule;
+
+static Probe_slot *slots = NULL;
+static int slot_num = 0;
+static Probe_schedule *schedules = NULL;
+
+static int reap_probe(int results[]);
+
+/**
+ * @brief allocate the slots of running probes, must be called before run_probes()
+ *
+ * @param env Env struct
+ *
+ * @return STATUS_OK on success and STATUS_CLECT_ERR on failure
+ */
+int init_probes(Env *env){
+	int i;
+
+	slot_num = env->probe_concurrency;
+	if(slot_num <= 0)
+		slot_num = DEFAULT_PROBE_CONCURRENCY;
+
+	slots = (Probe_slot *)calloc(slot_num, sizeof(Probe_slot));
+	schedules = (Probe_schedule *)calloc(env->service_num,
+			sizeof(Probe_schedule));
+	if(slots == NULL || schedules == NULL)
+		return STATUS_CLECT_ERR;
+
+	/* everything is probed in the first cycle */
+	for(i = 0; i < env->service_num; i++){
+		schedules[i].next_probe = 0.0;
+		schedules[i].interval = env->services[i].probe_interval;
+		schedules[i].last_result = -1;
+	}
+
+	return init_proc_index(env);
+}
+
+/**
+ * @brief decide which services should be probed in this cycle
+ *
+ * @param env Env struct
+ * @param now current monotonic time in seconds
+ * @param due[] set to 1 for the services to probe and 0 for the others
+ *
+ * @return number of the services to probe
+ */
+int schedule_probes(Env *env, double now, int due[]){
+	int i, num = 0;
+	/* the probes fall due within half a heartbeat are run now */
+	double horizon = now + env->ha_interval / 2;
+
+	for(i = 0; i < env->service_num; i++){
+		schedules[i].kicked = env->services[i].probe_now;
+		if(schedules[i].kicked)
+			env->services[i].probe_now = 0;
+		due[i] = schedules[i].next_probe <= horizon || schedules[i].kicked;
+		num += due[i];
+	}
+	return num;
+}
+
+/**
+ * @brief compute when the probed services should be probed again, a service keeping the same result backs off up to probe_max_interval, while a change, a failed probe or a command just received brings it back to its ProbeInterval
+ *
+ * @param env Env struct
+ * @param now monotonic time in seconds when the cycle started
+ * @param due[] the services probed in this cycle
+ * @param results[] exit code of the state commands
+ *
+ * @return 0
+ */
+int reschedule_probes(Env *env, double now, const int due[],
+		const int results[]){
+	int i;
+	Probe_schedule *sched;
+
+	for(i = 0; i < env->service_num; i++){
+		if(!due[i])
+			continue;
+		sched = &schedules[i];
+
+		if(!env->adaptive_probe || sched->kicked ||
+				results[i] == -1 || results[i] != sched->last_result)
+			sched->interval = env->services[i].probe_interval;
+		else{
+			sched->interval *= 2;
+			if(sched->interval > env->probe_max_interval)
+				sched->interval = env->probe_max_interval;
+		}
+
+		sched->last_result = results[i];
+		sched->next_probe = now + sched->interval;
+	}
+	return 0;
+}
+
+/**
+ * @brief run the state commands of the due services, at most probe_concurrency of them at the same time, the builtin probes are all answered by a single scan of /proc
+ *
+ * @param env Env struct
+ * @param due[] the services to probe, NULL for all of them
+ * @param results[] where the exit code of each state command is stored, -1 if it cannot be executed, untouched for the services not due
+ *
+ * @return number of probes which cannot be executed
+ */
+int run_probes(Env *env, const int due[], int results[]){
+	int next = 0, running = 0, tries, i, failed = 0;
+	pid_t pid;
+
+	scan_processes(env, due, results);
+
+	while(next < env->service_num || running > 0){
+		/* fill up the free slots */
+		while(next < env->service_num && running < slot_num){
+			if(env->services[next].statecmd.builtin != Builtin_None ||
+					(due != NULL && !due[next])){
+				next++;
+				continue;
+			}
+
+			for(tries = 0; tries < MAX_TRY_NUM; tries++){
+				pid = spawn_command(&env->services[next].statecmd);
+				if(pid > 0)
+					break;
+			}
+
+			if(pid > 0){
+				for(i = 0; slots[i].pid != 0; i++)
+					;
+				slots[i].pid = pid;
+				slots[i].service_index = next;
+				running++;
+			}
+			else{
+				results[next] = -1;
+				failed++;
+			}
+			next++;
+		}
+
+		/* wait for whichever probe finishes first */
+		if(running > 0){
+			if(reap_probe(results) == 0)
+				running--;
+			else if(errno == ECHILD){
+				/* someone else reaped our children, give up on them */
+				for(i = 0; i < slot_num; i++)
+					if(slots[i].pid != 0){
+						results[slots[i].service_index] = -1;
+						slots[i].pid = 0;
+						failed++;
+					}
+				running = 0;
+			}
+		}
+	}
+
+	return failed;
+}
+
+/**
+ * @brief wait for one probe to exit and record its exit code
+ *
+ * @param results[] exit code of each state command
+ *
+ * @return 0 if a probe has been reaped and -1 on failure
+ */
+static int reap_probe(int results[]){
+	int i, status;
+	pid_t pid;
+
+	do{
+		pid = waitpid(-1, &status, 0);
+	} while(pid == -1 && errno == EINTR);
+	if(pid == -1)
+		return -1;
+
+	for(i = 0; i < slot_num; i++)
+		if(slots[i].pid == pid)
+			break;
+	/* not one of ours */
+	if(i >= slot_num){
+		errno = 0;
+		return -1;
+	}
+
+	if(WIFEXITED(status))
+		results[slots[i].service_index] = WEXITSTATUS(status);
+	else
+		results[slots[i].service_index] = -1;
+	slots[i].pid = 0;
+
+	return 0;
+}
+
+/**
+ * @brief publish the probe result to the main process, the collect process is the only writer
+ *
+ * @param service the probed service, in the shared memory
+ * @param result exit code of the state command
+ * @param status status sent in the heartbeat
+ * @param probed_at monotonic time of the probe
+ */
+void publish_local_status(Service *service, int result, int status,
+		double probed_at){
+	/* odd while the fields are being written */
+	__atomic_add_fetch(&service->status_seq, 1, __ATOMIC_ACQ_REL);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	service->local_result = result;
+	service->local_status = status;
+	service->probed_at = probed_at;
+	__atomic_add_fetch(&service->status_seq, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief read a consistent copy of the probe result published by the collect process
+ *
+ * @param service the service, in the shared memory
+ * @param result exit code of the state command
+ * @param status status sent in the heartbeat
+ * @param probed_at monotonic time of the probe, 0 if it's never probed
+ *
+ * @return version of the result
+ */
+unsigned read_local_status(const Service *service, int *result, int *status,
+		double *probed_at){
+	unsigned seq;
+
+	for(;;){
+		seq = __atomic_load_n(&service->status_seq, __ATOMIC_ACQUIRE);
+		if(seq & 1)
+			continue;
+		*result = service->local_result;
+		*status = service->local_status;
+		*probed_at = service->probed_at;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(seq == __atomic_load_n(&service->status_seq, __ATOMIC_ACQUIRE))
+			return seq;
+	}
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+#ifndef _PROBE_H_
+#define _PROBE_H_
+
+#include "hast3.h"
+
+#define DEFAULT_PROBE_CONCURRENCY	8
+/* ProbeMaxInterval defaults to so many heartbeats */
+#define DEFAULT_PROBE_BACKOFF	16
+
+int init_probes(Env *env);
+int schedule_probes(Env *env, double now, int due[]);
+int run_probes(Env *env, const int due[], int results[]);
+int reschedule_probes(Env *env, double now, const int due[],
+		const int results[]);
+void publish_local_status(Service *service, int result, int status,
+		double probed_at);
+unsigned read_local_status(const Service *service, int *result, int *status,
+		double *probed_at);
+
+#endif
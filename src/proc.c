@@ -0,0 +1,303 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/**
+ * @file proc.c
+ * @brief builtin probes which are answered from /proc without forking
+ * @author Li Jiliang<tjulijiliang@gmail.com
+ * @version 1.0
+ * @date 2011-11-09
+ */
+
+#include <sys/types.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "hast3.h"
+#include "proc.h"
+
+/* one wanted process name and the pid found by the last scan */
+typedef struct{
+	char comm[COMMLEN];
+	pid_t pid;
+} Proc_entry;
+
+/* sorted by comm, each name appears only once */
+static Proc_entry *proc_index = NULL;
+static int proc_index_num = 0;
+/* the index entry of each service, -1 if it's not a process probe */
+static int *service_entry = NULL;
+
+static int cmp_proc_entry(const void *arg1, const void *arg2);
+static int read_comm(int procfd, const char *pid, char comm[]);
+static int walk_proc(Proc_entry *index, int num);
+static int pid_alive(pid_t pid);
+
+/**
+ * @brief build the index of the process names wanted by the builtin:process probes
+ *
+ * @param env Env struct
+ *
+ * @return STATUS_OK on success and STATUS_CLECT_ERR on failure
+ */
+int init_proc_index(Env *env){
+	int i, j, num = 0;
+	Proc_entry key, *found;
+	Command *cmd;
+
+	proc_index = (Proc_entry *)calloc(env->service_num, sizeof(Proc_entry));
+	service_entry = (int *)calloc(env->service_num, sizeof(int));
+	if(proc_index == NULL || service_entry == NULL)
+		return STATUS_CLECT_ERR;
+
+	for(i = 0; i < env->service_num; i++){
+		cmd = &env->services[i].statecmd;
+		if(cmd->builtin != Builtin_Process)
+			continue;
+		strncpy(proc_index[num].comm, cmd->argv[0], COMMLEN - 1);
+		num++;
+	}
+	qsort(proc_index, num, sizeof(Proc_entry), cmp_proc_entry);
+
+	/* drop the duplicated names */
+	for(i = 0, j = 0; i < num; i++)
+		if(j == 0 || strcmp(proc_index[j-1].comm, proc_index[i].comm) != 0)
+			proc_index[j++] = proc_index[i];
+	proc_index_num = j;
+
+	for(i = 0; i < env->service_num; i++){
+		service_entry[i] = -1;
+		cmd = &env->services[i].statecmd;
+		if(cmd->builtin != Builtin_Process)
+			continue;
+		memset(&key, 0, sizeof(key));
+		strncpy(key.comm, cmd->argv[0], COMMLEN - 1);
+		found = bsearch(&key, proc_index, proc_index_num, sizeof(Proc_entry),
+				cmp_proc_entry);
+		service_entry[i] = (int)(found - proc_index);
+	}
+
+	return STATUS_OK;
+}
+
+/**
+ * @brief answer all the due builtin probes with a single walk of /proc
+ *
+ * @param env Env struct
+ * @param due[] the services to probe, NULL for all of them
+ * @param results[] 0 for the services whose process exists and 1 for the others, untouched for non builtin probes
+ *
+ * @return number of the services answered
+ */
+int scan_processes(Env *env, const int due[], int results[]){
+	int i, answered = 0, walk = 0;
+	Command *cmd;
+
+	for(i = 0; i < env->service_num && !walk; i++)
+		walk = env->services[i].statecmd.builtin == Builtin_Process &&
+			(due == NULL || due[i]);
+	if(walk)
+		walk_proc(proc_index, proc_index_num);
+
+	for(i = 0; i < env->service_num; i++){
+		cmd = &env->services[i].statecmd;
+		if(due != NULL && !due[i])
+			continue;
+		if(cmd->builtin == Builtin_Process)
+			results[i] = proc_index[service_entry[i]].pid > 0 ? 0 : 1;
+		else if(cmd->builtin == Builtin_Pidfile)
+			results[i] = pid_alive(read_pidfile(cmd->argv[0])) ? 0 : 1;
+		else
+			continue;
+		answered++;
+	}
+
+	return answered;
+}
+
+/**
+ * @brief answer a single builtin probe, the exit code follows pgrep(1)
+ *
+ * @param cmd command
+ *
+ * @return 0 if the process exists, 1 if not
+ */
+int builtin_probe(const Command *cmd){
+	if(cmd->builtin == Builtin_Process)
+		return find_process(cmd->argv[0]) > 0 ? 0 : 1;
+	else
+		return pid_alive(read_pidfile(cmd->argv[0])) ? 0 : 1;
+}
+
+/**
+ * @brief the pid of the service as seen by the last scan_processes()
+ *
+ * @param env Env struct
+ * @param service_index the index of the service
+ *
+ * @return pid on success and 0 if it's unknown
+ */
+pid_t service_pid(Env *env, int service_index){
+	Command *cmd = &env->services[service_index].statecmd;
+
+	if(cmd->builtin == Builtin_Process)
+		return proc_index[service_entry[service_index]].pid;
+	else if(cmd->builtin == Builtin_Pidfile)
+		return read_pidfile(cmd->argv[0]);
+	return 0;
+}
+
+/**
+ * @brief find a process by its name
+ *
+ * @param name process name
+ *
+ * @return pid on success and 0 if there is no such process
+ */
+pid_t find_process(const char *name){
+	Proc_entry entry;
+
+	memset(&entry, 0, sizeof(entry));
+	strncpy(entry.comm, name, COMMLEN - 1);
+	walk_proc(&entry, 1);
+	return entry.pid;
+}
+
+/**
+ * @brief read the pid stored in a pid file
+ *
+ * @param path path of the pid file
+ *
+ * @return pid on success and 0 on failure
+ */
+pid_t read_pidfile(const char *path){
+	FILE *fp;
+	long pid = 0;
+
+	fp = fopen(path, "r");
+	if(fp == NULL)
+		return 0;
+	if(fscanf(fp, "%ld", &pid) != 1 || pid <= 0)
+		pid = 0;
+	fclose(fp);
+
+	return (pid_t)pid;
+}
+
+/**
+ * @brief walk /proc once and record the pid of each wanted name
+ *
+ * @param index sorted wanted names
+ * @param num number of names
+ *
+ * @return number of names found
+ */
+static int walk_proc(Proc_entry *index, int num){
+	DIR *dir;
+	struct dirent *dirent;
+	Proc_entry key, *found;
+	int i, found_num = 0;
+
+	for(i = 0; i < num; i++)
+		index[i].pid = 0;
+
+	dir = opendir("/proc");
+	if(dir == NULL)
+		return 0;
+
+	memset(&key, 0, sizeof(key));
+	while(found_num < num && (dirent = readdir(dir)) != NULL){
+		if(dirent->d_name[0] < '0' || dirent->d_name[0] > '9')
+			continue;
+		if(read_comm(dirfd(dir), dirent->d_name, key.comm) != 0)
+			continue;
+
+		found = bsearch(&key, index, num, sizeof(Proc_entry),
+				cmp_proc_entry);
+		if(found != NULL && found->pid == 0){
+			found->pid = (pid_t)atol(dirent->d_name);
+			found_num++;
+		}
+	}
+	closedir(dir);
+
+	return found_num;
+}
+
+/**
+ * @brief read /proc/<pid>/comm
+ *
+ * @param procfd fd of /proc
+ * @param pid pid in string
+ * @param comm[] where the name is stored, COMMLEN bytes
+ *
+ * @return 0 on success and -1 on failure
+ */
+static int read_comm(int procfd, const char *pid, char comm[]){
+	char path[NAME_MAX + 8];
+	int fd;
+	ssize_t len;
+
+	snprintf(path, sizeof(path), "%s/comm", pid);
+	fd = openat(procfd, path, O_RDONLY);
+	if(fd == -1)
+		return -1;
+	len = read(fd, comm, COMMLEN);
+	close(fd);
+	if(len <= 0)
+		return -1;
+
+	/* strip the tailing newline */
+	if(comm[len-1] == '\n')
+		len--;
+	memset(comm + len, 0, COMMLEN - len);
+	return 0;
+}
+
+/**
+ * @brief check if the process exists
+ *
+ * @param pid pid of the process
+ *
+ * @return 1 if it exists and 0 if not
+ */
+static int pid_alive(pid_t pid){
+	if(pid <= 0)
+		return 0;
+	return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+/**
+ * @brief compares two Proc_entry by name
+ *
+ * @param arg1 pointer to Proc_entry
+ * @param arg2 pointer to Proc_entry
+ *
+ * @return result of strcmp
+ */
+static int cmp_proc_entry(const void *arg1, const void *arg2){
+	return strcmp(((const Proc_entry *)arg1)->comm,
+			((const Proc_entry *)arg2)->comm);
+}
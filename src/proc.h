@@ -0,0 +1,40 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+#ifndef _PROC_H_
+#define _PROC_H_
+
+#include <sys/types.h>
+
+#include "hast3.h"
+
+#define BUILTIN_PREFIX	"builtin:"
+#define BUILTIN_PROCESS	"process:"
+#define BUILTIN_PIDFILE	"pidfile:"
+
+/* the kernel truncates the process name to 15 characters */
+#define COMMLEN 16
+
+int init_proc_index(Env *env);
+int scan_processes(Env *env, const int due[], int results[]);
+int builtin_probe(const Command *cmd);
+pid_t service_pid(Env *env, int service_index);
+pid_t find_process(const char *name);
+pid_t read_pidfile(const char *path);
+
+#endif
@@ -0,0 +1,756 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/**
+ * @file protocol.c
+ * @brief encode and decode the messages between the nodes, in the v1 format of struct Hast3_message or the compact v2 format
+ * @author Li Jiliang<tjulijiliang@gmail.com
+ * @version 1.0
+ * @date 2011-11-09
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hast3.h"
+#include "checksum.h"
+#include "protocol.h"
+#include "util.h"
+
+/* a varint of 32 bits takes at most 5 bytes */
+#define VARINT_MAXLEN	5
+
+/* a slot of the service index, which is probed linearly */
+typedef struct{
+	/* hash of the name, compared before the name itself */
+	uint32_t fingerprint;
+	/* index in the services of Env, -1 for an empty slot */
+	int service;
+} Service_slot;
+
+static Service_slot *service_index = NULL;
+static unsigned service_index_mask = 0;
+
+static int encode_v1(Env *env, const Hast3_packet *pkt, char buf[],
+		size_t size);
+static int encode_v2(Env *env, const Hast3_packet *pkt, unsigned char buf[],
+		size_t size);
+static int encode_v2_parts(Env *env, const Hast3_packet *pkt,
+		unsigned char buf[], size_t size);
+static int services_per_part(Env *env);
+static unsigned find_slot(Env *env, const char *name);
+static int v1_extended(Env *env, int type);
+static int decode_v1(Env *env, const char buf[], int len, Hast3_packet *pkt);
+static int decode_v2(Env *env, const unsigned char buf[], int len,
+		Hast3_packet *pkt);
+static int decode_v2_part(Env *env, const unsigned char *p,
+		const unsigned char *end, Hast3_packet *pkt);
+static int put_varint(unsigned char *p, unsigned value);
+static int get_varint(const unsigned char **p, const unsigned char *end,
+		unsigned *value);
+static void put_u16(unsigned char *p, unsigned short value);
+static unsigned short get_u16(const unsigned char *p);
+
+/**
+ * @brief allocate a packet which holds an entry for every service
+ *
+ * @param env Env struct
+ *
+ * @return address on success and NULL on failure
+ */
+Hast3_packet * alloc_packet(Env *env){
+	Hast3_packet *pkt = (Hast3_packet *)calloc(1, sizeof(Hast3_packet));
+
+	if(pkt == NULL)
+		return NULL;
+	pkt->capacity = env->service_num > 0 ? env->service_num : 1;
+	pkt->data = (Hast3_entry *)calloc(pkt->capacity, sizeof(Hast3_entry));
+	if(pkt->data == NULL){
+		free(pkt);
+		return NULL;
+	}
+	return pkt;
+}
+
+/**
+ * @brief free the packet
+ *
+ * @param pkt pointer to Hast3_packet struct
+ */
+void free_packet(Hast3_packet *pkt){
+	if(pkt == NULL)
+		return;
+	free(pkt->data);
+	free(pkt);
+}
+
+/**
+ * @brief the largest message this node may send
+ *
+ * @param env Env struct
+ *
+ * @return length in bytes
+ */
+size_t max_message_len(Env *env){
+	/* 
+	 * a CMD entry takes the most, plus a byte to pad to even length, and
+	 * the parts of a snapshot may take a datagram more
+	 */
+	if(env->protocol == HAST3_PROTO_V2)
+		return HAST3_V2_HEADER_LEN + VARINT_MAXLEN +
+			(size_t)env->service_num * (VARINT_MAXLEN + 1) + 1 +
+			(size_t)env->max_datagram;
+	return sizeof(Hast3_message_ext) +
+		(size_t)env->service_num * sizeof(Hast3_message_entry);
+}
+
+/**
+ * @brief the most commands which fit in a datagram
+ *
+ * @param env Env struct
+ *
+ * @return number of entries
+ */
+int max_cmd_entries(Env *env){
+	if(env->protocol == HAST3_PROTO_V2)
+		return (env->max_datagram - HAST3_V2_HEADER_LEN - VARINT_MAXLEN - 1) /
+			(VARINT_MAXLEN + 1);
+	return (int)((MAXBUFSIZE - sizeof(Hast3_message)) /
+			sizeof(Hast3_message_entry));
+}
+
+/**
+ * @brief encode the packet in the format of env->protocol and fill the checksum, the sender is always the local node
+ *
+ * @param env Env struct
+ * @param pkt the packet to send
+ * @param buf[] where the message is stored
+ * @param size size of buf
+ *
+ * @return length of the message on success and -1 if buf is too small
+ */
+int encode_message(Env *env, const Hast3_packet *pkt, char buf[], size_t size){
+	if(env->protocol == HAST3_PROTO_V2)
+		return encode_v2(env, pkt, (unsigned char *)buf, size);
+	return encode_v1(env, pkt, buf, size);
+}
+
+/**
+ * @brief decode a message of either format whose checksum is verified, the services unknown to this node are dropped
+ *
+ * @param env Env struct
+ * @param buf[] the message
+ * @param len length of the message
+ * @param pkt where the decoded message is stored
+ *
+ * @return STATUS_OK on success and STATUS_MSG_CORRPUT on failure
+ */
+int decode_message(Env *env, const char buf[], int len, Hast3_packet *pkt){
+	const unsigned char *ubuf = (const unsigned char *)buf;
+
+	/* a v1 message starts with the node name, which is never like this */
+	if(len >= HAST3_V2_HEADER_LEN && ubuf[0] == HAST3_V2_MAGIC0 &&
+			ubuf[1] == HAST3_V2_MAGIC1)
+		return decode_v2(env, ubuf, len, pkt);
+	return decode_v1(env, buf, len, pkt);
+}
+
+/**
+ * @brief index the services by name, called once the services are configured
+ *
+ * @param env Env struct
+ *
+ * @return STATUS_OK on success and STATUS_CNF_ERR on failure or a duplicate name
+ */
+int build_service_index(Env *env){
+	unsigned size = 4, i;
+	int k;
+
+	/* at most half full, so the probes stay short */
+	while(size < (unsigned)env->service_num * 2)
+		size *= 2;
+	free(service_index);
+	service_index = (Service_slot *)malloc(size * sizeof(Service_slot));
+	if(service_index == NULL){
+		fprintf(stderr, "Failed to malloc the service index\n");
+		return STATUS_CNF_ERR;
+	}
+	service_index_mask = size - 1;
+	for(i = 0; i < size; i++)
+		service_index[i].service = -1;
+
+	for(k = 0; k < env->service_num; k++){
+		i = find_slot(env, env->services[k].name);
+		if(service_index[i].service >= 0){
+			fprintf(stderr, "Duplicate service name %s\n",
+					env->services[k].name);
+			return STATUS_CNF_ERR;
+		}
+		service_index[i].fingerprint = hash_name(env->services[k].name);
+		service_index[i].service = k;
+	}
+	return STATUS_OK;
+}
+
+/**
+ * @brief free the service index
+ */
+void free_service_index(){
+	free(service_index);
+	service_index = NULL;
+	service_index_mask = 0;
+}
+
+/**
+ * @brief the slot of the name in the service index, or the empty slot it would be stored in
+ */
+static unsigned find_slot(Env *env, const char *name){
+	uint32_t fingerprint = hash_name(name);
+	unsigned i;
+
+	for(i = fingerprint & service_index_mask; service_index[i].service >= 0;
+			i = (i + 1) & service_index_mask)
+		/* the names are compared only if the whole hashes agree */
+		if(service_index[i].fingerprint == fingerprint &&
+				strncmp(name, env->services[service_index[i].service].name,
+					NAMELEN) == 0)
+			break;
+	return i;
+}
+
+/**
+ * @brief find the service by name
+ *
+ * @param env Env struct
+ * @param name name of the service
+ *
+ * @return the index of the service on success and -1 on failure
+ */
+int find_service(Env *env, const char *name){
+	if(service_index == NULL)
+		return -1;
+	return service_index[find_slot(env, name)].service;
+}
+
+/**
+ * @brief encode the packet as struct Hast3_message
+ *
+ * @param env Env struct
+ * @param pkt the packet to send
+ * @param buf[] where the message is stored
+ * @param size size of buf
+ *
+ * @return length of the message on success and -1 if buf is too small
+ */
+static int encode_v1(Env *env, const Hast3_packet *pkt, char buf[],
+		size_t size){
+	int i;
+	size_t len, header_len;
+	Hast3_message *msg = (Hast3_message *)buf;
+	Hast3_message_entry *data;
+
+	if(v1_extended(env, pkt->type))
+		header_len = sizeof(Hast3_message_ext);
+	else
+		header_len = sizeof(Hast3_message);
+	len = header_len + (size_t)pkt->field_num * sizeof(Hast3_message_entry);
+	if(len > size)
+		return -1;
+
+	memset(msg, 0, header_len);
+	strcpy(msg->nodename, env->nodename);
+	msg->type = pkt->type;
+	msg->field_num = (short)pkt->field_num;
+	if(header_len == sizeof(Hast3_message_ext))
+		((Hast3_message_ext *)buf)->serial = pkt->serial;
+	data = (Hast3_message_entry *)(buf + header_len);
+	for(i = 0; i < pkt->field_num; i++){
+		memset(data[i].service_name, 0, NAMELEN);
+		strcpy(data[i].service_name,
+				env->services[pkt->data[i].service].name);
+		data[i].cmd_or_status = pkt->data[i].cmd_or_status;
+	}
+
+	msg->checksum = checksum(msg, (int)len);
+	return (int)len;
+}
+
+/**
+ * @brief whether a v1 message of the type carries serial
+ *
+ * the BCAST and CMD keep the 22 bytes header the older versions decode, a
+ * BCAST needs its generation only for the DELTA which the older versions
+ * drop anyway
+ *
+ * @param env Env struct
+ * @param type type of the message
+ *
+ * @return 1 for Hast3_message_ext and 0 for Hast3_message
+ */
+static int v1_extended(Env *env, int type){
+	if(type == HAST3_MSG_CMD)
+		return 0;
+	if(type == HAST3_MSG_BCAST)
+		return env->delta_heartbeat;
+	return 1;
+}
+
+/**
+ * @brief encode the packet in the v2 format, a snapshot too large for a datagram is split into parts by encode_v2_parts()
+ *
+ * @param env Env struct
+ * @param pkt the packet to send
+ * @param buf[] where the message is stored
+ * @param size size of buf
+ *
+ * @return length of the message on success and -1 if buf is too small
+ */
+static int encode_v2(Env *env, const Hast3_packet *pkt, unsigned char buf[],
+		size_t size){
+	unsigned char *p;
+	int i, k, count;
+
+	count = pkt->type == HAST3_MSG_BCAST ? env->service_num : pkt->field_num;
+	if(pkt->type == HAST3_MSG_BCAST &&
+			HAST3_V2_HEADER_LEN + VARINT_MAXLEN + (size_t)(count + 3) / 4 + 1 >
+			(size_t)env->max_datagram)
+		return encode_v2_parts(env, pkt, buf, size);
+	if(HAST3_V2_HEADER_LEN + VARINT_MAXLEN +
+			(size_t)count * (VARINT_MAXLEN + 1) + 1 > size)
+		return -1;
+
+	p = put_v2_header(env, pkt->type, pkt->serial, buf, 0);
+	if(pkt->type != HAST3_MSG_SNAPREQ && pkt->type != HAST3_MSG_ACK)
+		p += put_varint(p, (unsigned)count);
+
+	if(pkt->type == HAST3_MSG_BCAST){
+		/* the status of service k goes to the k-th 2 bits */
+		memset(p, 0, (size_t)(count + 3) / 4);
+		for(i = 0; i < pkt->field_num; i++){
+			k = pkt->data[i].service;
+			p[k / 4] |= (unsigned char)
+				((pkt->data[i].cmd_or_status & 3) << (k % 4 * 2));
+		}
+		p += (count + 3) / 4;
+	}
+	else if(pkt->type == HAST3_MSG_DELTA){
+		for(i = 0; i < count; i++)
+			p += put_varint(p, (unsigned)pkt->data[i].service);
+		memset(p, 0, (size_t)(count + 3) / 4);
+		for(i = 0; i < count; i++)
+			p[i / 4] |= (unsigned char)
+				((pkt->data[i].cmd_or_status & 3) << (i % 4 * 2));
+		p += (count + 3) / 4;
+	}
+	else if(pkt->type == HAST3_MSG_CMD){
+		for(i = 0; i < count; i++){
+			p += put_varint(p, (unsigned)pkt->data[i].service);
+			*p++ = (unsigned char)pkt->data[i].cmd_or_status;
+		}
+	}
+
+	return (int)seal_v2_message(env, buf, (size_t)(p - buf));
+}
+
+/**
+ * @brief split a snapshot into parts of max_datagram bytes, each with its own header, the index of the part and the first service in it. All but the last part are padded to max_datagram, so that the whole buffer can be sent with UDP_SEGMENT.
+ *
+ * @param env Env struct
+ * @param pkt the snapshot
+ * @param buf[] where the parts are stored one after another
+ * @param size size of buf
+ *
+ * @return total length of the parts on success and -1 on failure
+ */
+static int encode_v2_parts(Env *env, const Hast3_packet *pkt,
+		unsigned char buf[], size_t size){
+	unsigned char *p, *body[HAST3_V2_MAX_PARTS];
+	int i, k, part, parts, per_part, first, num;
+	size_t len = 0, segment = (size_t)env->max_datagram;
+
+	per_part = services_per_part(env);
+	parts = (env->service_num + per_part - 1) / per_part;
+	if(parts > HAST3_V2_MAX_PARTS || (size_t)parts * segment > size)
+		return -1;
+
+	for(part = 0; part < parts; part++){
+		first = part * per_part;
+		num = env->service_num - first < per_part ?
+			env->service_num - first : per_part;
+
+		p = put_v2_header(env, pkt->type, pkt->serial, buf + part * segment,
+				HAST3_V2_FLAG_PART);
+		p += put_varint(p, (unsigned)part);
+		p += put_varint(p, (unsigned)parts);
+		p += put_varint(p, (unsigned)first);
+		p += put_varint(p, (unsigned)num);
+		body[part] = p;
+		memset(p, 0, (size_t)(num + 3) / 4);
+		len = (size_t)(p - (buf + part * segment)) + (size_t)(num + 3) / 4;
+	}
+
+	/* per_part is a multiple of 4, so a byte never spans two parts */
+	for(i = 0; i < pkt->field_num; i++){
+		k = pkt->data[i].service;
+		part = k / per_part;
+		k %= per_part;
+		body[part][k / 4] |= (unsigned char)
+			((pkt->data[i].cmd_or_status & 3) << (k % 4 * 2));
+	}
+
+	for(part = 0; part < parts - 1; part++){
+		p = buf + part * segment;
+		memset(body[part] + per_part / 4, 0,
+				segment - (size_t)(body[part] + per_part / 4 - p));
+		seal_v2_message(env, p, segment);
+	}
+	len = seal_v2_message(env, buf + (parts - 1) * segment, len);
+
+	return (int)((parts - 1) * segment + len);
+}
+
+/**
+ * @brief the number of services in each part of a snapshot
+ *
+ * @param env Env struct
+ *
+ * @return number of services, a multiple of 4
+ */
+static int services_per_part(Env *env){
+	return (env->max_datagram - HAST3_V2_HEADER_LEN - 4 * VARINT_MAXLEN - 1)
+		* 4;
+}
+
+/**
+ * @brief fill the v2 header except the check
+ *
+ * @param env Env struct
+ * @param type message type
+ * @param serial serial of the message
+ * @param buf[] where the message is stored
+ * @param flags flags other than the check
+ *
+ * @return where the body starts
+ */
+unsigned char * put_v2_header(Env *env, int type, unsigned short serial,
+		unsigned char buf[], int flags){
+	if(env->checksum_mode == HAST3_CHECK_CRC32C)
+		flags |= HAST3_V2_FLAG_CRC32C;
+
+	buf[0] = HAST3_V2_MAGIC0;
+	buf[1] = HAST3_V2_MAGIC1;
+	buf[2] = HAST3_PROTO_V2;
+	buf[3] = (unsigned char)type;
+	buf[4] = (unsigned char)flags;
+	buf[5] = 0;
+	put_u16(buf + 6, (unsigned short)env->node_id);
+	put_u16(buf + 8, serial);
+	memset(buf + HAST3_V2_CHECK_OFFSET, 0, 4);
+	return buf + HAST3_V2_HEADER_LEN;
+}
+
+/**
+ * @brief fill the check of a v2 message
+ *
+ * @param env Env struct
+ * @param buf[] the message
+ * @param len length of the message
+ *
+ * @return length of the message, which may be padded by a byte
+ */
+size_t seal_v2_message(Env *env, unsigned char buf[], size_t len){
+	u_short sum;
+	unsigned crc;
+
+	if(env->checksum_mode == HAST3_CHECK_CRC32C){
+		crc = message_crc32c(buf, len);
+		put_u16(buf + HAST3_V2_CHECK_OFFSET, (unsigned short)(crc >> 16));
+		put_u16(buf + HAST3_V2_CHECK_OFFSET + 2, (unsigned short)crc);
+		return len;
+	}
+
+	/* pad to even length so the checksum is the same on any byte order */
+	if(len % 2 != 0)
+		buf[len++] = 0;
+
+	sum = checksum(buf, (int)len);
+	memcpy(buf + HAST3_V2_CHECK_OFFSET, &sum, sizeof(sum));
+	return len;
+}
+
+/**
+ * @brief decode a message of struct Hast3_message
+ *
+ * @param env Env struct
+ * @param buf[] the message
+ * @param len length of the message
+ * @param pkt where the decoded message is stored
+ *
+ * @return STATUS_OK on success and STATUS_MSG_CORRPUT on failure
+ */
+static int decode_v1(Env *env, const char buf[], int len, Hast3_packet *pkt){
+	const Hast3_message *msg = (const Hast3_message *)buf;
+	const Hast3_message_entry *data;
+	int header_len, entry_len, i, k;
+	char name[NAMELEN];
+
+	/* 
+	 * the legacy header has no serial, the lengths of the two never agree
+	 * since entry_len is even and larger than 2
+	 */
+	entry_len = sizeof(Hast3_message_entry);
+	header_len = sizeof(Hast3_message);
+	if(len < header_len || (len - header_len) % entry_len != 0){
+		header_len = sizeof(Hast3_message_ext);
+		if(len < header_len || (len - header_len) % entry_len != 0)
+			return STATUS_MSG_CORRPUT;
+	}
+	if(msg->field_num < 0 || msg->field_num > (len - header_len) / entry_len)
+		return STATUS_MSG_CORRPUT;
+	data = (const Hast3_message_entry *)(buf + header_len);
+
+	memcpy(pkt->nodename, msg->nodename, NAMELEN);
+	pkt->nodename[NAMELEN-1] = '\0';
+	pkt->type = msg->type;
+	if(header_len == (int)sizeof(Hast3_message_ext))
+		pkt->serial = ((const Hast3_message_ext *)buf)->serial;
+	else
+		pkt->serial = 0;
+	pkt->part = 0;
+	pkt->parts = 1;
+	pkt->field_num = 0;
+
+	name[NAMELEN-1] = '\0';
+	for(i = 0; i < msg->field_num && pkt->field_num < pkt->capacity; i++){
+		memcpy(name, data[i].service_name, NAMELEN - 1);
+		/* the services are usually listed in the same order */
+		if(i < env->service_num && strcmp(name, env->services[i].name) == 0)
+			k = i;
+		else
+			k = find_service(env, name);
+
+		if(k < 0){
+			if(msg->type == HAST3_MSG_CMD)
+				write_log(ERROR, "Unknown service [%s] from node [%s]",
+						name, pkt->nodename);
+			continue;
+		}
+		pkt->data[pkt->field_num].service = k;
+		pkt->data[pkt->field_num].cmd_or_status = data[i].cmd_or_status;
+		pkt->field_num++;
+	}
+
+	return STATUS_OK;
+}
+
+/**
+ * @brief decode a message of the v2 format
+ *
+ * @param env Env struct
+ * @param buf[] the message
+ * @param len length of the message
+ * @param pkt where the decoded message is stored
+ *
+ * @return STATUS_OK on success and STATUS_MSG_CORRPUT on failure
+ */
+static int decode_v2(Env *env, const unsigned char buf[], int len,
+		Hast3_packet *pkt){
+	const unsigned char *p = buf + HAST3_V2_HEADER_LEN, *end = buf + len;
+	unsigned node_id, count, id, i;
+	Hast3_entry *entry;
+
+	if(buf[2] != HAST3_PROTO_V2)
+		return STATUS_MSG_CORRPUT;
+
+	node_id = get_u16(buf + 6);
+	if(node_id == 0 || node_id > (unsigned)env->cluster_size){
+		if(debug_level > 0)
+			write_log(DEBUG, "Drop message from unknown node id %u", node_id);
+		return STATUS_MSG_CORRPUT;
+	}
+	strcpy(pkt->nodename, env->cluster_nodes[node_id-1]);
+	pkt->type = (short)buf[3];
+	pkt->serial = get_u16(buf + 8);
+	pkt->part = 0;
+	pkt->parts = 1;
+	pkt->field_num = 0;
+
+	if(pkt->type == HAST3_MSG_SNAPREQ || pkt->type == HAST3_MSG_ACK)
+		return STATUS_OK;
+	if(buf[4] & HAST3_V2_FLAG_PART)
+		return decode_v2_part(env, p, end, pkt);
+	if(get_varint(&p, end, &count) != 0 || count > (unsigned)len * 4)
+		return STATUS_MSG_CORRPUT;
+
+	if(pkt->type == HAST3_MSG_BCAST){
+		if(end - p < (long)(count + 3) / 4)
+			return STATUS_MSG_CORRPUT;
+		/* the services beyond ours are dropped */
+		for(i = 0; i < count && i < (unsigned)pkt->capacity; i++){
+			entry = &pkt->data[pkt->field_num++];
+			entry->service = (int)i;
+			entry->cmd_or_status = (short)((p[i / 4] >> (i % 4 * 2)) & 3);
+		}
+	}
+	else if(pkt->type == HAST3_MSG_DELTA){
+		/* keep the position of each known id to find its status */
+		for(i = 0; i < count; i++){
+			if(get_varint(&p, end, &id) != 0)
+				return STATUS_MSG_CORRPUT;
+			if(id >= (unsigned)env->service_num ||
+					pkt->field_num >= pkt->capacity)
+				continue;
+			entry = &pkt->data[pkt->field_num++];
+			entry->service = (int)id;
+			entry->cmd_or_status = (short)i;
+		}
+		if(end - p < (long)(count + 3) / 4)
+			return STATUS_MSG_CORRPUT;
+		for(i = 0; i < (unsigned)pkt->field_num; i++){
+			entry = &pkt->data[i];
+			entry->cmd_or_status = (short)((p[entry->cmd_or_status / 4] >>
+						(entry->cmd_or_status % 4 * 2)) & 3);
+		}
+	}
+	else if(pkt->type == HAST3_MSG_CMD){
+		for(i = 0; i < count; i++){
+			if(get_varint(&p, end, &id) != 0 || p >= end)
+				return STATUS_MSG_CORRPUT;
+			if(id >= (unsigned)env->service_num){
+				write_log(ERROR, "Unknown service id %u from node [%s]",
+						id, pkt->nodename);
+				p++;
+				continue;
+			}
+			if(pkt->field_num >= pkt->capacity)
+				break;
+			entry = &pkt->data[pkt->field_num++];
+			entry->service = (int)id;
+			entry->cmd_or_status = (short)*p++;
+		}
+	}
+
+	return STATUS_OK;
+}
+
+/**
+ * @brief decode the body of a part of a snapshot, the entries keep the ids of the whole snapshot
+ *
+ * @param env Env struct
+ * @param p start of the body
+ * @param end end of the message
+ * @param pkt where the decoded part is stored, the header is already filled
+ *
+ * @return STATUS_OK on success and STATUS_MSG_CORRPUT on failure
+ */
+static int decode_v2_part(Env *env, const unsigned char *p,
+		const unsigned char *end, Hast3_packet *pkt){
+	unsigned part, parts, first, count, i;
+	Hast3_entry *entry;
+
+	if(pkt->type != HAST3_MSG_BCAST)
+		return STATUS_MSG_CORRPUT;
+	if(get_varint(&p, end, &part) != 0 || get_varint(&p, end, &parts) != 0 ||
+			get_varint(&p, end, &first) != 0 ||
+			get_varint(&p, end, &count) != 0)
+		return STATUS_MSG_CORRPUT;
+	if(parts == 0 || parts > HAST3_V2_MAX_PARTS || part >= parts ||
+			end - p < (long)(count + 3) / 4)
+		return STATUS_MSG_CORRPUT;
+
+	pkt->part = (int)part;
+	pkt->parts = (int)parts;
+	/* the services beyond ours are dropped */
+	for(i = 0; i < count && first + i < (unsigned)env->service_num &&
+			pkt->field_num < pkt->capacity; i++){
+		entry = &pkt->data[pkt->field_num++];
+		entry->service = (int)(first + i);
+		entry->cmd_or_status = (short)((p[i / 4] >> (i % 4 * 2)) & 3);
+	}
+
+	return STATUS_OK;
+}
+
+/**
+ * @brief store an unsigned integer as a varint, 7 bits per byte with the high bit set on all but the last byte
+ *
+ * @param p where the varint is stored, at least VARINT_MAXLEN bytes
+ * @param value the integer
+ *
+ * @return number of bytes stored
+ */
+static int put_varint(unsigned char *p, unsigned value){
+	int n = 0;
+
+	while(value >= 0x80){
+		p[n++] = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	p[n++] = (unsigned char)value;
+	return n;
+}
+
+/**
+ * @brief read a varint and advance the pointer
+ *
+ * @param p pointer to the varint
+ * @param end end of the message
+ * @param value where the integer is stored
+ *
+ * @return 0 on success and -1 if the varint is truncated or too long
+ */
+static int get_varint(const unsigned char **p, const unsigned char *end,
+		unsigned *value){
+	int shift;
+	const unsigned char *q = *p;
+
+	*value = 0;
+	for(shift = 0; shift < VARINT_MAXLEN * 7 && q < end; shift += 7){
+		*value |= (unsigned)(*q & 0x7f) << shift;
+		if((*q++ & 0x80) == 0){
+			*p = q;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/**
+ * @brief store a 16 bits integer in network byte order
+ *
+ * @param p where the integer is stored
+ * @param value the integer
+ */
+static void put_u16(unsigned char *p, unsigned short value){
+	p[0] = (unsigned char)(value >> 8);
+	p[1] = (unsigned char)value;
+}
+
+/**
+ * @brief read a 16 bits integer in network byte order
+ *
+ * @param p pointer to the integer
+ *
+ * @return the integer
+ */
+static unsigned short get_u16(const unsigned char *p){
+	return (unsigned short)(p[0] << 8 | p[1]);
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+#ifndef _PROTOCOL_H_
+#define _PROTOCOL_H_
+
+#include <sys/types.h>
+
+#include "hast3.h"
+
+#define HAST3_PROTO_V1	1
+#define HAST3_PROTO_V2	2
+
+/* 
+ * The v2 header, all in network byte order:
+ *   0  magic, 2 bytes
+ *   2  version
+ *   3  message type
+ *   4  flags
+ *   5  reserved
+ *   6  node id of the sender, 2 bytes
+ *   8  serial, 2 bytes
+ *  10  check, 4 bytes, the CRC32C of the rest of the message if the
+ *      HAST3_V2_FLAG_CRC32C flag is set, otherwise the 16 bits checksum
+ *      which makes the ones' complement sum of the message 0
+ * The body starts with a varint entry count. The statuses of BCAST are
+ * packed 2 bits per service in the order of the service ids, DELTA carries
+ * the varint ids of the changed services and then their packed statuses,
+ * CMD carries a varint id and a command byte per entry. SNAPREQ and ACK
+ * have no body.
+ * A BCAST longer than MaxDatagram is split into parts with the
+ * HAST3_V2_FLAG_PART flag set, whose body is the varint part index, part
+ * count, first service id and entry count followed by the packed statuses
+ * of the services from the first one. All the parts of a snapshot carry
+ * the same serial and all but the last are MaxDatagram bytes long.
+ */
+#define HAST3_V2_MAGIC0	0xA3
+#define HAST3_V2_MAGIC1	0x33
+#define HAST3_V2_HEADER_LEN	14
+#define HAST3_V2_CHECK_OFFSET	10
+#define HAST3_V2_FLAG_CRC32C	0x01
+#define HAST3_V2_FLAG_PART	0x02
+#define HAST3_V2_MAX_PARTS	64
+/* fits an Ethernet frame with the IP and UDP headers */
+#define DEFAULT_MAX_DATAGRAM	1400
+#define HAST3_MIN_DATAGRAM	256
+#define HAST3_MAX_NODE_ID	65535
+
+Hast3_packet * alloc_packet(Env *env);
+void free_packet(Hast3_packet *pkt);
+size_t max_message_len(Env *env);
+int max_cmd_entries(Env *env);
+int encode_message(Env *env, const Hast3_packet *pkt, char buf[], size_t size);
+int decode_message(Env *env, const char buf[], int len, Hast3_packet *pkt);
+int build_service_index(Env *env);
+void free_service_index();
+int find_service(Env *env, const char *name);
+unsigned char * put_v2_header(Env *env, int type, unsigned short serial,
+		unsigned char buf[], int flags);
+size_t seal_v2_message(Env *env, unsigned char buf[], size_t len);
+
+#endif
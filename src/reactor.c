@@ -0,0 +1,151 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file reactor.c
+ * @brief the event loop of the main process, every fd it waits for is registered with its handler on a single epoll instance
+ * @author Li Jiliang<tjulijiliang@gmail.com
+ * @version 1.0
+ * @date 2011-11-09
+ */
+
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "hast3.h"
+#include "log.h"
+#include "reactor.h"
+
+typedef struct{
+	int fd;
+	Event_func func;
+} Event_source;
+
+static int epoll_fd = -1;
+static Event_source sources[REACTOR_MAX_SOURCES];
+static int source_num = 0;
+
+/**
+ * @brief create the epoll instance
+ *
+ * @return STATUS_OK on success and STATUS_SVR_ERR on failure
+ */
+int init_reactor(){
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(epoll_fd == -1){
+		write_log(ERROR, "Cannot create the epoll instance");
+		return STATUS_SVR_ERR;
+	}
+	source_num = 0;
+	return STATUS_OK;
+}
+
+/**
+ * @brief wait for fd to become readable and call func on it
+ *
+ * @param fd the fd
+ * @param func the handler, which should consume what's readable since the events are level triggered
+ *
+ * @return STATUS_OK on success and STATUS_SVR_ERR on failure
+ */
+int add_event_source(int fd, Event_func func){
+	struct epoll_event event;
+
+	if(source_num >= REACTOR_MAX_SOURCES){
+		write_log(ERROR, "Too many event sources");
+		return STATUS_SVR_ERR;
+	}
+
+	sources[source_num].fd = fd;
+	sources[source_num].func = func;
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1){
+		write_log(ERROR, "Cannot add fd %d to the epoll instance", fd);
+		return STATUS_SVR_ERR;
+	}
+	source_num++;
+	return STATUS_OK;
+}
+
+/**
+ * @brief stop waiting for fd, which is not closed
+ *
+ * @param fd the fd
+ *
+ * @return STATUS_OK on success and STATUS_SVR_ERR if fd is not a source
+ */
+int del_event_source(int fd){
+	int i;
+
+	for(i = 0; i < source_num; i++)
+		if(sources[i].fd == fd){
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+			sources[i] = sources[--source_num];
+			return STATUS_OK;
+		}
+	return STATUS_SVR_ERR;
+}
+
+/**
+ * @brief wait for the sources and call the handlers of the readable ones
+ *
+ * @param timeout seconds to wait at most, -1 to wait for an event however long it takes
+ *
+ * @return number of events handled, 0 on timeout or interruption and -1 on failure
+ */
+int wait_events(double timeout){
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	int n, i, j, ms;
+
+	/* rounded up, so that the deadline is due when it returns */
+	if(timeout < 0)
+		ms = -1;
+	else if(timeout > INT_MAX / 1000)
+		ms = INT_MAX;
+	else
+		ms = (int)ceil(timeout * 1000);
+
+	n = epoll_wait(epoll_fd, events, REACTOR_MAX_EVENTS, ms);
+	if(n == -1){
+		if(errno == EINTR)
+			return 0;
+		write_log(ERROR, "Failed to wait for the events");
+		return -1;
+	}
+
+	for(i = 0; i < n; i++)
+		for(j = 0; j < source_num; j++)
+			if(sources[j].fd == events[i].data.fd){
+				sources[j].func(sources[j].fd);
+				break;
+			}
+	return n;
+}
+
+/**
+ * @brief close the epoll instance, the sources are left to their owners
+ */
+void close_reactor(){
+	if(epoll_fd != -1)
+		close(epoll_fd);
+	epoll_fd = -1;
+	source_num = 0;
+}
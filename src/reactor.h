@@ -0,0 +1,45 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file reactor.h
+ * @brief 
+ * @author Li Jiliang<tjulijiliang@gmail.com
+ * @version 1.0
+ * @date 2011-11-09
+ */
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include "hast3.h"
+
+/* the heartbeat socket, the timer, the signals and some to spare */
+#define REACTOR_MAX_SOURCES	16
+/* events handled by a single epoll_wait() */
+#define REACTOR_MAX_EVENTS	16
+
+/* called when fd is readable */
+typedef void (*Event_func)(int fd);
+
+int init_reactor();
+int add_event_source(int fd, Event_func func);
+int del_event_source(int fd);
+int wait_events(double timeout);
+void close_reactor();
+
+#endif
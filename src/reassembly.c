@@ -0,0 +1,174 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/**
+ * @file reassembly.c
+ * @brief reassemble the snapshots sent in parts, so that the status table is only updated by a whole snapshot
+ * @author Li Jiliang<tjulijiliang@gmail.com
+ * @version 1.0
+ * @date 2011-11-09
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hast3.h"
+#include "log.h"
+#include "protocol.h"
+#include "reassembly.h"
+#include "util.h"
+
+/* a snapshot being reassembled */
+typedef struct{
+	char nodename[NAMELEN];
+	unsigned short serial;
+	int parts;
+	int received;
+	/* bit k is set once part k is received */
+	uint64_t got;
+	/* monotonic time the first part arrived */
+	double started_at;
+	int in_use;
+	Hast3_packet *pkt;
+} Reassembly_slot;
+
+static Reassembly_slot slots[REASSEMBLY_SLOTS];
+
+static Reassembly_slot * find_slot(Env *env, const Hast3_packet *part,
+		double now);
+
+/**
+ * @brief add a part of a snapshot to the reassembly table
+ *
+ * @param env Env struct
+ * @param part the decoded part
+ *
+ * @return the whole snapshot once its last part arrives, which stays valid until the next call, and NULL otherwise
+ */
+Hast3_packet * reassemble_packet(Env *env, const Hast3_packet *part){
+	Reassembly_slot *slot;
+	Hast3_packet *pkt;
+	double now = monotonic_time();
+
+	slot = find_slot(env, part, now);
+	if(slot == NULL)
+		return NULL;
+	if(slot->parts != part->parts){
+		write_log(WARN, "Part count of snapshot %u from node [%s] changes",
+				part->serial, part->nodename);
+		slot->in_use = 0;
+		return NULL;
+	}
+	/* a duplicated part */
+	if(slot->got & ((uint64_t)1 << part->part))
+		return NULL;
+
+	/* the parts carry disjoint ranges of services, never more than ours */
+	pkt = slot->pkt;
+	if(pkt->field_num + part->field_num > pkt->capacity){
+		slot->in_use = 0;
+		return NULL;
+	}
+	memcpy(pkt->data + pkt->field_num, part->data,
+			part->field_num * sizeof(Hast3_entry));
+	pkt->field_num += part->field_num;
+	slot->got |= (uint64_t)1 << part->part;
+	slot->received++;
+
+	if(slot->received < slot->parts)
+		return NULL;
+
+	slot->in_use = 0;
+	return pkt;
+}
+
+/**
+ * @brief free the reassembly table
+ */
+void free_reassembly(){
+	int i;
+
+	for(i = 0; i < REASSEMBLY_SLOTS; i++){
+		free_packet(slots[i].pkt);
+		slots[i].pkt = NULL;
+		slots[i].in_use = 0;
+	}
+}
+
+/**
+ * @brief find the slot of the snapshot or take one for it. A newer snapshot of the same node replaces the older one, and the expired or else the oldest slot is taken when the table is full.
+ *
+ * @param env Env struct
+ * @param part the decoded part
+ * @param now current monotonic time
+ *
+ * @return address of the slot on success and NULL on failure
+ */
+static Reassembly_slot * find_slot(Env *env, const Hast3_packet *part,
+		double now){
+	Reassembly_slot *slot, *victim = NULL;
+	int i;
+
+	for(i = 0; i < REASSEMBLY_SLOTS; i++){
+		slot = &slots[i];
+		if(slot->in_use && slot->started_at + 2 * env->ha_interval < now)
+			slot->in_use = 0;
+		if(slot->in_use && strcmp(slot->nodename, part->nodename) == 0){
+			if(slot->serial == part->serial)
+				return slot;
+			/* the node only sends one snapshot at a time */
+			if(debug_level > 0)
+				write_log(DEBUG, "Snapshot %u from node [%s] is incomplete, "
+						"%d of %d parts", slot->serial, slot->nodename,
+						slot->received, slot->parts);
+			slot->in_use = 0;
+		}
+		/* a free slot, or else the oldest one */
+		if(victim == NULL || (victim->in_use && (!slot->in_use ||
+						slot->started_at < victim->started_at)))
+			victim = slot;
+	}
+
+	if(victim->in_use)
+		write_log(WARN, "Reassembly table is full, drop snapshot %u "
+				"from node [%s]", victim->serial, victim->nodename);
+	if(victim->pkt == NULL){
+		victim->pkt = alloc_packet(env);
+		if(victim->pkt == NULL)
+			return NULL;
+	}
+
+	strcpy(victim->nodename, part->nodename);
+	victim->serial = part->serial;
+	victim->parts = part->parts;
+	victim->received = 0;
+	victim->got = 0;
+	victim->started_at = now;
+	victim->in_use = 1;
+
+	strcpy(victim->pkt->nodename, part->nodename);
+	victim->pkt->type = part->type;
+	victim->pkt->serial = part->serial;
+	victim->pkt->part = 0;
+	victim->pkt->parts = 1;
+	victim->pkt->field_num = 0;
+	return victim;
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+#ifndef _REASSEMBLY_H_
+#define _REASSEMBLY_H_
+
+#include "hast3.h"
+
+/* the snapshots of so many nodes are reassembled at the same time */
+#define REASSEMBLY_SLOTS	8
+
+Hast3_packet * reassemble_packet(Env *env, const Hast3_packet *part);
+void free_reassembly();
+
+#endif
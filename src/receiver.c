@@ -0,0 +1,245 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file receiver.c
+ * @brief the receiver thread, which drains the socket, checks and decodes the messages and reassembles the snapshots, then hands them over to the decision thread, so a busy decision thread never leaves the heartbeats unread
+ * @author Li Jiliang<tjulijiliang@gmail.com
+ * @version 1.0
+ * @date 2011-11-09
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "hast3.h"
+#include "log.h"
+#include "communicate.h"
+#include "protocol.h"
+#include "reassembly.h"
+#include "gossip.h"
+#include "ring.h"
+#include "receiver.h"
+
+static void * receiver_main(void *arg);
+static void receive_messages(Env *env, Recv_batch *batch);
+static void copy_packet(Hast3_packet *dst, const Hast3_packet *src);
+
+static Ring inbound;
+static pthread_t receiver_thread;
+static int receiver_started = 0;
+/* tells the decision thread there are messages in the ring */
+static int wake_fd = -1;
+/* tells the receiver thread to exit */
+static int stop_fd = -1;
+
+/**
+ * @brief allocate the ring and start the receiver thread, the signals should be blocked already
+ *
+ * @param env Env struct
+ *
+ * @return STATUS_OK on success and STATUS_SVR_ERR on failure
+ */
+int start_receiver(Env *env){
+	Inbound *in;
+	unsigned i;
+
+	if(init_ring(&inbound, INBOUND_RING_SIZE, sizeof(Inbound)) != 0)
+		return STATUS_SVR_ERR;
+	for(i = 0; i < INBOUND_RING_SIZE; i++){
+		in = (Inbound *)inbound.slots + i;
+		in->pkt = alloc_packet(env);
+		if(in->pkt == NULL)
+			return STATUS_SVR_ERR;
+	}
+
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	stop_fd = eventfd(0, EFD_CLOEXEC);
+	if(wake_fd < 0 || stop_fd < 0)
+		return STATUS_SVR_ERR;
+
+	if(pthread_create(&receiver_thread, NULL, receiver_main, env) != 0)
+		return STATUS_SVR_ERR;
+	receiver_started = 1;
+	return STATUS_OK;
+}
+
+/**
+ * @brief stop the receiver thread and free the ring
+ */
+void stop_receiver(){
+	uint64_t one = 1;
+	unsigned i;
+
+	if(receiver_started){
+		if(write(stop_fd, &one, sizeof(one)) == sizeof(one))
+			pthread_join(receiver_thread, NULL);
+		receiver_started = 0;
+	}
+	if(inbound.slots != NULL){
+		for(i = 0; i <= inbound.mask; i++)
+			free_packet(((Inbound *)inbound.slots + i)->pkt);
+		free_ring(&inbound);
+	}
+	if(wake_fd >= 0)
+		close(wake_fd);
+	if(stop_fd >= 0)
+		close(stop_fd);
+	wake_fd = stop_fd = -1;
+}
+
+/**
+ * @brief the fd which becomes readable when there are messages for the decision thread
+ *
+ * @return the eventfd
+ */
+int receiver_fd(){
+	return wake_fd;
+}
+
+/**
+ * @brief the oldest message handed over, called by the decision thread
+ *
+ * @return pointer to the message, which is valid till release_inbound(), NULL if there is none
+ */
+Inbound * next_inbound(){
+	return (Inbound *)ring_front(&inbound);
+}
+
+/**
+ * @brief give the message returned by next_inbound() back to the receiver thread
+ */
+void release_inbound(){
+	ring_pop(&inbound);
+}
+
+/**
+ * @brief wait for the messages till told to exit
+ *
+ * @param arg Env struct
+ *
+ * @return NULL
+ */
+static void * receiver_main(void *arg){
+	Env *env = (Env *)arg;
+	Recv_batch *batch;
+	struct pollfd fds[2];
+
+	batch = (Recv_batch *)malloc(sizeof(Recv_batch));
+	if(batch == NULL){
+		write_log(ERROR, "Failed to malloc the message buffer");
+		return NULL;
+	}
+
+	fds[0].fd = env->server_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = stop_fd;
+	fds[1].events = POLLIN;
+	for(;;){
+		if(poll(fds, 2, -1) < 0){
+			if(errno == EINTR)
+				continue;
+			write_log(ERROR, "Receiver thread failed to poll the socket");
+			break;
+		}
+		if(fds[1].revents)
+			break;
+		if(fds[0].revents)
+			receive_messages(env, batch);
+	}
+
+	free(batch);
+	return NULL;
+}
+
+/**
+ * @brief drain the socket and hand the valid messages over, the ones which find the ring full are dropped
+ *
+ * @param env Env struct
+ * @param batch the receive buffer
+ */
+static void receive_messages(Env *env, Recv_batch *batch){
+	Inbound *in;
+	Hast3_packet *whole;
+	uint64_t one = 1;
+	int i, n, handed = 0;
+
+	/* a full batch means more may be waiting */
+	do{
+		n = get_and_check_messages(env, batch);
+		for(i = 0; i < n; i++){
+			if(batch->len[i] < 0)
+				continue;
+			in = (Inbound *)ring_back(&inbound);
+			if(in == NULL){
+				__atomic_fetch_add(&env->queue_dropped, 1, __ATOMIC_RELAXED);
+				continue;
+			}
+
+			if(env->transport == HAST3_TRANSPORT_GOSSIP &&
+					is_gossip_message(batch->buf[i], batch->len[i])){
+				in->kind = INBOUND_GOSSIP;
+				in->len = batch->len[i];
+				memcpy(in->buf, batch->buf[i], batch->len[i]);
+			}
+			else if(decode_message(env, batch->buf[i], batch->len[i],
+						in->pkt) == STATUS_OK){
+				/* a snapshot in parts is handed over once it's whole */
+				if(in->pkt->parts > 1){
+					whole = reassemble_packet(env, in->pkt);
+					if(whole == NULL)
+						continue;
+					copy_packet(in->pkt, whole);
+				}
+				in->kind = INBOUND_PACKET;
+			}
+			else
+				continue;
+
+			in->from = batch->from[i];
+			ring_push(&inbound);
+			handed++;
+		}
+	} while(n == RECV_BATCH);
+
+	if(handed > 0 && write(wake_fd, &one, sizeof(one)) != sizeof(one) &&
+			errno != EAGAIN)
+		write_log(ERROR, "Failed to wake up the decision thread");
+}
+
+/**
+ * @brief copy a packet into another one of the same capacity
+ *
+ * @param dst the packet copied to
+ * @param src the packet copied from
+ */
+static void copy_packet(Hast3_packet *dst, const Hast3_packet *src){
+	Hast3_entry *data = dst->data;
+	int capacity = dst->capacity;
+
+	*dst = *src;
+	dst->data = data;
+	dst->capacity = capacity;
+	memcpy(dst->data, src->data, src->field_num * sizeof(Hast3_entry));
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file receiver.h
+ * @brief 
+ * @author Li Jiliang<tjulijiliang@gmail.com
+ * @version 1.0
+ * @date 2011-11-09
+ */
+#ifndef _RECEIVER_H_
+#define _RECEIVER_H_
+
+#include <netinet/in.h>
+
+#include "hast3.h"
+
+/* the messages waiting for the decision thread */
+#define INBOUND_RING_SIZE	128
+
+/* a decoded message, or a gossip datagram which is decoded by its handler */
+#define INBOUND_PACKET	0
+#define INBOUND_GOSSIP	1
+
+typedef struct{
+	int kind;
+	struct sockaddr_in from;
+	/* the decoded message, a whole snapshot if it was sent in parts */
+	Hast3_packet *pkt;
+	int len;
+	char buf[MAXBUFSIZE];
+} Inbound;
+
+int start_receiver(Env *env);
+void stop_receiver();
+int receiver_fd();
+Inbound * next_inbound();
+void release_inbound();
+
+#endif
@@ -0,0 +1,279 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/**
+ * @file reliable.c
+ * @brief the commands are retransmitted until the receiver acknowledges them, the receiver runs a command only once however many copies arrive
+ * @author Li Jiliang<tjulijiliang@gmail.com
+ * @version 1.0
+ * @date 2011-11-09
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hast3.h"
+#include "protocol.h"
+#include "reliable.h"
+#include "util.h"
+
+#define CMD_TABLE_RESIZE	8
+
+/* a command waiting for its ACK */
+typedef struct{
+	char node[NAMELEN];
+	unsigned short seq;
+	int retries;
+	double deadline;
+	struct sockaddr_in addr;
+	char *msg;
+	size_t msglen;
+	int in_use;
+} Pending_cmd;
+
+/* the commands received from a node, bit i of mask is the seq highest - i */
+typedef struct{
+	char node[NAMELEN];
+	unsigned short highest;
+	uint64_t mask;
+} Cmd_window;
+
+static Pending_cmd *pending = NULL;
+static int pending_cap = 0;
+static Cmd_window *windows = NULL;
+static int window_num = 0;
+static int window_cap = 0;
+static unsigned short cmd_seq = 0;
+
+static double cmd_timeout(Env *env, int retries);
+
+/**
+ * @brief the sequence number of the next command sent by this node, never 0 which marks the commands of the old versions
+ *
+ * @return sequence number
+ */
+unsigned short next_cmd_seq(){
+	/* start somewhere else after a restart, not to look like a retransmit */
+	if(cmd_seq == 0)
+		cmd_seq = (unsigned short)(getpid() ^ (unsigned)(monotonic_time() * 1000));
+	if(++cmd_seq == 0)
+		cmd_seq = 1;
+	return cmd_seq;
+}
+
+/**
+ * @brief keep a copy of a command just sent, to retransmit it if no ACK comes in time
+ *
+ * @param env Env struct
+ * @param node name of the receiving node
+ * @param seq sequence number of the command
+ * @param msg encoded message
+ * @param msglen length of the message
+ * @param addr address of the node
+ *
+ * @return 0 on success and -1 on failure
+ */
+int track_cmd(Env *env, const char *node, unsigned short seq,
+		const char *msg, size_t msglen, const struct sockaddr_in *addr){
+	Pending_cmd *cmd = NULL, *tmp;
+	int i;
+
+	for(i = 0; i < pending_cap; i++)
+		if(!pending[i].in_use){
+			cmd = &pending[i];
+			break;
+		}
+
+	if(cmd == NULL){
+		tmp = realloc(pending,
+				(pending_cap + CMD_TABLE_RESIZE) * sizeof(Pending_cmd));
+		if(tmp == NULL)
+			return -1;
+		memset(tmp + pending_cap, 0, CMD_TABLE_RESIZE * sizeof(Pending_cmd));
+		pending = tmp;
+		cmd = &pending[pending_cap];
+		pending_cap += CMD_TABLE_RESIZE;
+	}
+
+	/* the buffers are kept for reuse */
+	if(cmd->msg == NULL){
+		cmd->msg = (char *)malloc(max_message_len(env));
+		if(cmd->msg == NULL)
+			return -1;
+	}
+
+	strcpy(cmd->node, node);
+	cmd->seq = seq;
+	cmd->retries = 0;
+	cmd->deadline = monotonic_time() + cmd_timeout(env, 0);
+	cmd->addr = *addr;
+	memcpy(cmd->msg, msg, msglen);
+	cmd->msglen = msglen;
+	cmd->in_use = 1;
+	return 0;
+}
+
+/**
+ * @brief the node has acknowledged the command, stop retransmitting it
+ *
+ * @param node name of the node
+ * @param seq sequence number of the command
+ *
+ * @return 0 if the command was waiting and -1 if not
+ */
+int ack_cmd(const char *node, unsigned short seq){
+	int i;
+
+	for(i = 0; i < pending_cap; i++)
+		if(pending[i].in_use && pending[i].seq == seq &&
+				strcmp(pending[i].node, node) == 0){
+			pending[i].in_use = 0;
+			return 0;
+		}
+	return -1;
+}
+
+/**
+ * @brief the time to wait for the next retransmission
+ *
+ * @return seconds from now, 0 if it's due, -1 if no command is waiting
+ */
+double next_retransmit(){
+	int i;
+	double deadline = -1, now;
+
+	for(i = 0; i < pending_cap; i++)
+		if(pending[i].in_use &&
+				(deadline < 0 || pending[i].deadline < deadline))
+			deadline = pending[i].deadline;
+	if(deadline < 0)
+		return -1;
+
+	now = monotonic_time();
+	return deadline > now ? deadline - now : 0;
+}
+
+/**
+ * @brief retransmit the commands whose ACK is overdue with the timeout doubled each time, and give up after cmd_retries
+ *
+ * @param env Env struct
+ *
+ * @return number of commands retransmitted
+ */
+int retransmit_cmds(Env *env){
+	int i, num = 0;
+	double now = monotonic_time();
+	Pending_cmd *cmd;
+
+	for(i = 0; i < pending_cap; i++){
+		cmd = &pending[i];
+		if(!cmd->in_use || cmd->deadline > now)
+			continue;
+
+		if(cmd->retries >= env->cmd_retries){
+			/* routine_check() sends it again if it's still needed */
+			write_log(WARN, "No ACK from node [%s] for CMD %u, give up",
+					cmd->node, cmd->seq);
+			cmd->in_use = 0;
+			continue;
+		}
+
+		cmd->retries++;
+		cmd->deadline = now + cmd_timeout(env, cmd->retries);
+		sendto(env->cmd_fd, cmd->msg, cmd->msglen, 0,
+				(struct sockaddr *)&cmd->addr, sizeof(cmd->addr));
+		if(debug_level > 0)
+			write_log(DEBUG, "Retransmit CMD %u to node [%s]",
+					cmd->seq, cmd->node);
+		num++;
+	}
+	return num;
+}
+
+/**
+ * @brief check whether the command has been received before, and remember it if not
+ *
+ * @param node name of the sending node
+ * @param seq sequence number of the command
+ *
+ * @return 1 if it's a duplicate and 0 if not
+ */
+int seen_cmd(const char *node, unsigned short seq){
+	int i;
+	short diff;
+	Cmd_window *win = NULL, *tmp;
+
+	for(i = 0; i < window_num; i++)
+		if(strcmp(windows[i].node, node) == 0){
+			win = &windows[i];
+			break;
+		}
+
+	if(win == NULL){
+		if(window_num >= window_cap){
+			tmp = realloc(windows,
+					(window_cap + CMD_TABLE_RESIZE) * sizeof(Cmd_window));
+			if(tmp == NULL)
+				return 0;
+			windows = tmp;
+			window_cap += CMD_TABLE_RESIZE;
+		}
+		win = &windows[window_num++];
+		strcpy(win->node, node);
+		win->highest = seq;
+		win->mask = 1;
+		return 0;
+	}
+
+	diff = (short)(seq - win->highest);
+	if(diff > 0){
+		win->mask = diff >= CMD_WINDOW ? 0 : win->mask << diff;
+		win->mask |= 1;
+		win->highest = seq;
+		return 0;
+	}
+	if(-diff < CMD_WINDOW){
+		if(win->mask & ((uint64_t)1 << -diff))
+			return 1;
+		win->mask |= (uint64_t)1 << -diff;
+		return 0;
+	}
+
+	/* far behind, the sender must have restarted */
+	win->highest = seq;
+	win->mask = 1;
+	return 0;
+}
+
+/**
+ * @brief the time to wait for the ACK
+ *
+ * @param env Env struct
+ * @param retries times the command has been retransmitted
+ *
+ * @return seconds
+ */
+static double cmd_timeout(Env *env, int retries){
+	return env->cmd_timeout * (1 << retries);
+}
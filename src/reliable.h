@@ -0,0 +1,40 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+#ifndef _RELIABLE_H_
+#define _RELIABLE_H_
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "hast3.h"
+
+#define DEFAULT_CMD_TIMEOUT	0.2
+#define DEFAULT_CMD_RETRIES	5
+/* the commands of a node remembered to drop the retransmits */
+#define CMD_WINDOW	64
+
+unsigned short next_cmd_seq();
+int track_cmd(Env *env, const char *node, unsigned short seq,
+		const char *msg, size_t msglen, const struct sockaddr_in *addr);
+int ack_cmd(const char *node, unsigned short seq);
+double next_retransmit();
+int retransmit_cmds(Env *env);
+int seen_cmd(const char *node, unsigned short seq);
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file ring.c
+ * @brief lock-free single producer single consumer ring, the producer and the consumer only publish their own index with release semantics and read the other one with acquire semantics
+ * @author Li Jiliang<tjulijiliang@gmail.com
+ * @version 1.0
+ * @date 2011-11-09
+ */
+
+#include <stdlib.h>
+
+#include "ring.h"
+
+/**
+ * @brief allocate the slots of the ring
+ *
+ * @param ring Ring struct
+ * @param size number of slots, a power of 2
+ * @param elem_size size of a slot
+ *
+ * @return 0 on success and 1 on failure
+ */
+int init_ring(Ring *ring, unsigned size, size_t elem_size){
+	if(size == 0 || (size & (size - 1)) != 0)
+		return 1;
+	ring->slots = (unsigned char *)calloc(size, elem_size);
+	if(ring->slots == NULL)
+		return 1;
+	ring->mask = size - 1;
+	ring->elem_size = elem_size;
+	ring->head = 0;
+	ring->tail = 0;
+	return 0;
+}
+
+/**
+ * @brief free the slots of the ring
+ *
+ * @param ring Ring struct
+ */
+void free_ring(Ring *ring){
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+/**
+ * @brief the slot to be filled next, called by the producer
+ *
+ * @param ring Ring struct
+ *
+ * @return pointer to the slot, NULL if the ring is full
+ */
+void * ring_back(Ring *ring){
+	unsigned tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+	if(tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > ring->mask)
+		return NULL;
+	return ring->slots + (size_t)(tail & ring->mask) * ring->elem_size;
+}
+
+/**
+ * @brief hand the slot returned by ring_back() over to the consumer
+ *
+ * @param ring Ring struct
+ */
+void ring_push(Ring *ring){
+	unsigned tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief the oldest slot handed over, called by the consumer
+ *
+ * @param ring Ring struct
+ *
+ * @return pointer to the slot, NULL if the ring is empty
+ */
+void * ring_front(Ring *ring){
+	unsigned head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+	if(head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return ring->slots + (size_t)(head & ring->mask) * ring->elem_size;
+}
+
+/**
+ * @brief give the slot returned by ring_front() back to the producer
+ *
+ * @param ring Ring struct
+ */
+void ring_pop(Ring *ring){
+	unsigned head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file ring.h
+ * @brief 
+ * @author Li Jiliang<tjulijiliang@gmail.com
+ * @version 1.0
+ * @date 2011-11-09
+ */
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stddef.h>
+
+#define CACHE_LINE	64
+
+/* 
+ * a single producer single consumer queue, the slots are filled and read
+ * in place and only the indices are handed over
+ */
+typedef struct{
+	unsigned mask;
+	size_t elem_size;
+	unsigned char *slots;
+	/* written by the producer only */
+	unsigned tail __attribute__((aligned(CACHE_LINE)));
+	/* written by the consumer only */
+	unsigned head __attribute__((aligned(CACHE_LINE)));
+} Ring;
+
+int init_ring(Ring *ring, unsigned size, size_t elem_size);
+void free_ring(Ring *ring);
+void * ring_back(Ring *ring);
+void ring_push(Ring *ring);
+void * ring_front(Ring *ring);
+void ring_pop(Ring *ring);
+
+#endif
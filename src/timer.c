@@ -0,0 +1,193 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file timer.c
+ * @brief hierarchical timer wheel, a timer is added, re-armed and deleted in O(1) and the far ones are cascaded down a level at a time as the wheel turns
+ * @author Li Jiliang<tjulijiliang@gmail.com
+ * @version 1.0
+ * @date 2011-11-09
+ */
+
+#include <string.h>
+
+#include "timer.h"
+
+#define TIMER_MASK	(TIMER_SLOTS - 1)
+#define TIMER_RANGE	(1ULL << (TIMER_LEVEL_BITS * TIMER_LEVELS))
+
+static void enqueue_timer(Timer_wheel *wheel, Timer *timer);
+static void cascade_timers(Timer_wheel *wheel, int level, int index);
+
+/**
+ * @brief initialize an empty wheel
+ *
+ * @param wheel Timer_wheel struct
+ * @param now_ns current monotonic time in nanoseconds
+ */
+void init_timer_wheel(Timer_wheel *wheel, uint64_t now_ns){
+	memset(wheel, 0, sizeof(Timer_wheel));
+	wheel->now = now_ns / TIMER_TICK_NS;
+}
+
+/**
+ * @brief arm the timer, or re-arm it if it's pending
+ *
+ * @param wheel Timer_wheel struct
+ * @param timer the timer, whose data is kept
+ * @param expires_ns monotonic time in nanoseconds, the timer never fires before it
+ */
+void add_timer(Timer_wheel *wheel, Timer *timer, uint64_t expires_ns){
+	del_timer(wheel, timer);
+	timer->expires = (expires_ns + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+	enqueue_timer(wheel, timer);
+	wheel->pending++;
+}
+
+/**
+ * @brief disarm the timer, nothing is done if it's not pending
+ *
+ * @param wheel Timer_wheel struct
+ * @param timer the timer
+ */
+void del_timer(Timer_wheel *wheel, Timer *timer){
+	if(timer->pprev == NULL)
+		return;
+	*timer->pprev = timer->next;
+	if(timer->next != NULL)
+		timer->next->pprev = timer->pprev;
+	timer->next = NULL;
+	timer->pprev = NULL;
+	wheel->pending--;
+}
+
+/**
+ * @brief turn the wheel up to now and take the timers expired
+ *
+ * @param wheel Timer_wheel struct
+ * @param now_ns current monotonic time in nanoseconds
+ *
+ * @return the expired timers linked by their next, no longer pending, NULL if none
+ */
+Timer * expire_timers(Timer_wheel *wheel, uint64_t now_ns){
+	uint64_t target = now_ns / TIMER_TICK_NS;
+	Timer *expired = NULL, **tail = &expired, *timer;
+	int level, index;
+
+	while(wheel->now <= target){
+		/* nothing to cascade or fire on the way */
+		if(wheel->pending == 0){
+			wheel->now = target + 1;
+			break;
+		}
+
+		/* the timers of a level come down when the level below wraps */
+		index = wheel->now & TIMER_MASK;
+		for(level = 1; index == 0 && level < TIMER_LEVELS; level++){
+			index = (wheel->now >> (TIMER_LEVEL_BITS * level)) & TIMER_MASK;
+			cascade_timers(wheel, level, index);
+		}
+
+		while((timer = wheel->slots[0][wheel->now & TIMER_MASK]) != NULL){
+			del_timer(wheel, timer);
+			*tail = timer;
+			tail = &timer->next;
+		}
+		wheel->now++;
+	}
+	return expired;
+}
+
+/**
+ * @brief the earliest time a timer may expire, a far timer is reported at the time it's cascaded
+ *
+ * @param wheel Timer_wheel struct
+ *
+ * @return monotonic time in nanoseconds, never later than the next expiry, -1 if no timer is pending
+ */
+int64_t next_timer(const Timer_wheel *wheel){
+	uint64_t base, tick, next = 0;
+	int level, index, d;
+
+	if(wheel->pending == 0)
+		return -1;
+
+	for(level = 0; level < TIMER_LEVELS; level++){
+		base = wheel->now >> (TIMER_LEVEL_BITS * level);
+		index = base & TIMER_MASK;
+		/* the current slot of a higher level was cascaded, it's a round ahead */
+		for(d = level == 0 ? 0 : 1; d <= TIMER_SLOTS; d++)
+			if(wheel->slots[level][(index + d) & TIMER_MASK] != NULL)
+				break;
+		if(d > TIMER_SLOTS)
+			continue;
+		tick = (base + d) << (TIMER_LEVEL_BITS * level);
+		if(next == 0 || tick < next)
+			next = tick;
+	}
+	return (int64_t)(next * TIMER_TICK_NS);
+}
+
+/**
+ * @brief put the timer into the slot of its level, the farther it expires the higher the level
+ *
+ * @param wheel Timer_wheel struct
+ * @param timer the timer, not pending
+ */
+static void enqueue_timer(Timer_wheel *wheel, Timer *timer){
+	uint64_t expires = timer->expires, delta;
+	Timer **slot;
+	int level;
+
+	if(expires < wheel->now)
+		expires = wheel->now;
+	delta = expires - wheel->now;
+	/* beyond the range, parked at the farthest slot and cascaded again */
+	if(delta >= TIMER_RANGE){
+		delta = TIMER_RANGE - 1;
+		expires = wheel->now + delta;
+	}
+	for(level = 0; level < TIMER_LEVELS - 1; level++)
+		if(delta < 1ULL << (TIMER_LEVEL_BITS * (level + 1)))
+			break;
+
+	slot = &wheel->slots[level][(expires >> (TIMER_LEVEL_BITS * level)) &
+		TIMER_MASK];
+	timer->next = *slot;
+	if(timer->next != NULL)
+		timer->next->pprev = &timer->next;
+	timer->pprev = slot;
+	*slot = timer;
+}
+
+/**
+ * @brief move the timers of a slot down to the lower levels
+ *
+ * @param wheel Timer_wheel struct
+ * @param level level of the slot
+ * @param index index of the slot
+ */
+static void cascade_timers(Timer_wheel *wheel, int level, int index){
+	Timer *timer = wheel->slots[level][index], *next;
+
+	wheel->slots[level][index] = NULL;
+	for(; timer != NULL; timer = next){
+		next = timer->next;
+		enqueue_timer(wheel, timer);
+	}
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file timer.h
+ * @brief 
+ * @author Li Jiliang<tjulijiliang@gmail.com
+ * @version 1.0
+ * @date 2011-11-09
+ */
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <stdint.h>
+
+/* resolution of the wheel */
+#define TIMER_TICK_NS	1000000ULL
+/* 4 levels of 64 slots cover 2^24 ticks, about 4.6 hours */
+#define TIMER_LEVEL_BITS	6
+#define TIMER_SLOTS	(1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS	4
+
+typedef struct Timer{
+	struct Timer *next;
+	/* the pointer to this timer in its slot, NULL while not pending */
+	struct Timer **pprev;
+	/* the tick it expires at */
+	uint64_t expires;
+	void *data;
+} Timer;
+
+typedef struct{
+	Timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+	/* the next tick to be processed */
+	uint64_t now;
+	int pending;
+} Timer_wheel;
+
+void init_timer_wheel(Timer_wheel *wheel, uint64_t now_ns);
+void add_timer(Timer_wheel *wheel, Timer *timer, uint64_t expires_ns);
+void del_timer(Timer_wheel *wheel, Timer *timer);
+Timer * expire_timers(Timer_wheel *wheel, uint64_t now_ns);
+int64_t next_timer(const Timer_wheel *wheel);
+
+#endif
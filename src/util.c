@@ -27,33 +27,318 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <signal.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
 
 #include "hast3.h"
 #include "log.h"
+#include "util.h"
+#include "proc.h"
+
+extern char **environ;
+
+/* characters which make a command line need /bin/sh */
+#define SHELL_META_CHARS	"|&;<>()$`\\\"'*?[#~\n"
+
+/* words which only make sense to the shell */
+static const char *shell_words[] = {
+	"exit", "cd", "export", "set", "unset", "ulimit", "umask", "exec", ".",
+	"source", "eval", "if", "for", "while", "until", "case", "!", "{",
+	NULL
+};
+
+/* the spawn attributes without and with a new process group */
+static posix_spawnattr_t spawnattrs[2];
+static pthread_once_t spawnattrs_once = PTHREAD_ONCE_INIT;
+
+static void init_spawnattrs();
+static posix_spawnattr_t *get_spawnattr(int new_group);
+static pid_t spawn_with(const Command *cmd, int new_group);
+
+/**
+ * @brief tokenize the command line into argv, commands which need the shell syntax are marked to use /bin/sh
+ *
+ * @param cmd where the result is stored
+ * @param line command line
+ *
+ * @return 0 if the command can be executed directly, 1 if it needs the shell and -1 if it's an unknown builtin probe
+ */
+int parse_command(Command *cmd, const char *line){
+	int argc = 0, i;
+	char *p, *word, *saveptr;
+
+	strncpy(cmd->line, line, MAXSTRLEN - 1);
+	cmd->line[MAXSTRLEN - 1] = '\0';
+	strcpy(cmd->words, cmd->line);
+	cmd->argv[0] = NULL;
+	cmd->use_shell = 1;
+	cmd->builtin = Builtin_None;
+
+	/* builtin:process:<name> or builtin:pidfile:<path> */
+	if(strncmp(cmd->line, BUILTIN_PREFIX, strlen(BUILTIN_PREFIX)) == 0){
+		p = cmd->line + strlen(BUILTIN_PREFIX);
+		if(strncmp(p, BUILTIN_PROCESS, strlen(BUILTIN_PROCESS)) == 0)
+			cmd->builtin = Builtin_Process;
+		else if(strncmp(p, BUILTIN_PIDFILE, strlen(BUILTIN_PIDFILE)) == 0)
+			cmd->builtin = Builtin_Pidfile;
+		else
+			return -1;
+
+		strcpy(cmd->words, strchr(p, ':') + 1);
+		if(cmd->words[0] == '\0')
+			return -1;
+		cmd->argv[0] = cmd->words;
+		cmd->argv[1] = NULL;
+		cmd->use_shell = 0;
+		return 0;
+	}
+
+	if(strpbrk(cmd->line, SHELL_META_CHARS) != NULL)
+		return 1;
+
+	for(p = cmd->words; ; p = NULL){
+		word = strtok_r(p, " \t", &saveptr);
+		if(word == NULL)
+			break;
+		/* too many arguments, leave it to the shell */
+		if(argc >= MAXCMDARGS)
+			return 1;
+		cmd->argv[argc++] = word;
+	}
+	cmd->argv[argc] = NULL;
+
+	/* an empty command or a variable assignment */
+	if(argc == 0 || strchr(cmd->argv[0], '=') != NULL)
+		return 1;
+	for(i = 0; shell_words[i] != NULL; i++)
+		if(strcmp(cmd->argv[0], shell_words[i]) == 0)
+			return 1;
+
+	cmd->use_shell = 0;
+	return 0;
+}
+
+/**
+ * @brief start the command without waiting for it, the daemon is not copied since posix_spawn(3) uses vfork semantics
+ *
+ * @param cmd command
+ *
+ * @return pid of the child on success and -1 on failure
+ */
+pid_t spawn_command(const Command *cmd){
+	return spawn_with(cmd, 0);
+}
+
+/**
+ * @brief start the command as the leader of a new process group, so that it can be killed with all its children
+ *
+ * @param cmd command
+ *
+ * @return pid of the child, which is the process group id as well, on success and -1 on failure
+ */
+pid_t spawn_command_group(const Command *cmd){
+	return spawn_with(cmd, 1);
+}
 
 /**
- * @brief wrap of the system(3)
+ * @brief start the command without waiting for it
  *
  * @param cmd command
+ * @param new_group 1 to put the child into a new process group
+ *
+ * @return pid of the child on success and -1 on failure
+ */
+static pid_t spawn_with(const Command *cmd, int new_group){
+	static char sh_name[] = "sh", sh_flag[] = "-c";
+	pid_t pid;
+	int error;
+	char line[MAXSTRLEN];
+	char *sh_argv[] = {sh_name, sh_flag, line, NULL};
+
+	if(cmd->builtin != Builtin_None){
+		errno = EINVAL;
+		return -1;
+	}
+
+	if(cmd->use_shell){
+		/* posix_spawn() takes the arguments as non-const */
+		strcpy(line, cmd->line);
+		error = posix_spawn(&pid, "/bin/sh", NULL, get_spawnattr(new_group),
+				sh_argv, environ);
+	}
+	else
+		error = posix_spawnp(&pid, cmd->argv[0], NULL, get_spawnattr(new_group),
+				cmd->argv, environ);
+
+	if(error != 0){
+		errno = error;
+		return -1;
+	}
+	return pid;
+}
+
+/**
+ * @brief wait for the child started by spawn_command()
+ *
+ * @param pid pid of the child
  *
  * @return -1 on failure, real exit code on success
  */
-int wrap_system(const char* cmd){
+int wait_command(pid_t pid){
 	int status;
 
+	while(waitpid(pid, &status, 0) == -1)
+		if(errno != EINTR)
+			return -1;
+
+	if(!WIFEXITED(status))
+		return -1;
+	return WEXITSTATUS(status);
+}
+
+/**
+ * @brief wrap of the pidfd_open(2) system call, a fd which becomes readable when the process exits
+ *
+ * @param pid pid of the process
+ *
+ * @return the pidfd on success, -1 on failure or if the kernel doesn't support it
+ */
+int open_pidfd(pid_t pid){
+#ifdef SYS_pidfd_open
+	return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/**
+ * @brief run the command and wait for it
+ *
+ * @param cmd command
+ *
+ * @return -1 on failure, real exit code on success
+ */
+int run_command(const Command *cmd){
+	int status;
+	pid_t pid;
+
+	if(cmd->builtin != Builtin_None)
+		return builtin_probe(cmd);
+
 	errno = 0;
-	status = system(cmd);
-	if(status == -1){
+	pid = spawn_command(cmd);
+	if(pid == -1){
 		write_log(ERROR, "Failed to execute [%s] with error message:%s",
-				cmd, strerror(errno));
+				cmd->line, strerror(errno));
 		return -1;
 	}
 
-	status = WEXITSTATUS(status);
+	status = wait_command(pid);
 	if(debug_level > 2)
-		write_log(DEBUG, "Exit code of [%s] is %d, with error:%s",
-				cmd, status, strerror(errno));
+		write_log(DEBUG, "Exit code of [%s] is %d", cmd->line, status);
 
 	return status;
 }
+
+/**
+ * @brief run a command line which is not known at config time
+ *
+ * @param cmd command
+ *
+ * @return -1 on failure, real exit code on success
+ */
+int wrap_system(const char* cmd){
+	Command command;
+
+	parse_command(&command, cmd);
+	return run_command(&command);
+}
+
+/**
+ * @brief the attributes of the spawned children, initialized once for all the threads which spawn
+ *
+ * @param new_group 1 for the attributes which put the child into a new process group
+ *
+ * @return pointer to the attributes
+ */
+static posix_spawnattr_t *get_spawnattr(int new_group){
+	pthread_once(&spawnattrs_once, init_spawnattrs);
+	return &spawnattrs[new_group != 0];
+}
+
+/**
+ * @brief initialize the attributes of the spawned children, signals ignored or blocked by hast3 are restored
+ */
+static void init_spawnattrs(){
+	sigset_t sigdefault, sigmask;
+	short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+	int i;
+
+	sigemptyset(&sigmask);
+	sigemptyset(&sigdefault);
+	sigaddset(&sigdefault, SIGINT);
+	sigaddset(&sigdefault, SIGQUIT);
+	sigaddset(&sigdefault, SIGTTIN);
+	sigaddset(&sigdefault, SIGTTOU);
+	sigaddset(&sigdefault, SIGPIPE);
+	sigaddset(&sigdefault, SIGCHLD);
+
+	for(i = 0; i < 2; i++){
+		posix_spawnattr_init(&spawnattrs[i]);
+		posix_spawnattr_setsigmask(&spawnattrs[i], &sigmask);
+		posix_spawnattr_setsigdefault(&spawnattrs[i], &sigdefault);
+		posix_spawnattr_setflags(&spawnattrs[i], flags);
+	}
+	/* the group id 0 makes the child the leader of its own group */
+	posix_spawnattr_setpgroup(&spawnattrs[1], 0);
+	posix_spawnattr_setflags(&spawnattrs[1], POSIX_SPAWN_SETSIGMASK |
+			POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+}
+
+/**
+ * @brief current time of CLOCK_MONOTONIC, which is not affected by the wall clock being stepped
+ *
+ * @return time in seconds
+ */
+double monotonic_time(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+/**
+ * @brief current time of CLOCK_MONOTONIC in nanoseconds, exact where the double of monotonic_time() rounds
+ *
+ * @return time in nanoseconds
+ */
+uint64_t monotonic_ns(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief FNV-1a hash of a node or service name
+ *
+ * @param name the name, at most NAMELEN bytes are hashed
+ *
+ * @return the hash
+ */
+uint32_t hash_name(const char *name){
+	uint32_t h = 2166136261u;
+	int i;
+
+	for(i = 0; i < NAMELEN && name[i] != '\0'; i++){
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
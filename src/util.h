@@ -19,6 +19,20 @@
 #ifndef _UTIL_H_
 #define _UTIL_H_
 
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "hast3.h"
+
+int parse_command(Command *cmd, const char *line);
+pid_t spawn_command(const Command *cmd);
+pid_t spawn_command_group(const Command *cmd);
+int wait_command(pid_t pid);
+int open_pidfd(pid_t pid);
+int run_command(const Command *cmd);
 int wrap_system(const char* cmd);
+double monotonic_time();
+uint64_t monotonic_ns();
+uint32_t hash_name(const char *name);
 
 #endif
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C)
+ * 2011 - Jiliang Li(tjulijiliang@gmail.com)
+ * This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/**
+ * @file watch.c
+ * @brief watch the processes of the services with pidfd, so that the collect process learns of their exit at once
+ * @author Li Jiliang<tjulijiliang@gmail.com
+ * @version 1.0
+ * @date 2011-11-09
+ */
+
+#include <sys/types.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "hast3.h"
+#include "proc.h"
+#include "watch.h"
+#include "util.h"
+
+/* pidfd of each service, -1 if it's not watched */
+static int *pidfds = NULL;
+/* the services being watched, in the same order as pollfds */
+static int *watched = NULL;
+/* the last pollfd is reserved for the heartbeat timer */
+static struct pollfd *pollfds = NULL;
+static int watch_num = 0;
+/* cleared once the kernel turns out not to support pidfd */
+static int pidfd_supported = 1;
+
+static void unwatch(int service_index);
+
+/**
+ * @brief allocate the watch table
+ *
+ * @param env Env struct
+ *
+ * @return STATUS_OK on success and STATUS_CLECT_ERR on failure
+ */
+int init_watches(Env *env){
+	int i;
+
+	pidfds = (int *)calloc(env->service_num, sizeof(int));
+	watched = (int *)calloc(env->service_num, sizeof(int));
+	pollfds = (struct pollfd *)calloc(env->service_num + 1,
+			sizeof(struct pollfd));
+	if(pidfds == NULL || watched == NULL || pollfds == NULL)
+		return STATUS_CLECT_ERR;
+
+	for(i = 0; i < env->service_num; i++)
+		pidfds[i] = -1;
+	return STATUS_OK;
+}
+
+/**
+ * @brief start watching the builtin probed services just found running, and stop watching those found stopped
+ *
+ * @param env Env struct
+ * @param due[] the services probed in this cycle
+ * @param results[] exit code of the state commands
+ *
+ * @return number of the services being watched
+ */
+int update_watches(Env *env, const int due[], const int results[]){
+	int i;
+	pid_t pid;
+
+	if(!env->watch_pid || !pidfd_supported)
+		return 0;
+
+	for(i = 0; i < env->service_num; i++){
+		if(!due[i] || env->services[i].statecmd.builtin == Builtin_None)
+			continue;
+
+		if(results[i] != 0){
+			unwatch(i);
+			continue;
+		}
+		if(pidfds[i] != -1)
+			continue;
+
+		pid = service_pid(env, i);
+		if(pid <= 0)
+			continue;
+		pidfds[i] = open_pidfd(pid);
+		if(pidfds[i] == -1){
+			if(errno == ENOSYS)
+				pidfd_supported = 0;
+			continue;
+		}
+
+		watched[watch_num] = i;
+		pollfds[watch_num].fd = pidfds[i];
+		pollfds[watch_num].events = POLLIN;
+		watch_num++;
+	}
+
+	return watch_num;
+}
+
+/**
+ * @brief sleep until the heartbeat timer expires or some watched process exits
+ *
+ * @param env Env struct
+ * @param tick_fd the heartbeat timerfd
+ * @param results[] set to 1 for the services whose process has exited
+ *
+ * @return number of the services whose process has exited
+ */
+int wait_for_exits(Env *env, int tick_fd, int results[]){
+	int i, ready, exited = 0;
+
+	pollfds[watch_num].fd = tick_fd;
+	pollfds[watch_num].events = POLLIN;
+	pollfds[watch_num].revents = 0;
+
+	ready = poll(pollfds, watch_num + 1, -1);
+	if(ready <= 0)
+		return 0;
+
+	for(i = watch_num - 1; i >= 0; i--){
+		if(pollfds[i].revents == 0)
+			continue;
+		results[watched[i]] = 1;
+		/* have it probed again on the next cycle at full rate */
+		env->services[watched[i]].probe_now = 1;
+		unwatch(watched[i]);
+		exited++;
+	}
+
+	return exited;
+}
+
+/**
+ * @brief stop watching the service
+ *
+ * @param service_index the index of the service
+ */
+static void unwatch(int service_index){
+	int i;
+
+	if(pidfds[service_index] == -1)
+		return;
+
+	for(i = 0; i < watch_num; i++)
+		if(watched[i] == service_index)
+			break;
+	/* keep pollfds dense by moving the last one here */
+	watch_num--;
+	watched[i] = watched[watch_num];
+	pollfds[i] = pollfds[watch_num];
+
+	close(pidfds[service_index]);
+	pidfds[service_index] = -1;
+}